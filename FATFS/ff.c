@@ -5249,6 +5249,63 @@ FRESULT f_forward (
 }
 #endif /* FF_USE_FORWARD */
 
+
+#if FF_USE_MMAP
+/*-----------------------------------------------------------------------*/
+/* Get a Pointer to the File Data in Memory Mapped Media                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_mmap (
+	FIL* fp,			/* Pointer to the file object */
+	const void** ptr,	/* Pointer to the variable to return the address of the file data */
+	FSIZE_t* len		/* Pointer to the variable to return the number of bytes mapped */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, ncl, n;
+	DMMAP mm;
+
+
+	*ptr = 0; *len = 0;
+#if !FF_FS_READONLY
+	if (fp->flag & FA_MODIFIED) {		/* Write back the file first */
+		res = f_sync(fp);
+		if (res != FR_OK) return res;
+	}
+#endif
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED);
+	if (fp->obj.objsize == 0) LEAVE_FF(fs, FR_OK);	/* Nothing to map */
+
+	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	ncl = (DWORD)((fp->obj.objsize - 1) / n) + 1;	/* Number of clusters the data occupies */
+#if FF_FS_EXFAT
+	if (fp->obj.stat != 2)	/* The chain is known contiguous on the exFAT volume */
+#endif
+	{
+		for (clst = fp->obj.sclust; --ncl; clst++) {	/* Check if the cluster chain is contiguous */
+			n = get_fat(&fp->obj, clst);
+			if (n == 1) ABORT(fs, FR_INT_ERR);
+			if (n == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+			if (n != clst + 1) LEAVE_FF(fs, FR_DENIED);	/* Fragmented file */
+		}
+	}
+#if !FF_FS_READONLY
+	if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);	/* Data may still be in the drive's write cache */
+#endif
+	mm.sector = clst2sect(fs, fp->obj.sclust);
+	mm.count = (LBA_t)((fp->obj.objsize + SS(fs) - 1) / SS(fs));
+	if (disk_ioctl(fs->pdrv, CTRL_MMAP, &mm) != RES_OK || !mm.addr) LEAVE_FF(fs, FR_DENIED);	/* Not memory mapped */
+	*ptr = mm.addr;
+	*len = fp->obj.objsize;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+#endif /* FF_USE_MMAP */
+
 #if !FF_FS_READONLY && FF_USE_MKFS
 /*-----------------------------------------------------------------------*/
 /* Create FAT/exFAT volume (with sub-functions)                          */
@@ -5444,7 +5501,8 @@ FRESULT f_mkfs (
 	ss = FF_MAX_SS;
 #endif
 	/* Options for FAT sub-type and FAT parameters */
-	fsopt = opt->fmt & (FM_ANY | FM_SFD);
+	fsopt = opt->fmt & (FM_ANY | FM_SFD | FM_ERASE);
+	if (sz_blk == 1 || sz_blk > 128) fsopt &= ~FM_ERASE;	/* Nothing to align, or the block is larger than any FAT cluster */
 	n_fat = (opt->n_fat >= 1 && opt->n_fat <= 2) ? opt->n_fat : 1;
 	n_root = (opt->n_root >= 1 && opt->n_root <= 32768 && (opt->n_root % (ss / SZDIRE)) == 0) ? opt->n_root : 512;
 	sz_au = (opt->au_size <= 0x1000000 && (opt->au_size & (opt->au_size - 1)) == 0) ? opt->au_size : 0;
@@ -5706,6 +5764,7 @@ FRESULT f_mkfs (
 				if (pau == 0) {	/* AU auto-selection */
 					n = (DWORD)sz_vol / 0x20000;	/* Volume size in unit of 128KS */
 					for (i = 0, pau = 1; cst32[i] && cst32[i] <= n; i++, pau <<= 1) ;	/* Get from table */
+					if ((fsopt & FM_ERASE) && pau < sz_blk) pau = sz_blk;	/* A cluster covers whole erase blocks */
 				}
 				n_clst = (DWORD)sz_vol / pau;	/* Number of clusters */
 				sz_fat = (n_clst * 4 + 8 + ss - 1) / ss;	/* FAT size [sector] */
@@ -5716,6 +5775,7 @@ FRESULT f_mkfs (
 				if (pau == 0) {	/* au auto-selection */
 					n = (DWORD)sz_vol / 0x1000;	/* Volume size in unit of 4KS */
 					for (i = 0, pau = 1; cst[i] && cst[i] <= n; i++, pau <<= 1) ;	/* Get from table */
+					if ((fsopt & FM_ERASE) && pau < sz_blk) pau = sz_blk;	/* A cluster covers whole erase blocks */
 				}
 				n_clst = (DWORD)sz_vol / pau;
 				if (n_clst > MAX_FAT12) {
@@ -5728,6 +5788,12 @@ FRESULT f_mkfs (
 				sz_rsv = 1;						/* Number of reserved sectors */
 				sz_dir = (DWORD)n_root * SZDIRE / ss;	/* Root dir size [sector] */
 			}
+			if (fsopt & FM_ERASE) {	/* Start FAT and root dir on erase block boundaries and fill whole blocks */
+				sz_rsv += (DWORD)((sz_blk - (b_vol + sz_rsv) % sz_blk) % sz_blk);
+				sz_fat = (sz_fat + sz_blk - 1) & ~(sz_blk - 1);
+				sz_dir = (sz_dir + sz_blk - 1) & ~(sz_blk - 1);
+				if (fsty != FS_FAT32) n_root = (UINT)(sz_dir * ss / SZDIRE);
+			}
 			b_fat = b_vol + sz_rsv;						/* FAT base */
 			b_data = b_fat + sz_fat * n_fat + sz_dir;	/* Data base */
 
@@ -5747,7 +5813,7 @@ FRESULT f_mkfs (
 			n_clst = ((DWORD)sz_vol - sz_rsv - sz_fat * n_fat - sz_dir) / pau;
 			if (fsty == FS_FAT32) {
 				if (n_clst <= MAX_FAT16) {	/* Too few clusters for FAT32? */
-					if (sz_au == 0 && (sz_au = pau / 2) != 0) continue;	/* Adjust cluster size and retry */
+					if (sz_au == 0 && (sz_au = pau / 2) != 0 && (!(fsopt & FM_ERASE) || sz_au >= sz_blk)) continue;	/* Adjust cluster size and retry, not below the erase block */
 					LEAVE_MKFS(FR_MKFS_ABORTED);
 				}
 			}
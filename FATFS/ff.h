@@ -243,7 +243,7 @@ typedef struct {
 /* Format parameter structure (MKFS_PARM) */
 
 typedef struct {
-	BYTE fmt;			/* Format option (FM_FAT, FM_FAT32, FM_EXFAT and FM_SFD) */
+	BYTE fmt;			/* Format option (FM_FAT, FM_FAT32, FM_EXFAT, FM_SFD and FM_ERASE) */
 	BYTE n_fat;			/* Number of FATs */
 	UINT align;			/* Data area alignment (sector) */
 	UINT n_root;		/* Number of root directory entries */
@@ -304,6 +304,7 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_mmap (FIL* fp, const void** ptr, FSIZE_t* len);			/* Get a pointer to the data of a contiguous file on memory mapped media */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const LBA_t ptbl[], void* work);		/* Divide a physical drive into some partitions */
@@ -370,6 +371,7 @@ int ff_del_syncobj (FF_SYNC_t sobj);	/* Delete a sync object */
 #define FM_EXFAT	0x04
 #define FM_ANY		0x07
 #define FM_SFD		0x08
+#define FM_ERASE	0x10	/* Align FAT, root directory and clusters to the erase block (FAT/FAT32) */
 
 /* Filesystem type (FATFS.fs_type) */
 #define FS_FAT12	1
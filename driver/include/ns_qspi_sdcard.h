@@ -42,6 +42,33 @@ extern uint8_t SD_TYPE;
 #define DUMMY_BYTE                 0xFF 
 #define MSD_BLOCKSIZE             512
 
+/* Highest SCK the board layout supports for the SD socket, in Hz */
+#ifndef SD_SPI_BOARD_MAX_CLK
+#define SD_SPI_BOARD_MAX_CLK      25000000
+#endif
+/* SCKDIV used for card identification (must stay below 400kHz) */
+#define SD_SPI_INIT_PRESCALER     QSPI_SCKDIV_PRESCALER_64
+/* Check the CRC16 trailing every data block read from the card */
+#ifndef SD_SPI_DATA_CRC_CHECK
+#define SD_SPI_DATA_CRC_CHECK     1
+#endif
+/* Polling limits, counted in bytes clocked on the bus */
+#define SD_SPI_RESP_RETRY         16
+#define SD_SPI_TOKEN_RETRY        0x000FFFFF
+#define SD_SPI_BUSY_RETRY         0x00FFFFFF
+/* Repeats of a failed transfer in SD_ReadDiskRetry/SD_WriteDiskRetry, all
+ * but the first one clock step slower */
+#ifndef SD_SPI_RETRIES
+#define SD_SPI_RETRIES            3
+#endif
+/* Clean transfers before a stepped down clock goes one step back up */
+#ifndef SD_SPI_STEP_UP_RUN
+#define SD_SPI_STEP_UP_RUN        64
+#endif
+/* Work done by one SD_JobPoll call: data bytes moved / wait bytes polled */
+#define SD_JOB_CHUNK              64
+#define SD_JOB_POLL_BYTES         8
+
 #define CMD0    0
 #define CMD1    1
 #define CMD8    8
@@ -54,7 +81,13 @@ extern uint8_t SD_TYPE;
 #define CMD23   23
 #define CMD24   24
 #define CMD25   25
+#define CMD32   32
+#define CMD33   33
+#define CMD35   35
+#define CMD36   36
+#define CMD38   38
 #define CMD41   41
+#define CMD51   51
 #define CMD55   55
 #define CMD58   58
 #define CMD59   59
@@ -152,17 +185,82 @@ MSD_CARDINFO, *PMSD_CARDINFO;
 
 extern MSD_CARDINFO SD0_CardInfo;
 
+typedef struct                 /* Optional commands of the card, read by SD_init */
+{
+    uint8_t  SdSpec;               /* SCR SD_SPEC, 0 on MMC */
+    uint8_t  SetBlockCount;        /* CMD23 ends CMD18 reads, no CMD12 needed */
+}
+MSD_CAPS;
+
+extern MSD_CAPS SD0_Caps;
+
+/* Errors of SD_ReadDisk/SD_WriteDisk and the jobs behind them */
+#define SD_ERR_TIMEOUT            1     /* No response, data token or end of busy in time */
+#define SD_ERR_CRC                2     /* Data CRC wrong, or the card saw a CRC error */
+#define SD_ERR_CMD                3     /* Card rejected the command or the data, e.g. address error */
+#define SD_ERR_BUSY               4     /* Another job owns the bus, nothing was sent */
+
+typedef enum
+{
+    SD_JOB_IDLE = 0,
+    SD_JOB_BUSY,
+    SD_JOB_DONE,
+    SD_JOB_ERROR,
+} SD_JobStatus;
+
+typedef struct                 /* Clock changes of SD_ReadDiskRetry/SD_WriteDiskRetry */
+{
+    uint32_t StepDowns;
+    uint32_t StepUps;
+}
+SD_SpeedStatTypeDef;
+
+extern SD_SpeedStatTypeDef SD_SpeedStat;
+
+typedef struct                 /* Sector read/write job advanced by SD_JobPoll */
+{
+    QSPI_TypeDef *QSPIx;
+    uint8_t  *buf;                 /* Current data block */
+    uint32_t addr;                 /* Card address (block or byte, per SD_TYPE) */
+    uint8_t  cnt;                  /* Total blocks */
+    uint8_t  preset;               /* CMD23 set the block count, the read ends without CMD12 */
+    uint8_t  left;                 /* Blocks still to transfer */
+    uint8_t  write;                /* 1: write job, 0: read job */
+    uint8_t  state;                /* Internal state */
+    uint8_t  next;                 /* State entered after the R1 response */
+    uint8_t  cmd;                  /* Command in flight */
+    uint32_t arg;                  /* Argument of the command in flight */
+    uint16_t pos;                  /* Byte offset in the current block */
+    uint32_t retry;                /* Remaining wait budget of the current state */
+    uint8_t  err;                  /* 0 ok or SD_ERR_* */
+    SD_JobStatus status;
+}
+SD_JobTypeDef;
+
 uint8_t         SD_init(QSPI_TypeDef* QSPIx);
 void            SD_CS(QSPI_TypeDef* QSPIx, uint8_t p);
 uint32_t        SD_GetSectorCount(QSPI_TypeDef* QSPIx);
 uint8_t         SD_GETCID (QSPI_TypeDef* QSPIx, uint8_t *cid_data);
 uint8_t         SD_GETCSD(QSPI_TypeDef* QSPIx, uint8_t *csd_data);
+uint8_t         SD_GETSCR(QSPI_TypeDef* QSPIx, uint8_t *scr_data);
 int             MSD0_GetCardInfo(QSPI_TypeDef* QSPIx, PMSD_CARDINFO SD0_CardInfo);
 uint8_t         SD_ReceiveData(QSPI_TypeDef* QSPIx, uint8_t *data, uint16_t len);
 uint8_t         SD_SendBlock(QSPI_TypeDef* QSPIx, uint8_t*buf,uint8_t cmd);
 uint8_t         SD_ReadDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
 uint8_t         SD_WriteDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
 
+uint8_t         SD_StartRead(SD_JobTypeDef *job, QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
+uint8_t         SD_StartWrite(SD_JobTypeDef *job, QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
+SD_JobStatus    SD_JobPoll(SD_JobTypeDef *job);
+uint8_t         SD_Sync(QSPI_TypeDef* QSPIx);
+uint8_t         SD_Erase(QSPI_TypeDef* QSPIx, uint32_t start, uint32_t end);
+uint32_t        SD_GetTranSpeed(QSPI_TypeDef* QSPIx);
+uint8_t         SD_SpeedRamp(QSPI_TypeDef* QSPIx);
+uint8_t         SD_SpeedStepDown(QSPI_TypeDef* QSPIx);
+uint8_t         SD_ReadDiskRetry(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
+uint8_t         SD_WriteDiskRetry(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt);
+uint32_t        SD_SpeedHz(void);
+
 void SPI_setspeed(QSPI_TypeDef* QSPIx, uint8_t speed);
 uint8_t spi_readwrite(QSPI_TypeDef* QSPIx, uint8_t Txdata);
 
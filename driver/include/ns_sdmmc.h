@@ -221,7 +221,7 @@ typedef union {
         uint8_t USE_NATIVE_SECTOR;
         uint8_t NATIVE_SECTOR_SIZE;
         uint8_t VENDOR_SPECIFIC_FIELD[64];
-        uint8_t Reserved25;
+        uint8_t Reserved25[2];
         uint8_t PROGRAM_CID_CSD_DDR_SUPPORT;
         uint8_t PERIODIC_WAKEUP;
         uint8_t TCASE_SUPPORT;
@@ -266,7 +266,6 @@ typedef union {
         uint8_t CMD_SET_REV;
         uint8_t Reserved14;
         uint8_t CMD_SET;
-        uint8_t Reserved13;
         uint8_t EXT_CSD_REV;
         uint8_t Reserved12;
         uint8_t Reserved11;
@@ -315,11 +314,11 @@ typedef union {
         uint8_t Reserved3;
         uint8_t INI_TIMEOUT_AP;
         uint8_t CORRECTLY_PRG_SECTORS_NUM[4];
-        uint8_t BKOPS_STATUS[2];
+        uint8_t BKOPS_STATUS;
         uint8_t POWER_OFF_LONG_TIME;
         uint8_t GENERIC_CMD6_TIME;
         uint8_t CACHE_SIZE[4];
-        uint8_t Reserved2[255];
+        uint8_t Reserved2[241];
         uint8_t EXT_SUPPORT;
         uint8_t LARGE_UNIT_SIZE_M1;
         uint8_t CONTEXT_CAPABILITIES;
@@ -342,10 +341,131 @@ typedef struct {
     SDMMC_CID EmmcCid;
     uint64_t CardCapacity;  /*!< Card Capacity */
     uint32_t CardBlockSize; /*!< Card Block Size */
+    uint32_t CacheSize;     /*!< Volatile cache size in KB, 0 if none */
     uint16_t RCA;
     uint8_t CardType;
 } EmmcCardInfo;
 
+/**
+  * @brief SDIO bus timing modes
+  */
+typedef enum
+{
+    SDMMC_TIMING_LEGACY = 0,    /*!< Default speed, clock up to DefaultSpeedHz */
+    SDMMC_TIMING_HS,            /*!< SD high speed or eMMC HS52, clock up to HighSpeedHz */
+    SDMMC_TIMING_DDR52,         /*!< eMMC dual data rate, clock up to HighSpeedHz */
+} SDMMC_TimingTypeDef;
+
+/**
+  * @brief SDIO bus timing, negotiated once by SDMMC_Init and kept until an error
+  */
+typedef struct
+{
+    uint32_t InitClkDiv;        /*!< CLK_DIV used for card identification, must give <= 400kHz */
+    uint32_t MinClkDiv;         /*!< Smallest CLK_DIV the board layout allows */
+    uint32_t DefaultSpeedHz;    /*!< Card clock limit in default speed mode */
+    uint32_t HighSpeedHz;       /*!< Card clock limit after a successful high speed switch */
+    uint32_t DataTimeout;       /*!< Data timeout register value */
+    uint8_t  HighSpeedEn;       /*!< Try the CMD6 high speed switch */
+    uint8_t  Timing;            /*!< Negotiated SDMMC_TimingTypeDef (read only) */
+    uint8_t  Negotiated;        /*!< Configuration is valid, cleared when a transfer fails (read only) */
+    uint8_t  Fallback;          /*!< Bus modes skipped after data CRC errors (read only) */
+    uint8_t  ClkStep;           /*!< Card clock halvings below the slowest bus mode (read only) */
+    uint32_t Width;             /*!< Negotiated SDIO_DATA_SETUP_MODE_x (read only) */
+    uint32_t ClkDiv;            /*!< Negotiated CLK_DIV (read only) */
+    uint32_t BlockLen;          /*!< Block length last set with CMD16 (read only) */
+} SDMMC_BusCfgTypeDef;
+
+extern SDMMC_BusCfgTypeDef SDMMC_BusCfg;
+
+/**
+  * @brief Capabilities of the card in the slot, filled in by SDMMC_Init
+  * @note  Probed from CSD, SCR and SD status (SD) or CSD and EXT_CSD (eMMC) the
+  *        first time a card is seen, later taken from SDMMC_Profile.
+  */
+typedef struct
+{
+    uint8_t  Valid;             /*!< Read from the card since the last power up (read only) */
+    uint8_t  Cached;            /*!< Taken from SDMMC_Profile instead of probing (read only) */
+    uint8_t  SdSpec;            /*!< SCR SD_SPEC, 0 on eMMC (read only) */
+    uint8_t  SdSpec3;           /*!< SCR SD_SPEC3 (read only) */
+    uint8_t  BusWidths;         /*!< SCR SD_BUS_WIDTHS, bit 0 1 bit, bit 2 4 bit (read only) */
+    uint8_t  SetBlockCount;     /*!< CMD23 closes multiple block reads, no CMD12 needed (read only) */
+    uint8_t  SpeedClass;        /*!< SD status speed class 0, 2, 4, 6 or 10, 0 on eMMC (read only) */
+    uint8_t  DeviceType;        /*!< EXT_CSD DEVICE_TYPE, 0 on SD (read only) */
+    uint32_t MaxClkHz;          /*!< Clock limit from CSD TRAN_SPEED, 52MHz for HS52 eMMC (read only) */
+    uint32_t AuSize;            /*!< SD allocation unit in sectors, 0 if not reported (read only) */
+    uint32_t EraseGroup;        /*!< Erase unit in sectors (read only) */
+    uint32_t CacheSize;         /*!< eMMC volatile cache in KB, 0 if none (read only) */
+} SDMMC_CardCapsTypeDef;
+
+extern SDMMC_CardCapsTypeDef SDMMC_CardCaps;
+
+/**
+  * @brief What SDMMC_Init remembers about a card, looked up by its CID
+  * @note  A known card skips the SCR, SD status and identification clock
+  *        EXT_CSD reads and goes straight to the bus level it was last tuned
+  *        to. The table may be kept in retention RAM or saved by the
+  *        application, a zero CID marks a free slot.
+  */
+typedef struct
+{
+    uint32_t Cid[4];            /*!< CID_Tab of the card */
+    SDMMC_CardCapsTypeDef Caps; /*!< Probed capabilities */
+    uint8_t  Fallback;          /*!< SDMMC_BusCfg.Fallback the card was tuned to */
+    uint8_t  ClkStep;           /*!< SDMMC_BusCfg.ClkStep the card was tuned to */
+    uint32_t LastUse;           /*!< SDMMC_Init count at the last match, the oldest slot is reused */
+} SDMMC_ProfileTypeDef;
+
+extern SDMMC_ProfileTypeDef SDMMC_Profile[];
+
+/**
+  * @brief Recovery budget of SDMMC_ReadDiskRetry / SDMMC_WriteDiskRetry and what it was used for
+  */
+typedef struct
+{
+    uint8_t  MaxRetries;        /*!< Repeats of a failed request before the bus is stepped down */
+    uint8_t  MaxReinits;        /*!< Step downs with re-initialisation before the request fails */
+    uint32_t Requests;          /*!< Requests issued (read only) */
+    uint32_t Errors;            /*!< Failed attempts (read only) */
+    uint32_t Retries;           /*!< Attempts repeated without re-initialisation (read only) */
+    uint32_t Reinits;           /*!< Re-initialisations (read only) */
+    uint32_t StepDowns;         /*!< Re-initialisations that found a slower bus level (read only) */
+    uint32_t Failures;          /*!< Requests that spent the whole budget (read only) */
+    uint32_t MaxAttempts;       /*!< Most attempts a single request took (read only) */
+} SDMMC_RetryTypeDef;
+
+extern SDMMC_RetryTypeDef SDMMC_Retry;
+
+/**
+  * @brief Transfer completion posted by the SDIO0 interrupt handlers
+  */
+typedef struct
+{
+    uint8_t  Enabled;           /*!< Handlers installed by SDMMC_IrqInit, waits sleep instead of spinning */
+    volatile uint32_t Events;   /*!< SDMMC_EVT_x bits posted and not taken yet */
+} SDMMC_CompletionTypeDef;
+
+extern SDMMC_CompletionTypeDef SDMMC_Completion;
+
+/**
+  * @brief Consumer (read) or producer (write) of one half of a streaming ring
+  * @param buf   half of the ring, half_blocks sectors
+  * @param index position of this half in the stream, starting at 0
+  * @param arg   user pointer given to SDMMC_StreamRead / SDMMC_StreamWrite
+  */
+typedef void (*SDMMC_StreamCallback)(uint8_t *buf, uint32_t index, void *arg);
+
+/**
+  * @brief One write of an eMMC packed write group
+  */
+typedef struct
+{
+    uint8_t *buf;               /*!< Word aligned data, count * 512 bytes */
+    uint32_t sector;            /*!< First sector */
+    uint32_t count;             /*!< Number of sectors */
+} SDMMC_PackedEntryTypeDef;
+
 /**
   * @brief SDIO Commands Index
   */
@@ -486,16 +606,93 @@ typedef struct {
 #define SDMMC_MAX_VOLT_TRIAL               ((uint32_t)0x0000FFFF)
 #define SDMMC_ALLZERO                      ((uint32_t)0x00000000)
 #define SDMMC_DATATIMEOUT                  ((uint32_t)0xFFFFFFFF)
+/* polls a DMA wait allows after EOT, for the channel to drain its FIFO */
+#define SDMMC_DMA_DRAIN_POLLS              ((uint32_t)0x00010000)
 #define SDMMC_0TO7BITS                     ((uint32_t)0x000000FF)
 #define SDMMC_8TO15BITS                    ((uint32_t)0x0000FF00)
 #define SDMMC_16TO23BITS                   ((uint32_t)0x00FF0000)
 #define SDMMC_24TO31BITS                   ((uint32_t)0xFF000000)
 #define SDMMC_WIDE_BUS_SUPPORT             ((uint32_t)0x00040000)
 #define SDMMC_SINGLE_BUS_SUPPORT           ((uint32_t)0x00010000)
+#define SDMMC_CMD23_SUPPORT                ((uint32_t)0x00000002)
 #define SDMMC_CARD_LOCKED                  ((uint32_t)0x02000000)
 #define SDMMC_CARD_PROGRAMMING             ((uint32_t)0x00000007)
 #define SDMMC_CARD_RECEIVING               ((uint32_t)0x00000006)
 #define SDMMC_MAX_DATA_LENGTH              ((uint32_t)0x01FFFFFF)
+#define SDMMC_SWITCH_HIGH_SPEED            ((uint32_t)0x80FFFFF1)
+#define SDMMC_SWITCH_STATUS_LEN            ((uint32_t)0x00000040)
+#define SDMMC_SD_STATUS_LEN                ((uint32_t)0x00000040)
+#define SDMMC_R1_SWITCH_ERROR              ((uint32_t)0x00000080)
+
+/** 
+  * @brief  EXT_CSD fields written with CMD6 SWITCH
+  */
+#define SDMMC_EXT_CSD_FLUSH_CACHE          ((uint32_t)32)
+#define SDMMC_EXT_CSD_CACHE_CTRL           ((uint32_t)33)
+#define SDMMC_EXT_CSD_BUS_WIDTH            ((uint32_t)183)
+#define SDMMC_EXT_CSD_HS_TIMING            ((uint32_t)185)
+#define SDMMC_EXT_CSD_WIDTH_1              ((uint32_t)0x00000000)
+#define SDMMC_EXT_CSD_WIDTH_4              ((uint32_t)0x00000001)
+#define SDMMC_EXT_CSD_WIDTH_8              ((uint32_t)0x00000002)
+#define SDMMC_EXT_CSD_WIDTH_DDR            ((uint32_t)0x00000004)
+#define SDMMC_EXT_CSD_CARD_HS52            ((uint32_t)0x00000002)
+#define SDMMC_EXT_CSD_CARD_DDR52           ((uint32_t)0x0000000C)
+#define SDMMC_EXT_CSD_REV_4_5              ((uint32_t)6)
+#define SDMMC_CMD23_PACKED                 ((uint32_t)0x40000000)
+#define SDMMC_PACKED_CMD_VERSION           ((uint32_t)0x00000001)
+#define SDMMC_PACKED_CMD_WRITE             ((uint32_t)0x00000002)
+/* entries that fit behind the version word of a 512 byte packed header */
+#define SDMMC_PACKED_MAX_ENTRIES           ((uint32_t)63)
+
+/** 
+  * @brief  CMD38 arguments, SEC_FEATURE_SUPPORT bit telling an eMMC supports TRIM
+  */
+#define SDMMC_ERASE_ARG                    ((uint32_t)0x00000000)
+#define SDMMC_TRIM_ARG                     ((uint32_t)0x00000001)
+#define SDMMC_DISCARD_ARG                  ((uint32_t)0x00000003)
+#define SDMMC_EXT_CSD_SEC_GB_CL_EN         ((uint32_t)0x00000010)
+
+/** 
+  * @brief  Completion events, the DMA ones use the channel status bit
+  */
+#define SDMMC_EVT_RX_DONE                  ((uint32_t)RX_FTRANS_IRQ_STAT)
+#define SDMMC_EVT_TX_DONE                  ((uint32_t)TX_FTRANS_IRQ_STAT)
+#define SDMMC_EVT_RX_HALF                  ((uint32_t)RX_HTRANS_IRQ_STAT)
+#define SDMMC_EVT_TX_HALF                  ((uint32_t)TX_HTRANS_IRQ_STAT)
+#define SDMMC_EVT_EOT                      ((uint32_t)0x00000100)
+
+#ifndef SDMMC_IRQ_PRIORITY
+#define SDMMC_IRQ_PRIORITY                 1
+#endif
+
+/* Sectors of the aligned pool unaligned SDMMC_ReadDisk/SDMMC_WriteDisk buffers bounce through */
+#ifndef SDMMC_BOUNCE_BLOCKS
+#define SDMMC_BOUNCE_BLOCKS                16
+#endif
+
+/* Copy between the bounce pool and the caller buffer with an M2M UDMA channel */
+#ifndef SDMMC_BOUNCE_M2M
+#define SDMMC_BOUNCE_M2M                   1
+#endif
+#ifndef SDMMC_BOUNCE_M2M_CH
+#define SDMMC_BOUNCE_M2M_CH                UDMA0_M2M_CH1
+#define SDMMC_BOUNCE_M2M_IRQ               UDMA0_CH1_M2M_IRQ
+#endif
+
+/* Card clock halvings BusStepDown may add once the slowest bus mode keeps failing */
+#ifndef SDMMC_CLK_STEP_MAX
+#define SDMMC_CLK_STEP_MAX                 3
+#endif
+
+/* Cards SDMMC_Profile remembers, at least 1 */
+#ifndef SDMMC_PROFILE_NUM
+#define SDMMC_PROFILE_NUM                  4
+#endif
+
+/* Turn on the eMMC volatile cache when EXT_CSD reports one, CTRL_SYNC flushes it */
+#ifndef SDMMC_EMMC_CACHE_EN
+#define SDMMC_EMMC_CACHE_EN                1
+#endif
 
 #define SDMMC_HALFFIFO                     ((uint32_t)0x00000008)
 #define SDMMC_HALFFIFOBYTES                ((uint32_t)0x00000020)
@@ -513,6 +710,18 @@ SDMMC_Error SDMMC_PowerOFF(void);
 SDMMC_Error SDMMC_InitializeCards(SDIO_TypeDef *SDIOx);
 SDMMC_Error SDMMC_GetCardInfo(SDMMC_CardInfo *cardinfo);
 SDMMC_Error SDMMC_EnableWideBusOperation(SDIO_TypeDef *SDIOx, uint32_t wmode);
+SDMMC_Error SDMMC_NegotiateBus(SDIO_TypeDef *SDIOx);
+SDMMC_Error SDMMC_FlushCache(SDIO_TypeDef *SDIOx);
+SDMMC_Error SDMMC_Erase(SDIO_TypeDef *SDIOx, uint32_t start, uint32_t end);
+SDMMC_Error SDMMC_IrqInit(SDIO_TypeDef *SDIOx);
+void SDMMC_IRQHandler(void);
+void SDMMC_DMA_IRQHandler(void);
+SDMMC_Error SDMMC_EventWait(uint32_t mask, uint32_t timeout);
+void SDMMC_EventSignal(uint32_t events);
+SDMMC_Error SDMMC_StreamRead(SDIO_TypeDef *SDIOx, uint32_t sector, uint8_t *ring, uint32_t half_blocks,
+                             uint32_t nblks, SDMMC_StreamCallback cb, void *arg);
+SDMMC_Error SDMMC_StreamWrite(SDIO_TypeDef *SDIOx, uint32_t sector, uint8_t *ring, uint32_t half_blocks,
+                              uint32_t nblks, SDMMC_StreamCallback cb, void *arg);
 SDMMC_Error SDMMC_SetDeviceMode(uint32_t mode);
 SDMMC_Error SDMMC_SelectDeselect(SDIO_TypeDef *SDIOx, uint32_t addr);
 SDMMC_Error SDMMC_SendStatus(uint32_t *pcardstatus);
@@ -521,12 +730,16 @@ SDMMC_Error SDMMC_ReadBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,uin
 SDMMC_Error SDMMC_ReadMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf, long long  addr,uint16_t blksize,uint32_t nblks);
 SDMMC_Error SDMMC_WriteBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,  uint16_t blksize);
 SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf, long long addr,uint16_t blksize,uint32_t nblks);
+uint32_t SDMMC_PackedWriteMax(void);
+SDMMC_Error SDMMC_WritePacked(SDIO_TypeDef *SDIOx, const SDMMC_PackedEntryTypeDef *entry, uint32_t num);
 SDMMC_Error SDMMC_ProcessIRQSrc(void);
 SDMMC_Error EmmcGetCardInfo(EmmcCardInfo *E, uint32_t *CSD_Tab, uint32_t *CID_Tab, uint16_t Rca);
 SDMMC_Error EmmcReadExtCsd(SDIO_TypeDef *SDIOx, EmmcCardInfo *E);
 
 uint8_t SDMMC_ReadDisk(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_t cnt);
 uint8_t SDMMC_WriteDisk(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_t cnt);
+uint8_t SDMMC_ReadDiskRetry(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt);
+uint8_t SDMMC_WriteDiskRetry(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt);
 static SDMMC_Error CmdResp7Error(SDIO_TypeDef *SDIOx);
 static SDMMC_Error CmdResp1Error(SDIO_TypeDef *SDIOx, uint32_t cmd);
 static SDMMC_Error CmdResp3Error(SDIO_TypeDef *SDIOx);
@@ -11,6 +11,36 @@
 #define W25Q256 0XEF18
 
 extern uint16_t W25QXX_TYPE;
+extern uint8_t W25QXX_READ_CMD;
+extern uint8_t W25QXX_PROG_CMD;
+
+//geometry and commands of the part, from SFDP or else from the ID
+typedef struct {
+    uint32_t Size;              //bytes
+    uint16_t PageSize;          //bytes one page program can take
+    uint8_t AddrBytes;          //3, or 4 above 16MB
+    uint8_t Enter4B;            //0 nothing to do, 1 0xB7, 2 write enable and 0xB7
+    uint8_t Erase4K;            //4KB erase command
+    uint8_t Erase64K;           //64KB erase command, 0 if the part has none
+    uint8_t Reads;              //W25QXX_READ_* the part offers
+    uint8_t Clocks[4];          //mode and dummy clocks after the address, per W25QXX_READ_*
+    uint8_t Sfdp;               //1 if the values came from SFDP
+} W25QXX_InfoTypeDef;
+
+extern W25QXX_InfoTypeDef W25QXX_Info;
+
+//bits of W25QXX_Info.Reads, also the index into W25QXX_Info.Clocks
+#define W25QXX_READ_112         0           //0x3B
+#define W25QXX_READ_122         1           //0xBB
+#define W25QXX_READ_114         2           //0x6B
+#define W25QXX_READ_144         3           //0xEB
+
+#ifndef W25QXX_SUSPEND
+#define W25QXX_SUSPEND          1           //reads suspend an erase that is still running
+#endif
+#ifndef W25QXX_ERASE_QUEUE
+#define W25QXX_ERASE_QUEUE      8           //runs of freed sectors W25QXX_Erase_Defer keeps
+#endif
 
 //command table
 #define W25X_WriteEnable		0x06
@@ -24,6 +54,10 @@ extern uint16_t W25QXX_TYPE;
 #define W25X_ReadData			0x03
 #define W25X_FastReadData		0x0B
 #define W25X_FastReadDual		0x3B
+#define W25X_FastReadDualIO		0xBB
+#define W25X_FastReadQuad		0x6B
+#define W25X_FastReadQuadIO		0xEB
+#define W25X_PageProgramQuad	0x32
 #define W25X_PageProgram		0x02
 #define W25X_BlockErase			0xD8
 #define W25X_SectorErase		0x20
@@ -35,11 +69,18 @@ extern uint16_t W25QXX_TYPE;
 #define W25X_JedecDeviceID		0x9F
 #define W25X_Enable4ByteAddr    0xB7
 #define W25X_Exit4ByteAddr      0xE9
+#define W25X_ReadSFDP           0x5A
+#define W25X_Suspend            0x75    //erase/program suspend
+#define W25X_Resume             0x7A    //erase/program resume
+
+#define W25X_SR2_QE             0x02    //quad enable, IO2/IO3 instead of /WP and /HOLD
+#define W25X_SR2_SUS            0x80    //an erase or program is suspended
 
 void W25QXX_Init(QSPI_TypeDef* QSPIx);                                 //spi init
 uint16_t W25QXX_ReadID(QSPI_TypeDef* QSPIx);                           //Read FLASH ID
 uint8_t W25QXX_ReadSR(QSPI_TypeDef* QSPIx, uint8_t regno);                   //read status register
 void W25QXX_4ByteAddr_Enable(QSPI_TypeDef* QSPIx);                     //Enable 4-byte address mode
+void W25QXX_ReadSFDP(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t Addr, uint16_t Len);   //read the SFDP tables
 void W25QXX_Write_SR(QSPI_TypeDef* QSPIx, uint8_t regno,uint8_t sr);         //write status register
 void W25QXX_Write_Enable(QSPI_TypeDef* QSPIx);                         //write enable
 void W25QXX_Write_Disable(QSPI_TypeDef* QSPIx);                        //write protection
@@ -48,6 +89,15 @@ void W25QXX_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t ReadAddr,uint16_
 void W25QXX_Write(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t WriteAddr, uint16_t NumByteToWrite);       //write to flash
 void W25QXX_Erase_Chip(QSPI_TypeDef* QSPIx);                           //whole chip erase
 void W25QXX_Erase_Sector(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr);            //Sector erase
+void W25QXX_Erase_Block(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr);             //64KB block erase
+void W25QXX_Erase_Range(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len);    //erase whole sectors inside a range
+void W25QXX_Erase_Defer(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len);    //queue whole sectors inside a range for erase-ahead
+uint8_t W25QXX_Erase_Idle(QSPI_TypeDef* QSPIx);                        //start the next queued erase, 0 when done
+void W25QXX_Cache_Write(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t WriteAddr, uint32_t NumByteToWrite);  //write through the 4KB sector cache
+void W25QXX_Cache_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t ReadAddr, uint32_t NumByteToRead);       //read, cached data included
+void W25QXX_Cache_Flush(QSPI_TypeDef* QSPIx);                    //write back the cached sector
+void W25QXX_XIP_Init(QSPI_TypeDef* QSPIx, uint32_t Window);       //read through the memory mapped window
+const uint8_t* W25QXX_XIP_Map(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len);  //flash mode, pointer into the window
 void W25QXX_Wait_Busy(QSPI_TypeDef* QSPIx);                            //wait for idle
 void W25QXX_PowerDown(QSPI_TypeDef* QSPIx);                            //Enter power down mode
 void W25QXX_WAKEUP(QSPI_TypeDef* QSPIx);                               // wake up
@@ -0,0 +1,55 @@
+#ifndef __W25QXX_FTL_H__
+#define __W25QXX_FTL_H__
+#include "w25qxx.h"
+
+// Log structured translation layer for 512 byte sectors on W25Q flash.
+// The region is split into units of one 4KB erase sector. The first 512 bytes
+// of a unit hold its header and one tag per slot, the other seven 512 byte
+// slots hold sectors. Sectors are appended to the open unit, the logical to
+// physical map lives in RAM and is rebuilt from the tags at mount.
+
+#ifndef W25QXX_FTL_BASE
+#define W25QXX_FTL_BASE         0           // first byte of the region, 4KB aligned
+#endif
+#ifndef W25QXX_FTL_UNITS
+#define W25QXX_FTL_UNITS        640         // units in the region, 2.5MB
+#endif
+#ifndef W25QXX_FTL_SECTORS
+#define W25QXX_FTL_SECTORS      4096        // logical sectors, 2MB
+#endif
+#ifndef W25QXX_FTL_IDLE_FREE
+#define W25QXX_FTL_IDLE_FREE    8           // free units W25QXX_FTL_Idle collects ahead
+#endif
+#ifndef W25QXX_FTL_WL_DELTA
+#define W25QXX_FTL_WL_DELTA     32          // erase count spread that moves cold data
+#endif
+
+#define W25QXX_FTL_UNIT_SIZE    4096
+#define W25QXX_FTL_SLOTS        7           // sectors per unit
+#define W25QXX_FTL_RESERVE      2           // free units only garbage collection may open
+
+#if (W25QXX_FTL_UNITS - W25QXX_FTL_RESERVE - 1) * W25QXX_FTL_SLOTS <= W25QXX_FTL_SECTORS
+#error "W25QXX_FTL_UNITS too small for W25QXX_FTL_SECTORS"
+#endif
+#if W25QXX_FTL_UNITS * W25QXX_FTL_SLOTS > 0xFFFF
+#error "W25QXX_FTL_UNITS too large for the 16 bit map"
+#endif
+
+typedef struct {
+    uint32_t Gc;                // units reclaimed by garbage collection
+    uint32_t GcCopies;          // sectors moved by garbage collection
+    uint32_t WlMoves;           // units reclaimed to move cold data
+    uint32_t Erases;            // unit erases
+    uint32_t FreeUnits;         // erased or reclaimable units
+    uint32_t MinErase;          // lowest unit erase count
+    uint32_t MaxErase;          // highest unit erase count
+} W25QXX_FTL_StatTypeDef;
+
+extern W25QXX_FTL_StatTypeDef W25QXX_FTL_Stat;
+
+uint8_t W25QXX_FTL_Mount(QSPI_TypeDef* QSPIx);                                                  //rebuild the map from flash
+uint8_t W25QXX_FTL_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t Sector, uint32_t Count);      //read sectors
+uint8_t W25QXX_FTL_Write(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t Sector, uint32_t Count);   //write sectors
+uint8_t W25QXX_FTL_Trim(QSPI_TypeDef* QSPIx, uint32_t Start, uint32_t End);                     //drop sectors Start..End
+uint8_t W25QXX_FTL_Idle(QSPI_TypeDef* QSPIx);                                                   //one step of background work
+#endif
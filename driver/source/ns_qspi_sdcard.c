@@ -17,6 +17,7 @@
  */
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "ns_qspi_sdcard.h"
 #include "ns_qspi.h"
 
@@ -26,6 +27,51 @@ uint8_t test;
 uint8_t SD_TYPE=0x00;
 
 MSD_CARDINFO SD0_CardInfo;
+MSD_CAPS SD0_Caps;
+
+/* SCKDIV candidates, fastest first */
+static const uint8_t SD_SpeedTab[] = {
+    QSPI_SCKDIV_PRESCALER_2,
+    QSPI_SCKDIV_PRESCALER_4,
+    QSPI_SCKDIV_PRESCALER_8,
+    QSPI_SCKDIV_PRESCALER_16,
+    QSPI_SCKDIV_PRESCALER_32,
+    QSPI_SCKDIV_PRESCALER_64,
+};
+#define SD_SPEED_NUM    (sizeof(SD_SpeedTab) / sizeof(SD_SpeedTab[0]))
+
+static uint8_t SD_SpeedIdx = SD_SPEED_NUM - 1;
+/* Fastest index SD_SpeedRamp verified, step ups stop there */
+static uint8_t SD_SpeedTop = SD_SPEED_NUM - 1;
+/* Transfers without error since the last step down */
+static uint32_t SD_CleanRun;
+SD_SpeedStatTypeDef SD_SpeedStat;
+static uint8_t SD_VerifyBuf[2][MSD_BLOCKSIZE];
+
+/* CSD TRAN_SPEED time value, scaled by 10 */
+static const uint8_t SD_TranSpeedMul[16] = {
+    0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+};
+
+static uint16_t SD_CRC16(const uint8_t *data, uint16_t len)
+{
+    uint16_t crc = 0;
+
+    while(len--)
+    {
+        crc = (uint8_t)(crc >> 8) | (crc << 8);
+        crc ^= *data++;
+        crc ^= (uint8_t)(crc & 0xFF) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xFF) << 5;
+    }
+    return crc;
+}
+
+static uint32_t SD_SpeedClk(uint8_t idx)
+{
+    return SystemCoreClock / (2 * ((uint32_t)SD_SpeedTab[idx] + 1));
+}
 
 void SD_CS(QSPI_TypeDef* QSPIx, uint8_t p){
     if(p == 0){
@@ -37,14 +83,15 @@ void SD_CS(QSPI_TypeDef* QSPIx, uint8_t p){
 
 int SD_sendcmd(QSPI_TypeDef* QSPIx, uint8_t cmd,uint32_t arg,uint8_t crc){
     uint8_t r1;
-    uint8_t retry;
+    uint32_t retry;
 
     SD_CS(QSPIx, 0);
     delay_1ms(1);
     SD_CS(QSPIx, 1);
-    do{
-        retry=spi_readwrite(QSPIx, DUMMY_BYTE);
-    }while(retry!=0xFF);
+    retry = SD_SPI_BUSY_RETRY;
+    while(spi_readwrite(QSPIx, DUMMY_BYTE) != 0xFF){
+        if(--retry == 0)return MSD_RESPONSE_FAILURE;
+    }
 
     spi_readwrite(QSPIx, cmd | 0x40);
     spi_readwrite(QSPIx, arg >> 24);
@@ -55,9 +102,10 @@ int SD_sendcmd(QSPI_TypeDef* QSPIx, uint8_t cmd,uint32_t arg,uint8_t crc){
 
     if(cmd==CMD12)spi_readwrite(QSPIx, DUMMY_BYTE);
 
+    retry = SD_SPI_RESP_RETRY;
     do{
         r1=spi_readwrite(QSPIx, 0xFF);
-    }while(r1&0X80);
+    }while((r1&0X80) && --retry);
 
     return r1;
 }
@@ -65,11 +113,13 @@ int SD_sendcmd(QSPI_TypeDef* QSPIx, uint8_t cmd,uint32_t arg,uint8_t crc){
 uint8_t SD_init(QSPI_TypeDef* QSPIx)
 {
     uint8_t r1;
-    uint8_t buff[6] = {0};
+    uint8_t buff[8] = {0};
     uint16_t retry;
     uint8_t i;
 
-    SPI_setspeed(QSPIx, QSPI_SCKDIV_PRESCALER_64);
+    SD_SpeedIdx = SD_SPEED_NUM - 1;
+    SD_SpeedTop = SD_SPEED_NUM - 1;
+    SPI_setspeed(QSPIx, SD_SPI_INIT_PRESCALER);
     SD_CS(QSPIx, 0);
     for(retry=0;retry<10;retry++){
             spi_readwrite(QSPIx, DUMMY_BYTE);
@@ -128,27 +178,46 @@ uint8_t SD_init(QSPI_TypeDef* QSPIx)
         }
     }
     SD_CS(QSPIx, 0);
-    SPI_setspeed(QSPIx, QSPI_SCKDIV_PRESCALER_8);
-    if(SD_TYPE)return 0;
+    memset(&SD0_Caps, 0, sizeof(SD0_Caps));
+    if(SD_TYPE && SD_TYPE != MMC && SD_GETSCR(QSPIx, buff) == 0){
+        /* SCR byte 0 holds SD_SPEC, bit 1 of byte 3 is CMD23 support */
+        SD0_Caps.SdSpec = buff[0] & 0x0F;
+        SD0_Caps.SetBlockCount = (buff[3] & 0x02) ? 1 : 0;
+    }
+    if(SD_TYPE){
+        SD_SpeedRamp(QSPIx);
+        return 0;
+    }
     else return 1;
 }
 
+/**
+ * \brief  Receive one data block, returns 1 on token timeout and 2 on CRC mismatch
+ */
 uint8_t SD_ReceiveData(QSPI_TypeDef* QSPIx, uint8_t *data, uint16_t len)
 {
     uint8_t r1;
+    uint16_t crc;
+    uint32_t retry = SD_SPI_TOKEN_RETRY;
+    uint8_t *p = data;
+    uint16_t n = len;
+
     SD_CS(QSPIx, 1);
     do
     {
         r1 = spi_readwrite(QSPIx, 0xFF);
-        delay_1ms(100);
-        }while(r1 != 0xFE);
-    while(len--)
+    }while(r1 != 0xFE && --retry);
+    if(r1 != 0xFE)return 1;
+    while(n--)
     {
-    *data = spi_readwrite(QSPIx, 0xFF);
-    data++;
+    *p = spi_readwrite(QSPIx, 0xFF);
+    p++;
     }
-    spi_readwrite(QSPIx, 0xFF);
-    spi_readwrite(QSPIx, 0xFF);
+    crc = (uint16_t)spi_readwrite(QSPIx, 0xFF) << 8;
+    crc |= spi_readwrite(QSPIx, 0xFF);
+#if SD_SPI_DATA_CRC_CHECK
+    if(crc != SD_CRC16(data, len))return 2;
+#endif
     return 0;
 }
 
@@ -156,9 +225,11 @@ uint8_t SD_SendBlock(QSPI_TypeDef* QSPIx, uint8_t*buf,uint8_t cmd)
 {
     uint16_t t;
     uint8_t r1;
+    uint32_t retry = SD_SPI_BUSY_RETRY;
     do{
         r1=spi_readwrite(QSPIx, 0xFF);
-    }while(r1!=0xFF);
+    }while(r1!=0xFF && --retry);
+    if(r1!=0xFF)return 1;
 
     spi_readwrite(QSPIx, cmd);
     if(cmd!=0XFD)
@@ -196,6 +267,25 @@ uint8_t SD_GETCSD(QSPI_TypeDef* QSPIx, uint8_t *csd_data){
     else return 0;
 }
 
+/**
+ * \brief  Read the 8 byte SD configuration register with ACMD51
+ * \return 0 on success, 1 on failure (MMC cards have no SCR)
+ */
+uint8_t SD_GETSCR(QSPI_TypeDef* QSPIx, uint8_t *scr_data)
+{
+    uint8_t r1;
+
+    SD_sendcmd(QSPIx, CMD55, 0, 0x01);
+    r1 = SD_sendcmd(QSPIx, CMD51, 0, 0x01);
+    if(r1 == 0)
+    {
+        r1 = SD_ReceiveData(QSPIx, scr_data, 8);
+    }
+    SD_CS(QSPIx, 0);
+    if(r1)return 1;
+    else return 0;
+}
+
 uint32_t SD_GetSectorCount(QSPI_TypeDef* QSPIx)
 {
     uint8_t csd[16];
@@ -357,62 +447,513 @@ int MSD0_GetCardInfo(QSPI_TypeDef* QSPIx, PMSD_CARDINFO SD0_CardInfo)
     return 0;
 }
 
-uint8_t SD_WriteDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+/* SD_JobTypeDef.state values */
+enum
 {
-    uint8_t r1;
-    if(SD_TYPE!=V2HC)sector *= 512;
-    if(cnt==1)
+    SD_ST_SELECT = 0,
+    SD_ST_READY,
+    SD_ST_CMD,
+    SD_ST_R1,
+    SD_ST_ACMD23,
+    SD_ST_WR_CMD,
+    SD_ST_RD_CMD,
+    SD_ST_RD_TOKEN,
+    SD_ST_RD_DATA,
+    SD_ST_WR_BUSY,
+    SD_ST_WR_DATA,
+    SD_ST_FINISH,
+};
+
+/* Job currently owning the bus, only one transfer may be in flight */
+static SD_JobTypeDef * volatile SD_ActiveJob;
+/* Card may still be programming after the last CMD24/CMD25/CMD12 */
+static volatile uint8_t SD_BusyPending;
+
+static void SD_JobCmd(SD_JobTypeDef *job, uint8_t cmd, uint32_t arg, uint8_t next)
+{
+    job->cmd = cmd;
+    job->arg = arg;
+    job->next = next;
+    job->state = SD_ST_SELECT;
+}
+
+static void SD_JobEnd(SD_JobTypeDef *job, uint8_t err)
+{
+    SD_CS(job->QSPIx, 0);
+    job->err = err;
+    job->status = err ? SD_JOB_ERROR : SD_JOB_DONE;
+    SD_ActiveJob = 0;
+}
+
+/* End a CMD25 that failed part way: wait out the block the card may still
+   program, unless that wait already timed out, then the stop tran token
+   takes it back to the transfer state */
+static void SD_JobStopWrite(SD_JobTypeDef *job, uint8_t wait)
+{
+    uint32_t retry = SD_SPI_BUSY_RETRY;
+
+    if(job->cnt == 1)return;
+    while(wait && spi_readwrite(job->QSPIx, DUMMY_BYTE) != 0xFF && --retry);
+    spi_readwrite(job->QSPIx, 0xFD);
+    SD_BusyPending = 1;
+}
+
+static uint8_t SD_JobStart(SD_JobTypeDef *job, QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    if(cnt == 0)return SD_ERR_CMD;
+    /* SD_JobPoll may run from a timer interrupt and end the owner */
+    __disable_irq();
+    if(SD_ActiveJob != 0)
     {
-        r1=SD_sendcmd(QSPIx, CMD24,sector,0X01);
-        if(r1==0)
-        {
-            r1=SD_SendBlock(QSPIx, buf,0xFE);
-        }
+        __enable_irq();
+        return SD_ERR_BUSY;
+    }
+    SD_ActiveJob = job;
+    __enable_irq();
+    job->QSPIx = QSPIx;
+    job->buf = buf;
+    job->addr = (SD_TYPE != V2HC) ? (sector << 9) : sector;
+    job->cnt = cnt;
+    job->left = cnt;
+    job->preset = 0;
+    job->err = 0;
+    job->status = SD_JOB_BUSY;
+    return 0;
+}
+
+/**
+ * \brief  Queue a sector read, the transfer is carried out by SD_JobPoll
+ * \return 0 when the job was accepted, SD_ERR_BUSY when the bus is owned by
+ *         another job, SD_ERR_CMD when cnt is 0
+ */
+uint8_t SD_StartRead(SD_JobTypeDef *job, QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    uint8_t err;
+
+    err = SD_JobStart(job, QSPIx, buf, sector, cnt);
+    if(err)return err;
+    job->write = 0;
+    if(cnt > 1 && SD0_Caps.SetBlockCount)
+    {
+        SD_JobCmd(job, CMD23, cnt, SD_ST_RD_CMD);
     }else
     {
-        if(SD_TYPE!=MMC)
-        {
-            SD_sendcmd(QSPIx, CMD55,0,0X01);
-            SD_sendcmd(QSPIx, CMD23,cnt,0X01);
-        }
-        r1=SD_sendcmd(QSPIx, CMD25,sector,0X01);
-        if(r1==0)
-        {
-            do
+        SD_JobCmd(job, (cnt == 1) ? CMD17 : CMD18, job->addr, SD_ST_RD_TOKEN);
+    }
+    return 0;
+}
+
+/**
+ * \brief  Queue a sector write, the transfer is carried out by SD_JobPoll
+ * \details The job completes once the last data response is received, the
+ *          card programming time is absorbed by the next command or SD_Sync.
+ * \return 0 when the job was accepted, SD_ERR_BUSY when the bus is owned by
+ *         another job, SD_ERR_CMD when cnt is 0
+ */
+uint8_t SD_StartWrite(SD_JobTypeDef *job, QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    uint8_t err;
+
+    err = SD_JobStart(job, QSPIx, buf, sector, cnt);
+    if(err)return err;
+    job->write = 1;
+    if(cnt > 1 && SD_TYPE != MMC)
+    {
+        SD_JobCmd(job, CMD55, 0, SD_ST_ACMD23);
+    }else
+    {
+        job->state = SD_ST_WR_CMD;
+    }
+    return 0;
+}
+
+/**
+ * \brief  Advance a read/write job by a bounded amount of bus work
+ * \details Safe to call from the main loop or a periodic timer interrupt,
+ *          each call moves at most SD_JOB_CHUNK data bytes or polls the
+ *          card for at most SD_JOB_POLL_BYTES bytes. Only one context may
+ *          poll a given job. A failed CMD25 is closed with the stop tran
+ *          token before the job ends, which may wait for the card.
+ * \return current job status
+ */
+SD_JobStatus SD_JobPoll(SD_JobTypeDef *job)
+{
+    QSPI_TypeDef* QSPIx = job->QSPIx;
+    uint8_t r1;
+    uint8_t n;
+    uint16_t crc;
+
+    if(job->status != SD_JOB_BUSY)return job->status;
+
+    switch(job->state)
+    {
+        case SD_ST_SELECT:
+            /* deselect for eight clocks instead of the 1ms used by SD_sendcmd */
+            SD_CS(QSPIx, 0);
+            spi_readwrite(QSPIx, DUMMY_BYTE);
+            SD_CS(QSPIx, 1);
+            job->retry = SD_SPI_BUSY_RETRY;
+            job->state = SD_ST_READY;
+            /* fall through */
+        case SD_ST_READY:
+            for(n = 0; n < SD_JOB_POLL_BYTES; n++)
             {
-                r1=SD_SendBlock(QSPIx, buf,0xFC);
-                buf+=512;
-            }while(--cnt && r1==0);
-            r1=SD_SendBlock(QSPIx, 0,0xFD);
-        }
+                if(spi_readwrite(QSPIx, DUMMY_BYTE) == 0xFF)
+                {
+                    SD_BusyPending = 0;
+                    job->state = SD_ST_CMD;
+                    break;
+                }
+                if(--job->retry == 0)
+                {
+                    SD_JobEnd(job, SD_ERR_TIMEOUT);
+                    return job->status;
+                }
+            }
+            break;
+        case SD_ST_CMD:
+            spi_readwrite(QSPIx, job->cmd | 0x40);
+            spi_readwrite(QSPIx, job->arg >> 24);
+            spi_readwrite(QSPIx, job->arg >> 16);
+            spi_readwrite(QSPIx, job->arg >> 8);
+            spi_readwrite(QSPIx, job->arg);
+            spi_readwrite(QSPIx, 0x01);
+            if(job->cmd == CMD12)spi_readwrite(QSPIx, DUMMY_BYTE);
+            job->retry = SD_SPI_RESP_RETRY;
+            job->state = SD_ST_R1;
+            /* fall through */
+        case SD_ST_R1:
+            do{
+                r1 = spi_readwrite(QSPIx, DUMMY_BYTE);
+            }while((r1 & 0x80) && --job->retry);
+            /* CMD55/ACMD23 only pre-erase and a read falls back to CMD12 without
+               CMD23, their status is not fatal */
+            if(r1 != 0 && job->cmd != CMD55 && job->cmd != CMD23)
+            {
+                SD_JobEnd(job, (r1 & 0x80) ? SD_ERR_TIMEOUT : SD_ERR_CMD);
+                return job->status;
+            }
+            if(job->cmd == CMD23 && !job->write)
+            {
+                /* a card that rejects CMD23 gets open ended reads from now on */
+                job->preset = (r1 == 0);
+                if(r1 != 0)SD0_Caps.SetBlockCount = 0;
+            }
+            if(job->cmd == CMD12)SD_BusyPending = 1;
+            job->retry = (job->next == SD_ST_RD_TOKEN) ? SD_SPI_TOKEN_RETRY : SD_SPI_BUSY_RETRY;
+            job->state = job->next;
+            break;
+        case SD_ST_ACMD23:
+            SD_JobCmd(job, CMD23, job->cnt, SD_ST_WR_CMD);
+            break;
+        case SD_ST_WR_CMD:
+            SD_JobCmd(job, (job->cnt == 1) ? CMD24 : CMD25, job->addr, SD_ST_WR_BUSY);
+            break;
+        case SD_ST_RD_CMD:
+            SD_JobCmd(job, CMD18, job->addr, SD_ST_RD_TOKEN);
+            break;
+        case SD_ST_RD_TOKEN:
+            for(n = 0; n < SD_JOB_POLL_BYTES; n++)
+            {
+                r1 = spi_readwrite(QSPIx, DUMMY_BYTE);
+                if(r1 == 0xFE)
+                {
+                    job->pos = 0;
+                    job->state = SD_ST_RD_DATA;
+                    break;
+                }
+                if(--job->retry == 0)
+                {
+                    if(job->cnt > 1)SD_sendcmd(QSPIx, CMD12, 0, 0X01);
+                    SD_JobEnd(job, SD_ERR_TIMEOUT);
+                    return job->status;
+                }
+            }
+            break;
+        case SD_ST_RD_DATA:
+            for(n = 0; n < SD_JOB_CHUNK && job->pos < MSD_BLOCKSIZE; n++)
+            {
+                job->buf[job->pos++] = spi_readwrite(QSPIx, DUMMY_BYTE);
+            }
+            if(job->pos < MSD_BLOCKSIZE)break;
+            crc = (uint16_t)spi_readwrite(QSPIx, DUMMY_BYTE) << 8;
+            crc |= spi_readwrite(QSPIx, DUMMY_BYTE);
+#if SD_SPI_DATA_CRC_CHECK
+            if(crc != SD_CRC16(job->buf, MSD_BLOCKSIZE))
+            {
+                if(job->cnt > 1)SD_sendcmd(QSPIx, CMD12, 0, 0X01);
+                SD_JobEnd(job, SD_ERR_CRC);
+                return job->status;
+            }
+#endif
+            job->buf += MSD_BLOCKSIZE;
+            if(--job->left)
+            {
+                job->retry = SD_SPI_TOKEN_RETRY;
+                job->state = SD_ST_RD_TOKEN;
+            }else if(job->cnt > 1 && !job->preset)
+            {
+                SD_JobCmd(job, CMD12, 0, SD_ST_FINISH);
+            }else
+            {
+                job->state = SD_ST_FINISH;
+            }
+            break;
+        case SD_ST_WR_BUSY:
+            /* card programs the previous block of a CMD25 here */
+            for(n = 0; n < SD_JOB_POLL_BYTES; n++)
+            {
+                if(spi_readwrite(QSPIx, DUMMY_BYTE) == 0xFF)
+                {
+                    if(job->left == 0)
+                    {
+                        spi_readwrite(QSPIx, 0xFD);
+                        SD_BusyPending = 1;
+                        job->state = SD_ST_FINISH;
+                    }else
+                    {
+                        spi_readwrite(QSPIx, (job->cnt == 1) ? 0xFE : 0xFC);
+                        job->pos = 0;
+                        job->state = SD_ST_WR_DATA;
+                    }
+                    break;
+                }
+                if(--job->retry == 0)
+                {
+                    SD_JobStopWrite(job, 0);
+                    SD_JobEnd(job, SD_ERR_TIMEOUT);
+                    return job->status;
+                }
+            }
+            break;
+        case SD_ST_WR_DATA:
+            for(n = 0; n < SD_JOB_CHUNK && job->pos < MSD_BLOCKSIZE; n++)
+            {
+                spi_readwrite(QSPIx, job->buf[job->pos++]);
+            }
+            if(job->pos < MSD_BLOCKSIZE)break;
+            spi_readwrite(QSPIx, 0xFF);
+            spi_readwrite(QSPIx, 0xFF);
+            r1 = spi_readwrite(QSPIx, 0xFF);
+            SD_BusyPending = 1;
+            if((r1 & 0x1F) != MSD_DATA_OK)
+            {
+                SD_JobStopWrite(job, 1);
+                SD_JobEnd(job, ((r1 & 0x1F) == MSD_DATA_CRC_ERROR) ? SD_ERR_CRC : SD_ERR_CMD);
+                return job->status;
+            }
+            job->buf += MSD_BLOCKSIZE;
+            job->left--;
+            if(job->cnt == 1)
+            {
+                job->state = SD_ST_FINISH;
+            }else
+            {
+                job->retry = SD_SPI_BUSY_RETRY;
+                job->state = SD_ST_WR_BUSY;
+            }
+            break;
+        case SD_ST_FINISH:
+        default:
+            SD_JobEnd(job, 0);
+            break;
     }
+    return job->status;
+}
+
+/**
+ * \brief  Wait until the card has finished programming the last write
+ * \return 0 on success, SD_ERR_TIMEOUT on timeout, SD_ERR_BUSY while a job owns the bus
+ */
+uint8_t SD_Sync(QSPI_TypeDef* QSPIx)
+{
+    uint32_t retry = SD_SPI_BUSY_RETRY;
+    uint8_t r1;
+
+    if(SD_ActiveJob != 0)return SD_ERR_BUSY;
+    if(!SD_BusyPending)return 0;
+    SD_CS(QSPIx, 1);
+    do{
+        r1 = spi_readwrite(QSPIx, DUMMY_BYTE);
+    }while(r1 != 0xFF && --retry);
     SD_CS(QSPIx, 0);
-    return r1;
+    if(r1 != 0xFF)return SD_ERR_TIMEOUT;
+    SD_BusyPending = 0;
+    return 0;
 }
 
-uint8_t SD_ReadDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+/**
+ * \brief  Erase sectors start..end (inclusive), backs FatFs CTRL_TRIM
+ * \details The card erases in the background, the busy time is absorbed by
+ *          the next command or SD_Sync like after a write.
+ * \return 0 on success, SD_ERR_BUSY while a job owns the bus, 1 on failure
+ */
+uint8_t SD_Erase(QSPI_TypeDef* QSPIx, uint32_t start, uint32_t end)
 {
     uint8_t r1;
-    if(SD_TYPE!=V2HC)sector <<= 9;
-    if(cnt==1)
+
+    if(SD_ActiveJob != 0)return SD_ERR_BUSY;
+    if(end < start)return 1;
+    if(SD_TYPE != V2HC)
     {
-        r1=SD_sendcmd(QSPIx, CMD17,sector,0X01);
-        if(r1==0)
+        start <<= 9;
+        end <<= 9;
+    }
+    r1 = SD_sendcmd(QSPIx, (SD_TYPE == MMC) ? CMD35 : CMD32, start, 0x01);
+    if(r1 == 0)r1 = SD_sendcmd(QSPIx, (SD_TYPE == MMC) ? CMD36 : CMD33, end, 0x01);
+    if(r1 == 0)r1 = SD_sendcmd(QSPIx, CMD38, 0, 0x01);
+    SD_CS(QSPIx, 0);
+    if(r1 != 0)return 1;
+    SD_BusyPending = 1;
+    return 0;
+}
+
+uint8_t SD_WriteDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    SD_JobTypeDef job;
+    uint8_t err;
+
+    err = SD_StartWrite(&job, QSPIx, buf, sector, cnt);
+    if(err)return err;
+    while(SD_JobPoll(&job) == SD_JOB_BUSY);
+    return job.err;
+}
+
+uint8_t SD_ReadDisk(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    SD_JobTypeDef job;
+    uint8_t err;
+
+    err = SD_StartRead(&job, QSPIx, buf, sector, cnt);
+    if(err)return err;
+    while(SD_JobPoll(&job) == SD_JOB_BUSY);
+    return job.err;
+}
+
+/**
+ * \brief  Decode the CSD TRAN_SPEED field
+ * \return maximum data transfer rate of the card in Hz, 0 on failure
+ */
+uint32_t SD_GetTranSpeed(QSPI_TypeDef* QSPIx)
+{
+    uint8_t csd[16];
+    uint32_t unit;
+    uint8_t i;
+
+    if(SD_GETCSD(QSPIx, csd)!=0) return 0;
+    if((csd[3] & 0x07) > 3) return 0;
+
+    unit = 10000;
+    for(i = 0; i < (csd[3] & 0x07); i++)unit *= 10;
+    return SD_TranSpeedMul[(csd[3] >> 3) & 0x0F] * unit;
+}
+
+/**
+ * \brief  Select the fastest SCKDIV allowed by TRAN_SPEED and SD_SPI_BOARD_MAX_CLK
+ * \details Block 0 is read at the identification clock and compared against
+ *          a read at each candidate clock, the first one that matches is kept.
+ * \return 0 when a faster clock was verified, 1 when staying at the init clock
+ */
+uint8_t SD_SpeedRamp(QSPI_TypeDef* QSPIx)
+{
+    uint32_t limit;
+    uint8_t i;
+
+    SD_SpeedIdx = SD_SPEED_NUM - 1;
+    SD_SpeedTop = SD_SPEED_NUM - 1;
+    SD_CleanRun = 0;
+    SPI_setspeed(QSPIx, SD_SPI_INIT_PRESCALER);
+
+    limit = SD_GetTranSpeed(QSPIx);
+    if(limit == 0)return 1;
+    if(limit > SD_SPI_BOARD_MAX_CLK)limit = SD_SPI_BOARD_MAX_CLK;
+    if(SD_ReadDisk(QSPIx, SD_VerifyBuf[0], 0, 1))return 1;
+
+    for(i = 0; i < SD_SPEED_NUM - 1; i++)
+    {
+        if(SD_SpeedClk(i) > limit)continue;
+        SPI_setspeed(QSPIx, SD_SpeedTab[i]);
+        if(SD_ReadDisk(QSPIx, SD_VerifyBuf[1], 0, 1) == 0 &&
+           memcmp(SD_VerifyBuf[0], SD_VerifyBuf[1], MSD_BLOCKSIZE) == 0)
         {
-            r1=SD_ReceiveData(QSPIx, buf,512);
+            SD_SpeedIdx = i;
+            SD_SpeedTop = i;
+            return 0;
         }
-    }else
+    }
+    SPI_setspeed(QSPIx, SD_SPI_INIT_PRESCALER);
+    return 1;
+}
+
+/**
+ * \brief  Drop the SPI clock one step after a CRC error or timeout
+ * \return 0 on success, 1 when already at the slowest clock
+ */
+uint8_t SD_SpeedStepDown(QSPI_TypeDef* QSPIx)
+{
+    SD_CleanRun = 0;
+    if(SD_SpeedIdx >= SD_SPEED_NUM - 1)return 1;
+    SD_SpeedIdx++;
+    SD_SpeedStat.StepDowns++;
+    SPI_setspeed(QSPIx, SD_SpeedTab[SD_SpeedIdx]);
+    return 0;
+}
+
+/*
+ * Only a CRC error or a timeout says the clock may be too fast. Such a
+ * transfer is repeated up to SD_SPI_RETRIES times, first at the same clock
+ * so a one-off error costs no speed, then one clock step slower each time.
+ * After SD_SPI_STEP_UP_RUN clean transfers a stepped down clock goes one
+ * step back toward the one SD_SpeedRamp verified.
+ */
+static uint8_t SD_DiskRetry(QSPI_TypeDef* QSPIx, uint8_t write, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    uint8_t err;
+    uint8_t tries = 0;
+
+    for(;;)
     {
-        r1=SD_sendcmd(QSPIx, CMD18,sector,0X01);
-        do
-        {
-            r1=SD_ReceiveData(QSPIx, buf,512);
-            buf+=512;
-        }while(--cnt && r1==0);
-        SD_sendcmd(QSPIx, CMD12,0,0X01);
+        err = write ? SD_WriteDisk(QSPIx, buf, sector, cnt) : SD_ReadDisk(QSPIx, buf, sector, cnt);
+        if(err != SD_ERR_CRC && err != SD_ERR_TIMEOUT)break;
+        SD_CleanRun = 0;
+        if(tries == SD_SPI_RETRIES)break;
+        if(tries++ != 0)SD_SpeedStepDown(QSPIx);    /* stays at the slowest clock once there */
     }
-    SD_CS(QSPIx, 0);
-    return r1;
+    if(err == 0 && SD_SpeedIdx > SD_SpeedTop && ++SD_CleanRun >= SD_SPI_STEP_UP_RUN)
+    {
+        SD_CleanRun = 0;
+        SD_SpeedIdx--;
+        SD_SpeedStat.StepUps++;
+        SPI_setspeed(QSPIx, SD_SpeedTab[SD_SpeedIdx]);
+    }
+    return err;
+}
+
+/**
+ * \brief  SD_ReadDisk that steps the clock down on CRC errors and timeouts
+ * \return 0 on success, SD_ERR_* of the last attempt otherwise
+ */
+uint8_t SD_ReadDiskRetry(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    return SD_DiskRetry(QSPIx, 0, buf, sector, cnt);
+}
+
+/**
+ * \brief  SD_WriteDisk that steps the clock down on CRC errors and timeouts
+ * \return 0 on success, SD_ERR_* of the last attempt otherwise
+ */
+uint8_t SD_WriteDiskRetry(QSPI_TypeDef* QSPIx, uint8_t*buf,uint32_t sector,uint8_t cnt)
+{
+    return SD_DiskRetry(QSPIx, 1, buf, sector, cnt);
+}
+
+/**
+ * \brief  SPI clock the transfers currently run at
+ * \return clock in Hz
+ */
+uint32_t SD_SpeedHz(void)
+{
+    return SD_SpeedClk(SD_SpeedIdx);
 }
 
 uint8_t spi_readwrite(QSPI_TypeDef* QSPIx, uint8_t Txdata){
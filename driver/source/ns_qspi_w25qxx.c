@@ -109,14 +109,19 @@ void SPI_FLASH_PageWrite(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t WriteAd
         FLASH_ERROR("SPI_FLASH_PageWrite too large!");
     }
 
-    /* data input*/
+    /* data input, queued in the transmit FIFO, with DIR TX nothing comes back */
+    QSPIx->FMT |= QSPI_FMT_DIR_TX;
     while (NumByteToWrite--)
     {
         /* Send the current byte data to be written */
-        SPI_FLASH_SendByte(QSPIx, *pBuffer);
+        while (SET == QSPI_GetFlag(QSPIx, QSPI_STATUS_TX_FULL)){}
+        QSPI_SendData(QSPIx, *pBuffer);
         /* point to the next byte of data */
         pBuffer++;
     }
+    /* the last bytes have to leave before CS goes high */
+    while (SET == QSPI_GetFlag(QSPIx, QSPI_STATUS_BUSY)){}
+    QSPIx->FMT &= ~QSPI_FMT_DIR_TX;
 
     /* stop signal FLASH: CS high level */
     SPI_CS(QSPIx, 0);
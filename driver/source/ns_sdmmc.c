@@ -20,6 +20,9 @@
 #include "ns.h"
 #include "ns_sdio.h"
 #include "ns_sdmmc.h"
+#if SDMMC_BOUNCE_M2M
+#include "ns_udma.h"
+#endif
 #include <string.h>
 
 uint8_t CardType;
@@ -37,6 +40,25 @@ uint32_t CID_Tab[4];
 SDIO_CmdInitTypeDef SDIO_CmdInitStructure;
 SDIO_DataSetupTypeDef SDIO_DataSetupStruct;
 SDIO_DmaCfgTypeDef SDIO_DmaCfgStruct;
+static uint8_t EmmcCacheOn = 0;
+/* SDMMC_Profile slot of the card in the slot, NULL before the first SDMMC_Init */
+static SDMMC_ProfileTypeDef *CardProfile;
+static uint32_t InitCount;
+SDMMC_BusCfgTypeDef SDMMC_BusCfg = {
+    .InitClkDiv = 0x31,
+    .MinClkDiv = 0,
+    .DefaultSpeedHz = 25000000,
+    .HighSpeedHz = 50000000,
+    .DataTimeout = SDMMC_DATATIMEOUT,
+    .HighSpeedEn = 1,
+};
+SDMMC_CompletionTypeDef SDMMC_Completion;
+SDMMC_CardCapsTypeDef SDMMC_CardCaps;
+SDMMC_ProfileTypeDef SDMMC_Profile[SDMMC_PROFILE_NUM];
+SDMMC_RetryTypeDef SDMMC_Retry = {
+    .MaxRetries = 2,
+    .MaxReinits = 3,
+};
 
 static SDMMC_Error CmdError(SDIO_TypeDef *SDIOx);
 static SDMMC_Error CmdResp1Error(SDIO_TypeDef *SDIOx, uint32_t cmd);
@@ -47,6 +69,200 @@ static SDMMC_Error CmdResp6Error(SDIO_TypeDef *SDIOx, uint32_t cmd, uint16_t *pr
 static SDMMC_Error SDEnWideBus(SDIO_TypeDef *SDIOx, uint8_t enx);
 static SDMMC_Error IsCardProgramming(SDIO_TypeDef *SDIOx, uint8_t *pstatus);
 static SDMMC_Error FindSCR(SDIO_TypeDef *SDIOx, uint16_t rca, uint32_t *pscr);
+static SDMMC_Error ReadDataPolled(SDIO_TypeDef *SDIOx, uint32_t cmd, uint32_t arg, uint32_t width, uint32_t *buf, uint32_t len);
+static SDMMC_Error ProbeCard(SDIO_TypeDef *SDIOx);
+static SDMMC_Error LoadCardProfile(SDIO_TypeDef *SDIOx);
+static SDMMC_Error SetBlockLen(SDIO_TypeDef *SDIOx, uint32_t blksize);
+static SDMMC_Error SDSwitchHighSpeed(SDIO_TypeDef *SDIOx);
+static SDMMC_Error EmmcSwitch(SDIO_TypeDef *SDIOx, uint32_t index, uint32_t value);
+static SDMMC_Error EmmcNegotiateBus(SDIO_TypeDef *SDIOx);
+
+/**
+  * \brief  Sleep until one of the events in mask has been signalled.
+  * \details Default for bare metal: WFI with interrupts masked, so a
+  *          completion arriving between the check and the WFI still wakes
+  *          the core. Every wake up counts against timeout, a periodic tick
+  *          bounds the wait that way; without one it relies on the controller
+  *          data timeout ending a stalled transfer with EOT. Once EOT is
+  *          posted and mask is still not met no interrupt is coming anymore,
+  *          the wait then polls SDMMC_DMA_DRAIN_POLLS times for the DMA to
+  *          drain and gives up. An RTOS port overrides this and
+  *          SDMMC_EventSignal, e.g. with a semaphore taken with a timeout, so
+  *          other tasks run during the transfer.
+  * \param  mask SDMMC_EVT_* bits
+  * \param  timeout wake ups to wait at most
+  * \retval SDMMC_OK, SDMMC_DATA_TIMEOUT when mask was not signalled in time
+  */
+__WEAK SDMMC_Error SDMMC_EventWait(uint32_t mask, uint32_t timeout)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t drain = SDMMC_DMA_DRAIN_POLLS;
+
+    __disable_irq();
+    while((SDMMC_Completion.Events & mask) == 0)
+    {
+        if(SDMMC_Completion.Events & SDMMC_EVT_EOT)
+        {
+            if(drain-- == 0)
+            {
+                errorstatus = SDMMC_DATA_TIMEOUT;
+                break;
+            }
+        }else
+        {
+            if(timeout-- == 0)
+            {
+                errorstatus = SDMMC_DATA_TIMEOUT;
+                break;
+            }
+            __WFI();
+        }
+        __enable_irq();
+        __disable_irq();
+    }
+    __enable_irq();
+    return errorstatus;
+}
+
+/**
+  * \brief  Called from the SDIO0 interrupt handlers after events were posted.
+  * \param  events SDMMC_EVT_* bits just set
+  */
+__WEAK void SDMMC_EventSignal(uint32_t events)
+{
+    (void)events;
+}
+
+/**
+  * \brief  SDIO0 interrupt: end of transfer.
+  * \details EOT stays set for the driver to check, the interrupt is masked
+  *          instead and armed again by the next wait.
+  */
+void SDMMC_IRQHandler(void)
+{
+    if((SDIO0->IE & SDIO_IE_EOT_IRQ) && SDIO_GetFlagStatus(SDIO0, SDIO_STATUS_EOT))
+    {
+        SDIO_InterruptEn(SDIO0, SDIO_IE_EOT_IRQ, DISABLE);
+        SDMMC_Completion.Events |= SDMMC_EVT_EOT;
+        SDMMC_EventSignal(SDMMC_EVT_EOT);
+    }
+}
+
+/**
+  * \brief  SDIO0 DMA interrupt: RX or TX channel finished, or half of a stream ring.
+  */
+void SDMMC_DMA_IRQHandler(void)
+{
+    uint32_t stat = SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_EN);
+
+    if(stat == 0) return;
+    SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, stat);
+    SDMMC_Completion.Events |= stat;
+    SDMMC_EventSignal(stat);
+}
+
+/**
+  * \brief  Install the SDIO0 and SDIO0 DMA interrupt handlers.
+  * \details From then on the drivers wait for DMA and end of transfer through
+  *          SDMMC_EventWait instead of spinning on the status registers.
+  * \param  SDIOx select the SDIO peripheral, only SDIO0 has interrupt lines.
+  * \retval SDMMC_Error status
+  */
+SDMMC_Error SDMMC_IrqInit(SDIO_TypeDef *SDIOx)
+{
+    if(SDIOx != SDIO0) return SDMMC_INVALID_PARAMETER;
+
+    SDMMC_Completion.Enabled = 0;
+    SDMMC_Completion.Events = 0;
+    SDIO_InterruptEn(SDIOx, SDIO_IE_EOT_IRQ, DISABLE);
+    SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_CLR | TX_FTRANS_IRQ_CLR);
+    SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_EN | TX_FTRANS_IRQ_EN, ENABLE);
+    if(ECLIC_Register_IRQ(SDIO0_DMA_IRQn, ECLIC_NON_VECTOR_INTERRUPT, ECLIC_LEVEL_TRIGGER, 1,
+                          SDMMC_IRQ_PRIORITY, SDMMC_DMA_IRQHandler) != 0) return SDMMC_INTERNAL_ERROR;
+    if(ECLIC_Register_IRQ(SDIO0_IRQn, ECLIC_NON_VECTOR_INTERRUPT, ECLIC_LEVEL_TRIGGER, 1,
+                          SDMMC_IRQ_PRIORITY, SDMMC_IRQHandler) != 0) return SDMMC_INTERNAL_ERROR;
+    SDMMC_Completion.Enabled = 1;
+    __enable_irq();
+    return SDMMC_OK;
+}
+
+/* take events posted by the interrupt handlers, sleeping until they arrive */
+static SDMMC_Error CompletionTake(uint32_t mask, uint32_t timeout)
+{
+    SDMMC_Error errorstatus = SDMMC_EventWait(mask, timeout);
+
+    __disable_irq();
+    if(errorstatus != SDMMC_OK)
+    {
+        /* nothing of the abandoned transfer may end the next wait early */
+        SDIO_InterruptEn(SDIO0, SDIO_IE_EOT_IRQ, DISABLE);
+        mask |= SDMMC_EVT_EOT;
+    }
+    SDMMC_Completion.Events &= ~mask;
+    __enable_irq();
+    return errorstatus;
+}
+
+/**
+  * \brief  Wait for a full or half transfer status bit of the RX or TX DMA channel.
+  * \details Besides the timeout, the wait ends once the controller has seen
+  *          EOT and the channel still has not finished after
+  *          SDMMC_DMA_DRAIN_POLLS more polls, a completion that got lost does
+  *          not hang the caller. In interrupt mode EOT is armed for this.
+  * \retval SDMMC_OK, SDMMC_DATA_TIMEOUT
+  */
+static SDMMC_Error WaitDmaDone(SDIO_TypeDef *SDIOx, uint32_t stat, uint32_t timeout)
+{
+    uint32_t drain = SDMMC_DMA_DRAIN_POLLS;
+
+    if(SDMMC_Completion.Enabled && (SDIOx == SDIO0))
+    {
+        /* EOT is armed again, a posted one can only be left from before */
+        __disable_irq();
+        SDMMC_Completion.Events &= ~SDMMC_EVT_EOT;
+        __enable_irq();
+        SDIO_InterruptEn(SDIOx, SDIO_IE_EOT_IRQ, ENABLE);
+        return CompletionTake(stat, timeout);
+    }
+    while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, stat))
+    {
+        if(--timeout == 0) return SDMMC_DATA_TIMEOUT;
+        if((SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) != RESET) && (drain-- == 0)) return SDMMC_DATA_TIMEOUT;
+    }
+    SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, stat);
+    return SDMMC_OK;
+}
+
+/* the DMA did not finish, stop the data path, getting the card back is up to the caller */
+static SDMMC_Error DmaAbort(SDIO_TypeDef *SDIOx)
+{
+    SDIO_DmaEn(SDIOx, DISABLE);
+    SDIO_ClearDataSetup(SDIOx);
+    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+    return SDMMC_DATA_TIMEOUT;
+}
+
+/* wait for EOT of the current data transfer, the flag is left for the caller */
+static SDMMC_Error WaitTransferEnd(SDIO_TypeDef *SDIOx, uint32_t timeout)
+{
+    if(SDMMC_Completion.Enabled && (SDIOx == SDIO0))
+    {
+        /* already posted during the DMA wait, a stale one has its flag cleared */
+        if(!(SDMMC_Completion.Events & SDMMC_EVT_EOT) || (SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) == RESET))
+        {
+            __disable_irq();
+            SDMMC_Completion.Events &= ~SDMMC_EVT_EOT;
+            __enable_irq();
+            SDIO_InterruptEn(SDIOx, SDIO_IE_EOT_IRQ, ENABLE);
+        }
+        return CompletionTake(SDMMC_EVT_EOT, timeout);
+    }
+    while(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) == RESET)
+    {
+        if(--timeout == 0) return SDMMC_DATA_TIMEOUT;
+    }
+    return SDMMC_OK;
+}
 
 static SDMMC_Error CmdError(SDIO_TypeDef *SDIOx)
 {
@@ -208,7 +424,7 @@ static SDMMC_Error IsCardProgramming(SDIO_TypeDef *SDIOx, uint8_t *pstatus)
         SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
         return SDMMC_CMD_RSP_TIMEOUT;
     }
-    if(SDIOx->RSP0 != SDMMC_CMD_SEND_STATUS) return SDMMC_ILLEGAL_CMD;
+    if(((SDIOx->RSP1 & 0x3f) << 8) != SDMMC_CMD_SEND_STATUS) return SDMMC_ILLEGAL_CMD;
     SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
     respR1 = SDIOx->RSP0;
     *pstatus = ADDR8(((respR1  >>  9) & 0x0000000F));
@@ -235,7 +451,15 @@ SDMMC_Error SDMMC_PowerON(SDIO_TypeDef *SDIOx)
     SDMMC_Error errorstatus = SDMMC_OK;
     uint32_t response = 0, count = 0, validvoltage = 0, status = 0;
 
-    SDIO_Clock_Set(SDIOx, 0x31);
+    SDMMC_BusCfg.Negotiated = 0;
+    SDMMC_CardCaps.Valid = 0;
+    SDMMC_BusCfg.Timing = SDMMC_TIMING_LEGACY;
+    SDMMC_BusCfg.Width = SDIO_DATA_SETUP_MODE_SINGLE;
+    SDMMC_BusCfg.BlockLen = 0;
+    SDMMC_BusCfg.ClkDiv = SDMMC_BusCfg.InitClkDiv;
+    SDIO_CfgDdrMode(SDIOx, DISABLE);
+    SDIO_Clock_Set(SDIOx, SDMMC_BusCfg.InitClkDiv);
+    SDIO_SetDateTimeout(SDIOx, SDMMC_BusCfg.DataTimeout);
     for(i = 0;i<74;i++){
         SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
         SDIO_CmdInitStructure.SDIO_Argument= 0x00;
@@ -445,17 +669,17 @@ SDMMC_Error EmmcReadExtCsd(SDIO_TypeDef *SDIOx, EmmcCardInfo *E)
 {
     SDMMC_Error Result = SDMMC_OK;
     uint32_t count = 0;
+    uint32_t timeout = SDMMC_DATATIMEOUT;
     uint32_t *ExtCsdBuf;
     ExtCsdBuf = (uint32_t *)(&(E->EmmcExtCsd.CsdBuf[0]));
 
     SDIO_DataSetupStructInit(SDIOx, &SDIO_DataSetupStruct);
     SDIO_DataSetupStruct.Data_en = SDIO_DATA_SETUP_CHANNEL_ENABLE;
     SDIO_DataSetupStruct.Data_rwn = SDIO_DATA_SETUP_RWN_READ;
-    SDIO_DataSetupStruct.Data_mode = SDIO_DATA_SETUP_MODE_SINGLE;
+    SDIO_DataSetupStruct.Data_mode = SDMMC_BusCfg.Width;
     SDIO_DataSetupStruct.Block_num = SDIO_DATA_SETUP_BLOCK_NUM(0);
     SDIO_DataSetupStruct.Block_size = SDIO_DATA_SETUP_BLOCK_SIZE(512 - 1);
     SDIO_DataSetup(SDIOx, &SDIO_DataSetupStruct);
-    SDIO_SetDateTimeout(SDIOx, 0xffffffff);
     /* CMD8 */
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
     SDIO_CmdInitStructure.SDIO_Argument = 0x00;
@@ -464,16 +688,24 @@ SDMMC_Error EmmcReadExtCsd(SDIO_TypeDef *SDIOx, EmmcCardInfo *E)
     SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
     SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_DISABLE;
     SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-    
-    while (count < (512 / 4)) {
-        while (SDIO_GET_IP_FLAG(SDIOx, SDIO_IP_RXEMPTY)) {
+
+    /* also used to verify a new bus mode, so a silent bus must not hang here */
+    while ((count < (512 / 4)) && (timeout > 0)) {
+        if (!SDIO_GET_IP_FLAG(SDIOx, SDIO_IP_RXEMPTY)) {
+            *(ExtCsdBuf + count) = SDIO_ReadData(SDIOx);
+            count++;
+        } else {
+            timeout--;
         }
-        *(ExtCsdBuf + count) = SDIO_ReadData(SDIOx);
-        count++;
     }
-
-    while (!SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT)) {
-    };
+    while (!SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) && (timeout > 0)) {
+        timeout--;
+    }
+    if (timeout == 0) {
+        Result = SDMMC_DATA_TIMEOUT;
+    } else if (SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET) {
+        Result = SDMMC_DATA_CRC_FAIL;
+    }
 
     /*!< Clear all the static flags */
     SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
@@ -556,6 +788,10 @@ SDMMC_Error EmmcGetCardInfo(EmmcCardInfo *E, uint32_t *CSD_Tab,
                               E->EmmcExtCsd.EXT_CSD.SEC_COUNT[1] << 8 |
                               E->EmmcExtCsd.EXT_CSD.SEC_COUNT[0]) *
                    E->CardBlockSize);
+    E->CacheSize = (uint32_t)E->EmmcExtCsd.EXT_CSD.CACHE_SIZE[3] << 24 |
+                   (uint32_t)E->EmmcExtCsd.EXT_CSD.CACHE_SIZE[2] << 16 |
+                   (uint32_t)E->EmmcExtCsd.EXT_CSD.CACHE_SIZE[1] << 8 |
+                   E->EmmcExtCsd.EXT_CSD.CACHE_SIZE[0];
 
     E->EmmcCsd.EraseGrSize = (tmp & 0x40) >> 6;
     E->EmmcCsd.EraseGrMul = (tmp & 0x3F) << 1;
@@ -665,22 +901,432 @@ SDMMC_Error EmmcGetCardInfo(EmmcCardInfo *E, uint32_t *CSD_Tab,
 SDMMC_Error SDMMC_Init(SDIO_TypeDef *SDIOx)
 {
     SDMMC_Error errorstatus = SDMMC_OK;
-    uint8_t clkdiv = 0;
+    /* CMD0 drops whatever still sits in the eMMC cache, push it out first */
+    if(EmmcCacheOn) SDMMC_FlushCache(SDIOx);
+    EmmcCacheOn = 0;
     errorstatus = SDMMC_PowerON(SDIOx);
     if(errorstatus == SDMMC_OK) errorstatus = SDMMC_InitializeCards(SDIOx);
     if(errorstatus == SDMMC_OK) errorstatus = SDMMC_GetCardInfo( & SDCardInfo);
     if(errorstatus == SDMMC_OK) errorstatus = SDMMC_SelectDeselect(SDIOx, (uint32_t)(SDCardInfo.RCA << 16));
-    if (errorstatus == SDMMC_OK) {
-        if (SDIO_MULTIMEDIA_CARD == CardType) {
-            errorstatus = EmmcReadExtCsd(SDIOx, &MyEmmcCardInfo);
-            if (errorstatus == SDMMC_OK) errorstatus = EmmcGetCardInfo(&MyEmmcCardInfo, &CSD_Tab[0], &CID_Tab[0], RCA);
+    if(errorstatus == SDMMC_OK) errorstatus = LoadCardProfile(SDIOx);
+    /* eMMC bus width is part of the timing negotiation */
+    if ((errorstatus == SDMMC_OK) && (SDIO_MULTIMEDIA_CARD != CardType)) errorstatus = SDMMC_EnableWideBusOperation(SDIOx, BusWidth);
+    if (errorstatus == SDMMC_OK) errorstatus = SDMMC_NegotiateBus(SDIOx);
+    /* the negotiation verified the bus by reading EXT_CSD, also after a profile hit */
+    if ((errorstatus == SDMMC_OK) && (SDIO_MULTIMEDIA_CARD == CardType))
+        errorstatus = EmmcGetCardInfo(&MyEmmcCardInfo, &CSD_Tab[0], &CID_Tab[0], RCA);
+    if ((errorstatus == SDMMC_OK) && (CardProfile != NULL)) {
+        CardProfile->Fallback = SDMMC_BusCfg.Fallback;
+        CardProfile->ClkStep = SDMMC_BusCfg.ClkStep;
+    }
+#if SDMMC_EMMC_CACHE_EN
+    if ((errorstatus == SDMMC_OK) && (SDIO_MULTIMEDIA_CARD == CardType) && (MyEmmcCardInfo.CacheSize != 0) &&
+        (MyEmmcCardInfo.EmmcExtCsd.EXT_CSD.EXT_CSD_REV >= SDMMC_EXT_CSD_REV_4_5)) {
+        /* a device that refuses the cache still works without it */
+        if (EmmcSwitch(SDIOx, SDMMC_EXT_CSD_CACHE_CTRL, 1) == SDMMC_OK) EmmcCacheOn = 1;
+    }
+#endif
+    return errorstatus;
+}
+
+/**
+  * \brief  Write the eMMC volatile cache back to flash.
+  * \details Issues the FLUSH_CACHE switch and waits until the device has left
+  *          programming. Does nothing on SD cards or when the cache is off.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_Error status
+  */
+SDMMC_Error SDMMC_FlushCache(SDIO_TypeDef *SDIOx)
+{
+    if(EmmcCacheOn == 0) return SDMMC_OK;
+    return EmmcSwitch(SDIOx, SDMMC_EXT_CSD_FLUSH_CACHE, 1);
+}
+
+static SDMMC_Error EraseCmd(SDIO_TypeDef *SDIOx, uint32_t cmd, uint32_t arg)
+{
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = arg;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = cmd;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    return CmdResp1Error(SDIOx, cmd);
+}
+
+/**
+  * \brief  Tell the card that sectors start..end no longer hold data.
+  * \details SD cards get a CMD32/CMD33/CMD38 erase. eMMC devices get DISCARD
+  *          (4.5 and later) or TRIM, both work on single sectors; a plain
+  *          eMMC erase would round out to whole erase groups and is not used.
+  *          Pre-erased sectors are later written without a read-modify-write
+  *          inside the card.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  start first sector
+  * \param  end last sector, inclusive
+  * \retval SDMMC_REQUEST_NOT_APPLICABLE when the card has no usable erase
+  */
+SDMMC_Error SDMMC_Erase(SDIO_TypeDef *SDIOx, uint32_t start, uint32_t end)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t timeout = SDMMC_DATATIMEOUT;
+    uint32_t arg = SDMMC_ERASE_ARG;
+    uint8_t cardstate = 0;
+    uint8_t mmc = (SDIO_MULTIMEDIA_CARD == CardType);
+
+    if(end < start) return SDMMC_INVALID_PARAMETER;
+    if(mmc)
+    {
+        if(MyEmmcCardInfo.EmmcExtCsd.EXT_CSD.EXT_CSD_REV >= SDMMC_EXT_CSD_REV_4_5) arg = SDMMC_DISCARD_ARG;
+        else if(MyEmmcCardInfo.EmmcExtCsd.EXT_CSD.SEC_FEATURE_SUPPORT & SDMMC_EXT_CSD_SEC_GB_CL_EN) arg = SDMMC_TRIM_ARG;
+        else return SDMMC_REQUEST_NOT_APPLICABLE;
+    }else if((SDCardInfo.SDMMC_csd.CardComdClasses & SDMMC_CCCC_ERASE) == 0) return SDMMC_REQUEST_NOT_APPLICABLE;
+    if(SDMMC_BusCfg.Negotiated == 0)
+    {
+        errorstatus = SDMMC_Init(SDIOx);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+    }
+    if(CardType != SDIO_HIGH_CAPACITY_SD_CARD)
+    {
+        start <<= 9;
+        end <<= 9;
+    }
+
+    errorstatus = EraseCmd(SDIOx, mmc ? SDMMC_CMD_ERASE_GRP_START : SDMMC_CMD_SD_ERASE_GRP_START, start);
+    if(errorstatus == SDMMC_OK)
+        errorstatus = EraseCmd(SDIOx, mmc ? SDMMC_CMD_ERASE_GRP_END : SDMMC_CMD_SD_ERASE_GRP_END, end);
+    if(errorstatus == SDMMC_OK)
+        errorstatus = EraseCmd(SDIOx, SDMMC_CMD_ERASE, arg);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    do {
+        errorstatus = IsCardProgramming(SDIOx, &cardstate);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+    } while((SDMMC_CARD_PROGRAMMING == cardstate) && (--timeout > 0));
+    if(timeout == 0) return SDMMC_DATA_TIMEOUT;
+    if(SDIOx->RSP0 & SDMMC_OCR_ERASE_SEQ_ERR) return SDMMC_ERASE_SEQ_ERR;
+    if(SDIOx->RSP0 & SDMMC_OCR_BAD_ERASE_PARAM) return SDMMC_BAD_ERASE_PARAM;
+    if(SDIOx->RSP0 & SDMMC_OCR_WP_ERASE_SKIP) return SDMMC_WP_ERASE_SKIP;
+    return SDMMC_OK;
+}
+
+/**
+  * \brief  Send CMD16 unless the card already uses this block length.
+  * \details In DDR52 the block length is fixed at 512 and CMD16 is illegal,
+  *          nothing is sent and any other length is refused.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  blksize block length in bytes, a power of two up to 2048.
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error SetBlockLen(SDIO_TypeDef *SDIOx, uint32_t blksize)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+
+    if((blksize == 0) || (blksize > 2048) || ((blksize & (blksize-1)) != 0)) return SDMMC_INVALID_PARAMETER;
+    if(SDMMC_BusCfg.BlockLen == blksize) return SDMMC_OK;
+    if(SDMMC_BusCfg.Timing == SDMMC_TIMING_DDR52)
+    {
+        if(blksize != 512) return SDMMC_REQUEST_NOT_APPLICABLE;
+        SDMMC_BusCfg.BlockLen = 512;
+        return SDMMC_OK;
+    }
+
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = blksize;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCKLEN;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCKLEN);
+    SDMMC_BusCfg.BlockLen = (errorstatus == SDMMC_OK) ? blksize : 0;
+    return errorstatus;
+}
+
+/**
+  * \brief  Send a command that answers with one short data block and poll the block in.
+  * \details Serves the CMD6 switch status, the SCR and the SD status. EOT only
+  *          rises once the data has been received, so the response is not
+  *          waited for separately. The block length must already be set.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  cmd SDMMC_CMD_x index
+  * \param  arg command argument
+  * \param  width SDIO_DATA_SETUP_MODE_x the card sends the data on
+  * \param  buf word buffer, len bytes
+  * \param  len block length in bytes, a multiple of 4
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error ReadDataPolled(SDIO_TypeDef *SDIOx, uint32_t cmd, uint32_t arg, uint32_t width, uint32_t *buf, uint32_t len)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t count = 0;
+    uint32_t timeout = SDMMC_DATATIMEOUT;
+
+    SDIO_ClearDataSetup(SDIOx);
+    SDIO_DataSetupStructInit(SDIOx, &SDIO_DataSetupStruct);
+    SDIO_DataSetupStruct.Data_en = SDIO_DATA_SETUP_CHANNEL_ENABLE;
+    SDIO_DataSetupStruct.Data_rwn = SDIO_DATA_SETUP_RWN_READ;
+    SDIO_DataSetupStruct.Data_mode = width;
+    SDIO_DataSetupStruct.Block_num = SDIO_DATA_SETUP_BLOCK_NUM(0);
+    SDIO_DataSetupStruct.Block_size = SDIO_DATA_SETUP_BLOCK_SIZE(len - 1);
+    SDIO_DataSetup(SDIOx, &SDIO_DataSetupStruct);
+
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = arg;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = cmd;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+
+    while((count < (len / 4)) && (timeout > 0))
+    {
+        if(!SDIO_GET_IP_FLAG(SDIOx, SDIO_IP_RXEMPTY)) buf[count++] = SDIO_ReadData(SDIOx);
+        else if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_ERR)) break;
+        else timeout--;
+    }
+    while(!SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) && (timeout > 0)) timeout--;
+    if(timeout == 0) errorstatus = SDMMC_DATA_TIMEOUT;
+    else if(SDIO_GetFlagStatus(SDIOx, SDIO_CMD0TIMEOUT) != RESET) errorstatus = SDMMC_CMD_RSP_TIMEOUT;
+    else if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET) errorstatus = SDMMC_DATA_CRC_FAIL;
+    else if(count < (len / 4)) errorstatus = SDMMC_DATA_TIMEOUT;
+    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+    SDIO_ClearDataSetup(SDIOx);
+    return errorstatus;
+}
+
+/**
+  * \brief  Switch an SD card to high speed with CMD6 and check the switch status.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_OK when the card now runs in high speed mode
+  */
+static SDMMC_Error SDSwitchHighSpeed(SDIO_TypeDef *SDIOx)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t status[SDMMC_SWITCH_STATUS_LEN / 4];
+    uint8_t *pstatus = (uint8_t *)status;
+
+    errorstatus = SetBlockLen(SDIOx, SDMMC_SWITCH_STATUS_LEN);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    /* SD 1.0 cards do not answer CMD6 at all */
+    errorstatus = ReadDataPolled(SDIOx, SDMMC_CMD_HS_SWITCH, SDMMC_SWITCH_HIGH_SPEED, SDMMC_BusCfg.Width,
+                                 status, SDMMC_SWITCH_STATUS_LEN);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    /* function group 1 must report function 1 (high speed) as selected */
+    if(((pstatus[13] & 0x02) == 0) || ((pstatus[16] & 0x0F) != 1)) return SDMMC_SWITCH_ERROR;
+    return SDMMC_OK;
+}
+
+/**
+  * \brief  CLK_DIV for the fastest card clock that does not exceed hz.
+  * \param  hz card clock limit
+  * \retval CLK_DIV, never below SDMMC_BusCfg.MinClkDiv
+  */
+static uint32_t ClkDivForHz(uint32_t hz)
+{
+    uint32_t clkdiv;
+
+    /* f_sdclk = SystemCoreClock / (2 * (CLK_DIV + 1)), round the divider up */
+    clkdiv = (SystemCoreClock + 2 * hz - 1) / (2 * hz);
+    clkdiv = (clkdiv > 0) ? (clkdiv - 1) : 0;
+    if(clkdiv < SDMMC_BusCfg.MinClkDiv) clkdiv = SDMMC_BusCfg.MinClkDiv;
+    return clkdiv;
+}
+
+/**
+  * \brief  Program the host side of the bus for a timing mode.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  timing SDMMC_TimingTypeDef the card has been switched to
+  * \param  width SDIO_DATA_SETUP_MODE_x the card has been switched to
+  */
+static void SetHostTiming(SDIO_TypeDef *SDIOx, uint8_t timing, uint32_t width)
+{
+    uint32_t hz = (timing == SDMMC_TIMING_LEGACY) ? SDMMC_BusCfg.DefaultSpeedHz : SDMMC_BusCfg.HighSpeedHz;
+
+    hz >>= SDMMC_BusCfg.ClkStep;
+    SDIO_CfgDdrMode(SDIOx, (timing == SDMMC_TIMING_DDR52) ? ENABLE : DISABLE);
+    SDMMC_BusCfg.ClkDiv = ClkDivForHz(hz);
+    SDIO_Clock_Set(SDIOx, SDMMC_BusCfg.ClkDiv);
+    SDMMC_BusCfg.Timing = timing;
+    SDMMC_BusCfg.Width = width;
+}
+
+/**
+  * \brief  Write one EXT_CSD byte with CMD6 SWITCH and wait for the card to apply it.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  index EXT_CSD byte index
+  * \param  value new value of the byte
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error EmmcSwitch(SDIO_TypeDef *SDIOx, uint32_t index, uint32_t value)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t timeout = SDMMC_DATATIMEOUT;
+    uint8_t cardstate = 0;
+
+    /* access mode 3 (write byte), command set 0 */
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = (0x03U << 24) | (index << 16) | (value << 8);
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_HS_SWITCH;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_HS_SWITCH);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    do {
+        errorstatus = IsCardProgramming(SDIOx, &cardstate);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+    } while((SDMMC_CARD_PROGRAMMING == cardstate) && (--timeout > 0));
+    if(timeout == 0) return SDMMC_DATA_TIMEOUT;
+    if(SDIOx->RSP0 & SDMMC_R1_SWITCH_ERROR) return SDMMC_SWITCH_ERROR;
+    return SDMMC_OK;
+}
+
+/**
+  * \brief  eMMC bus modes, fastest first. Negotiation walks down this list.
+  */
+static const struct {
+    uint8_t Timing;
+    uint32_t Width;
+} EmmcBusModes[] = {
+    {SDMMC_TIMING_DDR52,  SDIO_DATA_SETUP_MODE_OCTOL},
+    {SDMMC_TIMING_HS,     SDIO_DATA_SETUP_MODE_OCTOL},
+    {SDMMC_TIMING_DDR52,  SDIO_DATA_SETUP_MODE_QUAD},
+    {SDMMC_TIMING_HS,     SDIO_DATA_SETUP_MODE_QUAD},
+    {SDMMC_TIMING_LEGACY, SDIO_DATA_SETUP_MODE_OCTOL},
+    {SDMMC_TIMING_LEGACY, SDIO_DATA_SETUP_MODE_QUAD},
+    {SDMMC_TIMING_LEGACY, SDIO_DATA_SETUP_MODE_SINGLE},
+};
+#define EMMC_BUS_MODES  (sizeof(EmmcBusModes) / sizeof(EmmcBusModes[0]))
+
+/**
+  * \brief  Switch an eMMC device to the fastest bus mode both sides support.
+  * \details The card capabilities come from EXT_CSD DEVICE_TYPE, the host limits
+  *          from BusWidth, BusMode (SDIO_DDR_MODE allows DDR52) and
+  *          SDMMC_BusCfg.HighSpeedEn. Each candidate is applied with CMD6 to
+  *          HS_TIMING and BUS_WIDTH and then verified by reading EXT_CSD back
+  *          over the new bus. A CRC error or a mismatch moves on to the next
+  *          slower mode. Modes before SDMMC_BusCfg.Fallback are skipped.
+  *          CMD16 goes out first, DDR52 does not accept it afterwards.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error EmmcNegotiateBus(SDIO_TypeDef *SDIOx)
+{
+    SDMMC_Error errorstatus = SDMMC_ERROR;
+    EMMCEXT_CSD *ext = &MyEmmcCardInfo.EmmcExtCsd;
+    uint8_t devtype = SDMMC_CardCaps.DeviceType;
+    uint32_t i, buswidth, timing;
+    uint8_t mode;
+
+    errorstatus = SetBlockLen(SDIOx, 512);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+    errorstatus = SDMMC_ERROR;
+    for(i = SDMMC_BusCfg.Fallback; i < EMMC_BUS_MODES; i++)
+    {
+        mode = EmmcBusModes[i].Timing;
+        if(EmmcBusModes[i].Width > BusWidth) continue;
+        if((mode != SDMMC_TIMING_LEGACY) && ((SDMMC_BusCfg.HighSpeedEn == 0) || !(devtype & SDMMC_EXT_CSD_CARD_HS52))) continue;
+        if((mode == SDMMC_TIMING_DDR52) && ((BusMode != SDIO_DDR_MODE) || !(devtype & SDMMC_EXT_CSD_CARD_DDR52))) continue;
+
+        if(EmmcBusModes[i].Width == SDIO_DATA_SETUP_MODE_OCTOL) buswidth = SDMMC_EXT_CSD_WIDTH_8;
+        else if(EmmcBusModes[i].Width == SDIO_DATA_SETUP_MODE_QUAD) buswidth = SDMMC_EXT_CSD_WIDTH_4;
+        else buswidth = SDMMC_EXT_CSD_WIDTH_1;
+        if(mode == SDMMC_TIMING_DDR52) buswidth |= SDMMC_EXT_CSD_WIDTH_DDR;
+        timing = (mode == SDMMC_TIMING_LEGACY) ? 0 : 1;
+
+        /* DDR widths are only accepted once HS_TIMING is set, SDR goes width first */
+        SDIO_CfgDdrMode(SDIOx, DISABLE);
+        errorstatus = EmmcSwitch(SDIOx, SDMMC_EXT_CSD_HS_TIMING, timing);
+        if(errorstatus == SDMMC_OK) errorstatus = EmmcSwitch(SDIOx, SDMMC_EXT_CSD_BUS_WIDTH, buswidth);
+        if(errorstatus != SDMMC_OK) continue;
+
+        SetHostTiming(SDIOx, mode, EmmcBusModes[i].Width);
+        errorstatus = EmmcReadExtCsd(SDIOx, &MyEmmcCardInfo);
+        if((errorstatus == SDMMC_OK) && ((ext->EXT_CSD.BUS_WIDTH != buswidth) || (ext->EXT_CSD.HS_TIMING != timing)))
+        {
+            errorstatus = SDMMC_SWITCH_ERROR;
+        }
+        if(errorstatus == SDMMC_OK)
+        {
+            SDMMC_BusCfg.Fallback = i;
+            return SDMMC_OK;
         }
+        /* back to the identification clock before trying the next mode */
+        SetHostTiming(SDIOx, SDMMC_TIMING_LEGACY, SDIO_DATA_SETUP_MODE_SINGLE);
+        SDMMC_BusCfg.ClkDiv = SDMMC_BusCfg.InitClkDiv;
+        SDIO_Clock_Set(SDIOx, SDMMC_BusCfg.ClkDiv);
+    }
+    return errorstatus;
+}
+
+/**
+  * \brief  Make the next negotiation one level slower.
+  * \details Moves SDMMC_BusCfg.Fallback to the next bus mode (eMMC mode table,
+  *          SD high speed to default speed). Once the slowest mode is reached
+  *          SDMMC_BusCfg.ClkStep halves the card clock, up to
+  *          SDMMC_CLK_STEP_MAX times.
+  * \retval 1 stepped down, 0 nothing slower is left
+  */
+static uint8_t BusStepDown(void)
+{
+    uint8_t last = (SDIO_MULTIMEDIA_CARD == CardType) ? (EMMC_BUS_MODES - 1) : 1;
+
+    if(SDMMC_BusCfg.Fallback < last) SDMMC_BusCfg.Fallback++;
+    else if(SDMMC_BusCfg.ClkStep < SDMMC_CLK_STEP_MAX) SDMMC_BusCfg.ClkStep++;
+    else return 0;
+    /* the re-initialisation that follows must not restore the old level */
+    if(CardProfile != NULL)
+    {
+        CardProfile->Fallback = SDMMC_BusCfg.Fallback;
+        CardProfile->ClkStep = SDMMC_BusCfg.ClkStep;
+    }
+    return 1;
+}
+
+/**
+  * \brief  Settle the bus configuration once the card is in transfer state.
+  * \details SD cards already run on BusWidth and get the CMD6 high speed switch
+  *          when SDMMC_BusCfg.HighSpeedEn is set, eMMC devices go through
+  *          EmmcNegotiateBus. The block length is then fixed at 512 bytes.
+  *          Transfers keep this setting until one fails, which clears
+  *          SDMMC_BusCfg.Negotiated so the next SDMMC_ReadDisk or
+  *          SDMMC_WriteDisk runs the negotiation again from SDMMC_Init. A data
+  *          CRC error also moves SDMMC_BusCfg.Fallback one mode down.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_Error status
+  */
+SDMMC_Error SDMMC_NegotiateBus(SDIO_TypeDef *SDIOx)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint8_t timing = SDMMC_TIMING_LEGACY;
+
+    if(SDIO_MULTIMEDIA_CARD == CardType)
+    {
+        errorstatus = EmmcNegotiateBus(SDIOx);
+        if(errorstatus != SDMMC_OK) return errorstatus;
     }
-    if (errorstatus == SDMMC_OK) errorstatus = SDMMC_EnableWideBusOperation(SDIOx, BusWidth);
-    if((errorstatus == SDMMC_OK) || (SDIO_MULTIMEDIA_CARD == CardType))
+    else
     {
-        /*set clock divider here , use API: SDIO_Clock_Set(SDIOx, clkdiv); */
+        /* SD: 0 = high speed, 1 = default speed */
+        if(SDMMC_BusCfg.Fallback > 1) SDMMC_BusCfg.Fallback = 1;
+        SDMMC_BusCfg.Width = BusWidth;
+        if((SDMMC_BusCfg.HighSpeedEn != 0) && (SDMMC_BusCfg.Fallback == 0))
+        {
+            if(SDSwitchHighSpeed(SDIOx) == SDMMC_OK) timing = SDMMC_TIMING_HS;
+        }
+        if(timing == SDMMC_TIMING_LEGACY) SDMMC_BusCfg.Fallback = 1;
+        SetHostTiming(SDIOx, timing, BusWidth);
     }
+    errorstatus = SetBlockLen(SDIOx, 512);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    SDIO_SetDateTimeout(SDIOx, SDMMC_BusCfg.DataTimeout);
+    SDMMC_BusCfg.Negotiated = 1;
     return errorstatus;
 }
 
@@ -724,9 +1370,9 @@ SDMMC_Error SDMMC_WriteBlock(SDIO_TypeDef *SDIOx, uint8_t *buf, long long addr,
     SDIO_DataSetupStruct.Data_en = SDIO_DATA_SETUP_CHANNEL_ENABLE;
     SDIO_DataSetupStruct.Data_rwn = SDIO_DATA_SETUP_RWN_WRITE;
     if (CardType == SDIO_MULTIMEDIA_CARD) {
-        SDIO_DataSetupStruct.Data_mode = BusWidth;
+        SDIO_DataSetupStruct.Data_mode = SDMMC_BusCfg.Width;
     } else {
-        SDIO_DataSetupStruct.Data_mode = BusWidth;
+        SDIO_DataSetupStruct.Data_mode = SDMMC_BusCfg.Width;
     }
 
     SDIO_DataSetupStruct.Block_num = SDIO_DATA_SETUP_BLOCK_NUM(0);
@@ -734,8 +1380,6 @@ SDMMC_Error SDMMC_WriteBlock(SDIO_TypeDef *SDIOx, uint8_t *buf, long long addr,
         SDIO_DATA_SETUP_BLOCK_SIZE(blksize - 1);
 
     SDIO_DataSetup(SDIOx, &SDIO_DataSetupStruct);
-    SDIO_SetDateTimeout(SDIOx, 0xffffffff);
-    SDIO_Clock_Set(SDIOx, 0x00);
 
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
     SDIO_CmdInitStructure.SDIO_Argument = addr;
@@ -765,11 +1409,10 @@ SDMMC_Error SDMMC_WriteBlock(SDIO_TypeDef *SDIOx, uint8_t *buf, long long addr,
         SDIO_DmaCfgStruct.Tx_datasize = SDIO_TX_CFG_DATASIZE_WORD;
         SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
 
-        while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_STAT));
-        SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_CLR);
+        if(WaitDmaDone(SDIOx, TX_FTRANS_IRQ_STAT, SDMMC_DATATIMEOUT) != SDMMC_OK) return DmaAbort(SDIOx);
     }
 
-    while(!SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT)){};
+    if(WaitTransferEnd(SDIOx, SDMMC_DATATIMEOUT) != SDMMC_OK) return SDMMC_DATA_TIMEOUT;
     if(SDIO_GetFlagStatus(SDIOx, SDIO_CMD0TIMEOUT) != RESET)
     {
         SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
@@ -912,21 +1555,53 @@ SDMMC_Error SDMMC_GetCardInfo(SDMMC_CardInfo *cardinfo)
     return errorstatus;
 }
 
+/**
+  * \brief  Read the SD configuration register with ACMD51.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  rca relative card address
+  * \param  pscr pscr[1] receives SCR[63:32], pscr[0] SCR[31:0]
+  * \retval SDMMC_Error status
+  */
 static SDMMC_Error FindSCR(SDIO_TypeDef *SDIOx, uint16_t rca, uint32_t *pscr)
 {
-    uint32_t index = 0;
     SDMMC_Error errorstatus = SDMMC_OK;
     uint32_t tempscr[2] = {0, 0};
 
+    errorstatus = SetBlockLen(SDIOx, 8);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-    SDIO_CmdInitStructure.SDIO_Argument = ADDR32(8);
-    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCKLEN;
+    SDIO_CmdInitStructure.SDIO_Argument = ADDR32(rca << 16);
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_APP_CMD;
     SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
     SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
     SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
     SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
 
-    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCKLEN);
+    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_APP_CMD);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    /* the SCR is read before ACMD6, the card still sends on DAT0 only */
+    errorstatus = ReadDataPolled(SDIOx, SDMMC_CMD_SD_APP_SEND_SCR, 0, SDIO_DATA_SETUP_MODE_SINGLE, tempscr, 8);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    /* the FIFO packs the SCR bytes in transmission order, MSB first */
+    *(pscr+1) = ((tempscr[0] & SDMMC_0TO7BITS) << 24) | ((tempscr[0] & SDMMC_8TO15BITS) << 8) | ((tempscr[0] & SDMMC_16TO23BITS) >> 8) | ((tempscr[0] & SDMMC_24TO31BITS) >> 24);
+    *(pscr) = ((tempscr[1] & SDMMC_0TO7BITS) << 24) | ((tempscr[1] & SDMMC_8TO15BITS) << 8) | ((tempscr[1] & SDMMC_16TO23BITS) >> 8) | ((tempscr[1] & SDMMC_24TO31BITS) >> 24);
+    return errorstatus;
+}
+
+/**
+  * \brief  Read the 64 byte SD status with ACMD13.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  status receives the SD status, byte 0 holds bits 511:504
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error SDReadStatus(SDIO_TypeDef *SDIOx, uint32_t *status)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+
+    errorstatus = SetBlockLen(SDIOx, SDMMC_SD_STATUS_LEN);
     if(errorstatus != SDMMC_OK) return errorstatus;
 
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
@@ -936,49 +1611,159 @@ static SDMMC_Error FindSCR(SDIO_TypeDef *SDIOx, uint16_t rca, uint32_t *pscr)
     SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
     SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
     SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-
     errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_APP_CMD);
     if(errorstatus != SDMMC_OK) return errorstatus;
 
-    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-    SDIO_CmdInitStructure.SDIO_Argument = 0x0;
-    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SD_APP_SEND_SCR;
-    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    return ReadDataPolled(SDIOx, SDMMC_CMD_SD_APP_STAUS, 0, SDIO_DATA_SETUP_MODE_SINGLE, status, SDMMC_SD_STATUS_LEN);
+}
 
-    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SD_APP_SEND_SCR);
-    if(errorstatus != SDMMC_OK) return errorstatus;
+/**
+  * \brief  Decode the CSD TRAN_SPEED field.
+  * \param  tran TRAN_SPEED byte
+  * \param  mmc use the MMC time value table
+  * \retval clock limit in Hz, 0 for a reserved code
+  */
+static uint32_t CsdTranSpeedHz(uint8_t tran, uint8_t mmc)
+{
+    /* time value scaled by 10, SD and MMC differ at codes 6 and 11 */
+    static const uint8_t mul[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    uint32_t unit = 10000;
+    uint8_t v = mul[(tran >> 3) & 0x0F];
+    uint8_t i;
+
+    if((tran & 0x07) > 3) return 0;
+    if(mmc && (v == 25)) v = 26;
+    if(mmc && (v == 50)) v = 52;
+    for(i = 0; i < (tran & 0x07); i++) unit *= 10;
+    return v * unit;
+}
 
-    if(SDIO_GetFlagStatus(SDIOx, SDIO_CMD0TIMEOUT) != RESET)
-    {
-        SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
-        return SDMMC_CMD_RSP_TIMEOUT;
-    }
-    if(SDIO_GetFlagStatus(SDIOx, SDIO_CMDWrongDirection) != RESET)
+/**
+  * \brief  Probe SDMMC_CardCaps from the selected card.
+  * \details SD cards are asked for the SCR and the SD status, eMMC devices for
+  *          EXT_CSD. Runs in transfer state on the 1 bit bus at the
+  *          identification clock, this is the slow part of SDMMC_Init that a
+  *          profile hit skips.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error ProbeCard(SDIO_TypeDef *SDIOx)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    SDMMC_CardCapsTypeDef *caps = &SDMMC_CardCaps;
+    EMMCEXT_CSD *ext = &MyEmmcCardInfo.EmmcExtCsd;
+    uint32_t scr[2] = {0, 0};
+    uint32_t status[SDMMC_SD_STATUS_LEN / 4];
+    uint8_t *pstatus = (uint8_t *)status;
+    uint8_t mmc = (SDIO_MULTIMEDIA_CARD == CardType);
+    uint8_t wbl = (CSD_Tab[3] >> 22) & 0x0F;
+    uint8_t au;
+
+    memset(caps, 0, sizeof(*caps));
+    caps->MaxClkHz = CsdTranSpeedHz(CSD_Tab[0] & 0xFF, mmc);
+    if(wbl < 9) wbl = 9;
+    if(mmc)
     {
-        SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
-        return SDMMC_CMD_CRC_FAIL;
+        errorstatus = EmmcReadExtCsd(SDIOx, &MyEmmcCardInfo);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+        caps->SetBlockCount = 1;
+        caps->DeviceType = ext->EXT_CSD.DEVICE_TYPE;
+        if(caps->DeviceType & SDMMC_EXT_CSD_CARD_HS52) caps->MaxClkHz = 52000000;
+        caps->CacheSize = (uint32_t)ext->EXT_CSD.CACHE_SIZE[3] << 24 | (uint32_t)ext->EXT_CSD.CACHE_SIZE[2] << 16 |
+                          (uint32_t)ext->EXT_CSD.CACHE_SIZE[1] << 8 | ext->EXT_CSD.CACHE_SIZE[0];
+        /* HC_ERASE_GRP_SIZE counts 512KB, otherwise CSD ERASE_GRP_SIZE/ERASE_GRP_MULT */
+        if(ext->EXT_CSD.HC_ERASE_GRP_SIZE != 0) caps->EraseGroup = (uint32_t)ext->EXT_CSD.HC_ERASE_GRP_SIZE << 10;
+        else caps->EraseGroup = ((((CSD_Tab[2] >> 10) & 0x1F) + 1) * (((CSD_Tab[2] >> 5) & 0x1F) + 1)) << (wbl - 9);
     }
-    if(SDIO_GetFlagStatus(SDIOx, SDIO_CMDBusyTimeout) != RESET)
+    else
     {
-        SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
-        return SDMMC_CMD_CRC_FAIL;
+        errorstatus = FindSCR(SDIOx, RCA, scr);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+        caps->SdSpec = (scr[1] >> 24) & 0x0F;
+        caps->SdSpec3 = (scr[1] >> 15) & 0x01;
+        caps->BusWidths = (scr[1] >> 16) & 0x0F;
+        caps->SetBlockCount = (scr[1] & SDMMC_CMD23_SUPPORT) ? 1 : 0;
+        /* CSD SECTOR_SIZE in write blocks */
+        caps->EraseGroup = (((CSD_Tab[2] >> 7) & 0x7F) + 1) << (wbl - 9);
+
+        /* SD 1.0 cards have no SD status, the probe still succeeds without it */
+        if(SDReadStatus(SDIOx, status) == SDMMC_OK)
+        {
+            static const uint8_t speedclass[5] = {0, 2, 4, 6, 10};
+            static const uint8_t aumb[5] = {12, 16, 24, 32, 64};
+
+            if(pstatus[8] < 5) caps->SpeedClass = speedclass[pstatus[8]];
+            /* AU_SIZE 1..10 is 16KB << (n - 1), 11..15 are 12, 16, 24, 32 and 64MB */
+            au = pstatus[10] >> 4;
+            if((au != 0) && (au <= 10)) caps->AuSize = 32UL << (au - 1);
+            else if(au > 10) caps->AuSize = (uint32_t)aumb[au - 11] << 11;
+        }
     }
-    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
-    *(pscr+1) = ((tempscr[0] & SDMMC_0TO7BITS) << 24) | ((tempscr[0] & SDMMC_8TO15BITS) << 8) | ((tempscr[0] & SDMMC_16TO23BITS) >> 8) | ((tempscr[0] & SDMMC_24TO31BITS) >> 24);
-    *(pscr) = ((tempscr[1] & SDMMC_0TO7BITS) << 24) | ((tempscr[1] & SDMMC_8TO15BITS) << 8) | ((tempscr[1] & SDMMC_16TO23BITS) >> 8) | ((tempscr[1] & SDMMC_24TO31BITS) >> 24);
+    caps->Valid = 1;
     return errorstatus;
 }
 
-static SDMMC_Error SDMMCEnWideBus(SDIO_TypeDef *SDIOx, uint32_t enx)
+/**
+  * \brief  Restore SDMMC_CardCaps and the tuned bus level of a known card or probe a new one.
+  * \details The card is looked up in SDMMC_Profile by CID_Tab. A new card gets
+  *          the free or least recently used slot and starts negotiating from
+  *          the fastest bus mode again.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error LoadCardProfile(SDIO_TypeDef *SDIOx)
 {
-    /* SDMMC_CMD_APP_SD_SET_BUSWIDTH argument format:
-    *
-    *	[31:26] Always 0
-    *	[25:24] Access Mode
-    *	[23:16] Location of target Byte in EXT_CSD
+    SDMMC_Error errorstatus = SDMMC_OK;
+    SDMMC_ProfileTypeDef *p = NULL;
+    uint32_t i;
+
+    InitCount++;
+    for(i = 0; i < SDMMC_PROFILE_NUM; i++)
+    {
+        if((SDMMC_Profile[i].Caps.Valid != 0) && (memcmp(SDMMC_Profile[i].Cid, CID_Tab, sizeof(CID_Tab)) == 0))
+        {
+            p = &SDMMC_Profile[i];
+            break;
+        }
+    }
+    if(p != NULL)
+    {
+        SDMMC_CardCaps = p->Caps;
+        SDMMC_CardCaps.Cached = 1;
+        SDMMC_BusCfg.Fallback = p->Fallback;
+        SDMMC_BusCfg.ClkStep = p->ClkStep;
+        p->LastUse = InitCount;
+        CardProfile = p;
+        return SDMMC_OK;
+    }
+
+    CardProfile = NULL;
+    SDMMC_BusCfg.Fallback = 0;
+    SDMMC_BusCfg.ClkStep = 0;
+    errorstatus = ProbeCard(SDIOx);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    p = &SDMMC_Profile[0];
+    for(i = 1; i < SDMMC_PROFILE_NUM; i++)
+    {
+        if(SDMMC_Profile[i].LastUse < p->LastUse) p = &SDMMC_Profile[i];
+    }
+    memcpy(p->Cid, CID_Tab, sizeof(CID_Tab));
+    p->Caps = SDMMC_CardCaps;
+    p->Fallback = 0;
+    p->ClkStep = 0;
+    p->LastUse = InitCount;
+    CardProfile = p;
+    return SDMMC_OK;
+}
+
+static SDMMC_Error SDMMCEnWideBus(SDIO_TypeDef *SDIOx, uint32_t enx)
+{
+    /* SDMMC_CMD_APP_SD_SET_BUSWIDTH argument format:
+    *
+    *	[31:26] Always 0
+    *	[25:24] Access Mode
+    *	[23:16] Location of target Byte in EXT_CSD
     *	[15:08] Value Byte
     *	[07:03] Always 0
     *	[02:00] Command Set
@@ -1061,14 +1846,12 @@ static SDMMC_Error SDMMCEnWideBus(SDIO_TypeDef *SDIOx, uint32_t enx)
 static SDMMC_Error SDEnWideBus(SDIO_TypeDef *SDIOx, uint8_t enx)
 {
     SDMMC_Error errorstatus = SDMMC_OK;
-    uint32_t scr[2] = {0, 0};
     uint8_t arg = 0X00;
     if(enx)arg = 0X02;
     else arg = 0X00;
 
     if(SDIOx->RSP0 & SDMMC_CARD_LOCKED) return SDMMC_LOCK_UNLOCK_FAILED;
-    errorstatus = FindSCR(SDIOx, RCA, scr);
-    if(errorstatus != SDMMC_OK) return errorstatus;
+    if(enx && SDMMC_CardCaps.Valid && !(SDMMC_CardCaps.BusWidths & 0x04)) return SDMMC_REQUEST_NOT_APPLICABLE;
 
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
     SDIO_CmdInitStructure.SDIO_Argument = ADDR32( RCA << 16);
@@ -1135,18 +1918,11 @@ SDMMC_Error SDMMC_ReadBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,uin
     SDIO_DataSetupStructInit(SDIOx, &SDIO_DataSetupStruct);
     SDIO_DataSetupStruct.Data_en = SDIO_DATA_SETUP_CHANNEL_ENABLE;
     SDIO_DataSetupStruct.Data_rwn = SDIO_DATA_SETUP_RWN_READ;
-    if (CardType == SDIO_HIGH_CAPACITY_SD_CARD) {
-        SDIO_DataSetupStruct.Data_mode = BusWidth;
-    } else if (CardType == SDIO_MULTIMEDIA_CARD) {
-        SDIO_DataSetupStruct.Data_mode = BusWidth;
-    }
-
+    SDIO_DataSetupStruct.Data_mode = SDMMC_BusCfg.Width;
     SDIO_DataSetupStruct.Block_num = SDIO_DATA_SETUP_BLOCK_NUM(0);
     SDIO_DataSetupStruct.Block_size =
         SDIO_DATA_SETUP_BLOCK_SIZE(blksize - 1);
     SDIO_DataSetup(SDIOx, &SDIO_DataSetupStruct);
-    SDIO_SetDateTimeout(SDIOx, 0xffffffff);
-    SDIO_Clock_Set(SDIOx, 0x00);
     SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
     SDIO_CmdInitStructure.SDIO_Argument = addr;
     SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_READ_SINGLE_BLOCK;
@@ -1175,12 +1951,12 @@ SDMMC_Error SDMMC_ReadBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,uin
         SDIO_DmaCfgStruct.Rx_datasize = SDIO_RX_CFG_DATASIZE_WORD;
         SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
 
-        while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_STAT));
-        SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_CLR);
+        if(WaitDmaDone(SDIOx, RX_FTRANS_IRQ_STAT, SDMMC_DATATIMEOUT) != SDMMC_OK) return DmaAbort(SDIOx);
     }
 
-    while (!SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT)) {
-    };
+    if (WaitTransferEnd(SDIOx, SDMMC_DATATIMEOUT) != SDMMC_OK) {
+        return SDMMC_DATA_TIMEOUT;
+    }
     if (SDIO_GetFlagStatus(SDIOx, SDIO_CMD0TIMEOUT) != RESET) {
         SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
         return SDMMC_CMD_RSP_TIMEOUT;
@@ -1193,6 +1969,9 @@ SDMMC_Error SDMMC_ReadBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,uin
         SDIO_ClearFlag(SDIOx, SDIO_STATUS_ERR);
         return SDMMC_CMD_CRC_FAIL;
     }
+    if (SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET) {
+        errorstatus = SDMMC_DATA_CRC_FAIL;
+    }
     SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
 
     SDIO_ClearDataSetup(SDIOx);
@@ -1203,7 +1982,7 @@ SDMMC_Error SDMMC_ReadBlock(SDIO_TypeDef *SDIOx, uint8_t *buf,long long addr,uin
 SDMMC_Error SDMMC_ReadMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long addr, uint16_t blksize, uint32_t nblks)
 {
     SDMMC_Error errorstatus = SDMMC_OK;
-    uint8_t power;
+    uint8_t power, closed = 0;
     uint32_t count = 0;
     uint32_t timeout = SDIO_DATATIMEOUT;
     uint32_t *tempbuff = (uint32_t*)buf;
@@ -1214,29 +1993,35 @@ SDMMC_Error SDMMC_ReadMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
         addr >>= 9;
     }
     SDIO_ClearDataSetup(SDIOx);
-    if((blksize>0) && (blksize <= 2048) && ((blksize & (blksize-1)) == 0))
-    {
-        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-        SDIO_CmdInitStructure.SDIO_Argument = blksize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-        errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCKLEN);
-        if(errorstatus != SDMMC_OK) return errorstatus;
-    }else return SDMMC_INVALID_PARAMETER;
-    delay_1ms(5);
+    errorstatus = SetBlockLen(SDIOx, blksize);
+    if(errorstatus != SDMMC_OK) return errorstatus;
     if (nblks > 1) {
+        /* a preset block count ends the read on the card side, CMD12 is not needed */
+        closed = SDMMC_CardCaps.SetBlockCount && (nblks <= 0xFFFF);
+        if(closed)
+        {
+            SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+            SDIO_CmdInitStructure.SDIO_Argument = nblks;
+            SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCK_COUNT;
+            SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+            SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+            SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+            SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+            if(CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCK_COUNT) != SDMMC_OK)
+            {
+                /* the SCR promised more than the card does, stop reads with CMD12 from now on */
+                SDMMC_CardCaps.SetBlockCount = 0;
+                closed = 0;
+                SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+            }
+        }
         SDIO_DataSetupStructInit(SDIOx, &SDIO_DataSetupStruct);
         SDIO_DataSetupStruct.Data_en = SDIO_DATA_SETUP_CHANNEL_ENABLE;
         SDIO_DataSetupStruct.Data_rwn = SDIO_DATA_SETUP_RWN_READ;
-        SDIO_DataSetupStruct.Data_mode = BusWidth;
+        SDIO_DataSetupStruct.Data_mode = SDMMC_BusCfg.Width;
         SDIO_DataSetupStruct.Block_num = SDIO_DATA_SETUP_BLOCK_NUM(nblks - 1);
         SDIO_DataSetupStruct.Block_size = SDIO_DATA_SETUP_BLOCK_SIZE(blksize - 1);
         SDIO_DataSetup(SDIOx, &SDIO_DataSetupStruct);
-        SDIO_SetDateTimeout(SDIOx, 0xffffffff);
-        SDIO_Clock_Set(SDIOx, 0x00);
 
         SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
         SDIO_CmdInitStructure.SDIO_Argument = addr;
@@ -1266,8 +2051,7 @@ SDMMC_Error SDMMC_ReadMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
             SDIO_DmaCfgStruct.Rx_datasize = SDIO_RX_CFG_DATASIZE_WORD;
             SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
 
-            while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_STAT));
-            SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_CLR);
+            if(WaitDmaDone(SDIOx, RX_FTRANS_IRQ_STAT, SDMMC_DATATIMEOUT) != SDMMC_OK) return DmaAbort(SDIOx);
         }
         if(SDIO_GetFlagStatus(SDIOx, SDIO_FLAG_DTIMEOUT) != RESET)
         {
@@ -1280,20 +2064,24 @@ SDMMC_Error SDMMC_ReadMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
             *tempbuff = SDIO_ReadData(SDIOx);
             tempbuff++;
         }
-        while(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) == RESET)
+        if(WaitTransferEnd(SDIOx, timeout) != SDMMC_OK) return SDMMC_DATA_TIMEOUT;
+        if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET)
         {
-            timeout--;
-            if(timeout == 0) return SDMMC_DATA_TIMEOUT;
+            errorstatus = SDMMC_DATA_CRC_FAIL;
         }
         SDIO_ClearDataSetup(SDIOx);
         SDIO_DmaEn(SDIOx, DISABLE);
+        if(closed) return errorstatus;
 
-        SDIO_ClearFlag(SDIOx, SDIO_STATUS_EOT | SDIO_STATUS_ERR);
-        if((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_HIGH_CAPACITY_SD_CARD == CardType))
-        {
-            SDIO_Clock_Set(SDIOx, 0x31);
-            SDIO_ClearDataSetup(SDIOx);
-        }
+        /* CMD18 is open ended, the card keeps streaming until it is stopped */
+        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+        SDIO_CmdInitStructure.SDIO_Argument = 0x00;
+        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_STOP_TRANSMISSION;
+        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+        if(CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION) != SDMMC_OK) errorstatus = SDMMC_CMD_RSP_TIMEOUT;
         SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
     }
     return errorstatus;
@@ -1310,25 +2098,13 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
 
     if(buf == NULL) return SDMMC_INVALID_PARAMETER;
     SDIO_ClearDataSetup(SDIOx);
-    SDIO_Clock_Set(SDIOx, 0x31);
     if(CardType == SDIO_HIGH_CAPACITY_SD_CARD)
     {
         blksize = 512;
         addr >>= 9;
     }
-    if((blksize > 0) && (blksize <= 2048) && ((blksize & (blksize-1)) == 0))
-    {
-        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-        SDIO_CmdInitStructure.SDIO_Argument = blksize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-        errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCKLEN);
-        if(errorstatus != SDMMC_OK) return errorstatus;
-
-    }else return SDMMC_INVALID_PARAMETER;
+    errorstatus = SetBlockLen(SDIOx, blksize);
+    if(errorstatus != SDMMC_OK) return errorstatus;
 
     if(nblks > 1)
     {
@@ -1368,17 +2144,14 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
                 return errorstatus;
         }
 
-        SDIO_Clock_Set(SDIOx, 0);
-        SDIO_SetDateTimeout(SDIOx, 0xffffffff);
         SDIOx->DATA_SETUP =
-            0x1 | 0x0 << 1 | BusWidth | (nblks - 1) << 4 | (blksize - 1) << 20;
+            0x1 | 0x0 << 1 | SDMMC_BusCfg.Width | (nblks - 1) << 4 | (blksize - 1) << 20;
         SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
         SDIO_CmdInitStructure.SDIO_Argument = addr;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_WRITE_MULT_BLOCK;
         SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
         SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
         SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-        SDIO_CmdInitStructure.SDIO_Busy = 1 << 3;
         SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
         int n = 0;
         if(DeviceMode == SD_POLLING_MODE)
@@ -1392,7 +2165,6 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
 
         }else if(DeviceMode == SD_DMA_MODE)
         {
-            SDIO_DmaCfgStructInit(&SDIO_DmaCfgStruct);
             SDIO_DmaCfgStructInit(&SDIO_DmaCfgStruct);
             SDIO_DmaCfgStruct.Dma_en = SDIO_CR_DMA_ENABLE;
             SDIO_DmaCfgStruct.Tx_en = SDIO_TX_CFG_EN_ENABLE;
@@ -1401,27 +2173,22 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
             SDIO_DmaCfgStruct.Tx_datasize = SDIO_TX_CFG_DATASIZE_WORD;
             SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
 
-            while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_STAT));
-            SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_CLR);
+            if(WaitDmaDone(SDIOx, TX_FTRANS_IRQ_STAT, SDMMC_DATATIMEOUT) != SDMMC_OK) return DmaAbort(SDIOx);
         }
         if(SDIO_GetFlagStatus(SDIOx, SDIO_FLAG_DTIMEOUT) != RESET)
         {
             SDIO_ClearFlag(SDIOx, SDIO_FLAG_DTIMEOUT);
             return SDMMC_DATA_TIMEOUT;
         }
-        while(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) == RESET)
+        if(WaitTransferEnd(SDIOx, timeout) != SDMMC_OK) return SDMMC_DATA_TIMEOUT;
+        if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET)
         {
-            timeout--;
-            if(timeout == 0)
-            {
-                return SDMMC_DATA_TIMEOUT;
-            }
+            errorstatus = SDMMC_DATA_CRC_FAIL;
         }
         if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) ||
             (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) ||
             (SDIO_HIGH_CAPACITY_SD_CARD == CardType)) {
             SDIO_ClearDataSetup(SDIOx);
-            SDIO_Clock_Set(SDIOx, 0x31);
             SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
             SDIO_CmdInitStructure.SDIO_Argument = 0x00;
             SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_STOP_TRANSMISSION;
@@ -1429,11 +2196,17 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
             SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
             SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
             SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-
-            errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION);
-            if(errorstatus != SDMMC_OK) return errorstatus;
+            if(CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION) != SDMMC_OK) errorstatus = SDMMC_CMD_RSP_TIMEOUT;
         }
         SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+        SDIO_ClearDataSetup(SDIOx);
+
+        /* the whole train is on the card, wait once for it to leave programming */
+        timeout = SDMMC_DATATIMEOUT;
+        do {
+            if(IsCardProgramming(SDIOx, &cardstate) != SDMMC_OK) return SDMMC_CMD_RSP_TIMEOUT;
+        } while(((SDMMC_CARD_PROGRAMMING == cardstate) || (SDMMC_CARD_RECEIVING == cardstate)) && (--timeout > 0));
+        if(timeout == 0) return SDMMC_DATA_TIMEOUT;
     }
     SDIO_ClearDataSetup(SDIOx);
     SDIO_DmaEn(SDIOx, DISABLE);
@@ -1441,139 +2214,355 @@ SDMMC_Error SDMMC_WriteMultiBlocks(SDIO_TypeDef *SDIOx, uint8_t *buf,  long long
     return errorstatus;
 }
 
-SDMMC_Error SDMMC_WriteMultiBlocks_int(SDIO_TypeDef *SDIOx, uint8_t *buf, long long addr, uint16_t blksize, uint32_t nblks)
+/**
+  * \brief  Number of writes the device accepts in one packed write group.
+  * \retval 0 when packed commands are not available (SD card, eMMC before 4.5)
+  */
+uint32_t SDMMC_PackedWriteMax(void)
+{
+    uint32_t max;
+
+    if((SDIO_MULTIMEDIA_CARD != CardType) ||
+       (MyEmmcCardInfo.EmmcExtCsd.EXT_CSD.EXT_CSD_REV < SDMMC_EXT_CSD_REV_4_5)) return 0;
+    max = MyEmmcCardInfo.EmmcExtCsd.EXT_CSD.MAX_PACKED_WRITES;
+    return (max > SDMMC_PACKED_MAX_ENTRIES) ? SDMMC_PACKED_MAX_ENTRIES : max;
+}
+
+__attribute__ ((aligned (4))) static uint32_t SDIO_PACKED_HEADER[512 / 4];
+
+/**
+  * \brief  Send several scattered writes to an eMMC device in one packed write.
+  * \details CMD23 announces a packed group of header + data blocks, CMD25 then
+  *          carries a 512 byte header listing the CMD23/CMD25 arguments of every
+  *          write followed by the data of all writes back to back. The card
+  *          leaves programming only once for the whole group.
+  * \param  SDIOx select the SDIO peripheral.
+  * \param  entry writes of the group, buffers must be word aligned
+  * \param  num number of writes, 1 .. SDMMC_PackedWriteMax()
+  * \retval SDMMC_Error status
+  */
+SDMMC_Error SDMMC_WritePacked(SDIO_TypeDef *SDIOx, const SDMMC_PackedEntryTypeDef *entry, uint32_t num)
 {
-    SDIO_Clock_Set(SDIOx, 0x31);
     SDMMC_Error errorstatus = SDMMC_OK;
-    uint8_t  power = 0, cardstate = 0;
-    uint32_t timeout = SDIO_CMD0TIMEOUT, bytestransferred = 0;
-    uint32_t count = 0, restwords = 0;
-    uint32_t tlen = nblks*blksize;
-    uint32_t *tempbuff = (uint32_t *)(buf);
+    uint32_t timeout = SDIO_CMD0TIMEOUT;
+    uint32_t nblks = 1;
+    uint32_t i, n, len;
+    uint32_t *tempbuff;
+    uint8_t cardstate = 0;
 
-    if(buf == NULL) return SDMMC_INVALID_PARAMETER;
-    SDIO_ClearDataSetup(SDIOx);
+    if((entry == NULL) || (num == 0) || (num > SDMMC_PackedWriteMax())) return SDMMC_INVALID_PARAMETER;
 
-    if(CardType == SDIO_HIGH_CAPACITY_SD_CARD)
+    memset(SDIO_PACKED_HEADER, 0, sizeof(SDIO_PACKED_HEADER));
+    SDIO_PACKED_HEADER[0] = (num << 16) | (SDMMC_PACKED_CMD_WRITE << 8) | SDMMC_PACKED_CMD_VERSION;
+    for(i = 0; i < num; i++)
     {
-        blksize = 512;
-        addr >>= 9;
+        if((entry[i].buf == NULL) || (ADDR32(entry[i].buf) % 4 != 0) || (entry[i].count == 0)) return SDMMC_INVALID_PARAMETER;
+        SDIO_PACKED_HEADER[(i + 1) * 2] = entry[i].count;
+        SDIO_PACKED_HEADER[(i + 1) * 2 + 1] = entry[i].sector << 9;
+        nblks += entry[i].count;
     }
-    if((blksize > 0) && (blksize <= 2048) && ((blksize & (blksize-1)) == 0))
-    {
+    if(nblks > 0xFFFF) return SDMMC_INVALID_PARAMETER;
 
-        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-        SDIO_CmdInitStructure.SDIO_Argument = blksize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-        errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCKLEN);
-        if(errorstatus != SDMMC_OK) return errorstatus;
-
-    }else return SDMMC_INVALID_PARAMETER;
-    if(nblks > 1)
-    {
-        if(nblks*blksize>SDMMC_MAX_DATA_LENGTH) return SDMMC_INVALID_PARAMETER;
-        if((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_HIGH_CAPACITY_SD_CARD == CardType))
-        {
-            SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-            SDIO_CmdInitStructure.SDIO_Argument = (uint32_t)(RCA << 16);
-            SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_APP_CMD;
-            SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-            SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-            SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-            SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-            errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_APP_CMD);
+    SDIO_ClearDataSetup(SDIOx);
+    errorstatus = SetBlockLen(SDIOx, 512);
+    if(errorstatus != SDMMC_OK) return errorstatus;
 
-            if(errorstatus != SDMMC_OK) return errorstatus;
-            SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-            SDIO_CmdInitStructure.SDIO_Argument = nblks;
-            SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCK_COUNT;
-            SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-            SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-            SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-            SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
-            errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCK_COUNT);
-            if(errorstatus != SDMMC_OK) return errorstatus;
-        }
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = SDMMC_CMD23_PACKED | nblks;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_SET_BLOCK_COUNT;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_SET_BLOCK_COUNT);
+    if(errorstatus != SDMMC_OK) return errorstatus;
 
-        SDIO_Clock_Set(SDIOx, 0);
-        SDIO_SetDateTimeout(SDIOx, 0xffffffff);
-        SDIOx->DATA_SETUP =
-            0x1 | 0x0 << 1 | BusWidth | (nblks - 1) << 4 | (blksize - 1) << 20;
-        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
-        SDIO_CmdInitStructure.SDIO_Argument = addr;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_WRITE_MULT_BLOCK;
-        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
-        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
-        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
-        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    SDIOx->DATA_SETUP =
+        0x1 | 0x0 << 1 | SDMMC_BusCfg.Width | (nblks - 1) << 4 | (512 - 1) << 20;
+    /* CMD25 carries the address of the first write of the group */
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = entry[0].sector << 9;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_WRITE_MULT_BLOCK;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
 
+    /* header first, then every write's data as one continuous block train */
+    for(i = 0; i <= num; i++)
+    {
+        tempbuff = (i == 0) ? SDIO_PACKED_HEADER : (uint32_t *)entry[i - 1].buf;
+        len = (i == 0) ? 512 : entry[i - 1].count * 512;
         if(DeviceMode == SD_POLLING_MODE)
         {
-            SDIOx->TX_MARK = 1;
-            SDIOx->IE |= 1 << 0;
-
+            for(n = 0; n < (len / 4); n++)
+            {
+                while (SDIO_GET_IP_FLAG(SDIOx, SDIO_IP_TXFULL))
+                    ;
+                SDIO_SendData(SDIOx, tempbuff[n]);
+            }
         }else if(DeviceMode == SD_DMA_MODE)
         {
             SDIO_DmaCfgStructInit(&SDIO_DmaCfgStruct);
             SDIO_DmaCfgStruct.Dma_en = SDIO_CR_DMA_ENABLE;
-            SDIO_DmaCfgStruct.Rx_en = SDIO_RX_CFG_EN_ENABLE;
-            SDIO_DmaCfgStruct.Rx_addr = ADDR32(tempbuff);
-            SDIO_DmaCfgStruct.Rx_size = blksize;
-            SDIO_DmaCfgStruct.Rx_datasize = SDIO_RX_CFG_DATASIZE_WORD;
+            SDIO_DmaCfgStruct.Tx_en = SDIO_TX_CFG_EN_ENABLE;
+            SDIO_DmaCfgStruct.Tx_addr = ADDR32(tempbuff);
+            SDIO_DmaCfgStruct.Tx_size = len;
+            SDIO_DmaCfgStruct.Tx_datasize = SDIO_TX_CFG_DATASIZE_WORD;
             SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
 
-            while(!SDIO_DmaGetIntStat(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_STAT));
-            SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_CLR);
-        }
-        if(SDIO_GetFlagStatus(SDIOx, SDIO_FLAG_DTIMEOUT) != RESET)
-        {
-            SDIO_ClearFlag(SDIOx, SDIO_FLAG_DTIMEOUT);
-            return SDMMC_DATA_TIMEOUT;
+            if(WaitDmaDone(SDIOx, TX_FTRANS_IRQ_STAT, SDMMC_DATATIMEOUT) != SDMMC_OK) return DmaAbort(SDIOx);
         }
+    }
+    if(WaitTransferEnd(SDIOx, timeout) != SDMMC_OK) return SDMMC_DATA_TIMEOUT;
+    if(SDIO_GetFlagStatus(SDIOx, SDIO_CMD0TIMEOUT) != RESET) errorstatus = SDMMC_CMD_RSP_TIMEOUT;
+    else if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET) errorstatus = SDMMC_DATA_CRC_FAIL;
+    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+    SDIO_ClearDataSetup(SDIOx);
+    SDIO_DmaEn(SDIOx, DISABLE);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    timeout = SDMMC_DATATIMEOUT;
+    do {
+        if(IsCardProgramming(SDIOx, &cardstate) != SDMMC_OK) return SDMMC_CMD_RSP_TIMEOUT;
+    } while(((SDMMC_CARD_PROGRAMMING == cardstate) || (SDMMC_CARD_RECEIVING == cardstate)) && (--timeout > 0));
+    if(timeout == 0) return SDMMC_DATA_TIMEOUT;
+    /* a rejected group is reported through EXT_CSD PACKED_COMMAND_STATUS */
+    if(SDIOx->RSP0 & SDMMC_OCR_ERRORBITS) return SDMMC_GENERAL_UNKNOWN_ERROR;
+    return SDMMC_OK;
+}
+
+/* DMA channel status bit is set, without waiting and without consuming it */
+static uint32_t StreamPending(uint32_t stat)
+{
+    if(SDMMC_Completion.Enabled) return SDMMC_Completion.Events & stat;
+    return SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT & stat;
+}
+
+/* let both channels stop at the end of the ring they are running */
+static void StreamStop(SDIO_TypeDef *SDIOx)
+{
+    SDIOx->RX_CFG &= ~SDIO_RX_CFG_CONTINUOUS;
+    SDIOx->TX_CFG &= ~SDIO_TX_CFG_CONTINUOUS;
+}
+
+/**
+  * \brief  Stream sectors through a two half ring buffer in one open ended CMD18/CMD25.
+  * \details The DMA runs in continuous mode over the ring. Each half transfer
+  *          and full transfer event hands one half to cb: for reads after it
+  *          was filled, for writes to be refilled while the DMA sends the other
+  *          half. Both halves of a write ring are filled through cb before the
+  *          stream starts. Continuous mode is dropped once the last lap has
+  *          begun, the card is stopped with CMD12 after the last block.
+  *          cb must be done with its half before the DMA has finished the
+  *          other one, otherwise the DMA wraps into it and the stream fails
+  *          with SDMMC_RX_OVERRUN / SDMMC_TX_UNDERRUN.
+  * \param  SDIOx select the SDIO peripheral, DMA mode only.
+  * \param  write 0 for CMD18, 1 for CMD25
+  * \param  sector first sector
+  * \param  ring word aligned buffer of 2 * half_blocks sectors
+  * \param  half_blocks sectors per half of the ring
+  * \param  nblks sectors to stream, a multiple of 2 * half_blocks
+  * \param  cb called with each half and its index in the stream
+  * \param  arg passed to cb
+  * \retval SDMMC_Error status
+  */
+static SDMMC_Error StreamRun(SDIO_TypeDef *SDIOx, uint8_t write, uint32_t sector, uint8_t *ring,
+                             uint32_t half_blocks, uint32_t nblks, SDMMC_StreamCallback cb, void *arg)
+{
+    SDMMC_Error errorstatus = SDMMC_OK;
+    uint32_t half = half_blocks * 512;
+    uint32_t halves, k;
+    uint32_t ht = write ? TX_HTRANS_IRQ_STAT : RX_HTRANS_IRQ_STAT;
+    uint32_t ft = write ? TX_FTRANS_IRQ_STAT : RX_FTRANS_IRQ_STAT;
+    uint32_t timeout = SDIO_DATATIMEOUT;
+    uint8_t cardstate = 0;
+
+    if((cb == NULL) || (ring == NULL) || (ADDR32(ring) % 4 != 0) || (half_blocks == 0) ||
+       (2 * half > SDIO_RX_SIZE_NUM_MASK) || (nblks == 0) || (nblks % (2 * half_blocks) != 0) ||
+       ((uint64_t)nblks * 512 > SDMMC_MAX_DATA_LENGTH)) return SDMMC_INVALID_PARAMETER;
+    if(DeviceMode != SD_DMA_MODE) return SDMMC_REQUEST_NOT_APPLICABLE;
+    if(SDMMC_BusCfg.Negotiated == 0)
+    {
+        errorstatus = SDMMC_Init(SDIOx);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+    }
+    halves = nblks / half_blocks;
 
-        while(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_EOT) == RESET)
+    SDIO_ClearDataSetup(SDIOx);
+    errorstatus = SetBlockLen(SDIOx, 512);
+    if(errorstatus != SDMMC_OK) return errorstatus;
+
+    SDIO_DmaInterruptClr(SDIO0_DMA_SDIO0_P2M_IRQ, ht | ft);
+    __disable_irq();
+    SDMMC_Completion.Events &= ~(ht | ft);
+    __enable_irq();
+    SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, ht, ENABLE);
+    if(write)
+    {
+        cb(ring, 0, arg);
+        cb(ring + half, 1, arg);
+    }
+
+    SDIOx->DATA_SETUP =
+        0x1 | (write ? 0x0 : 0x1) << 1 | SDMMC_BusCfg.Width | (nblks - 1) << 4 | (512 - 1) << 20;
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = (CardType == SDIO_HIGH_CAPACITY_SD_CARD) ? sector : (sector << 9);
+    SDIO_CmdInitStructure.SDIO_CmdIndex = write ? SDMMC_CMD_WRITE_MULT_BLOCK : SDMMC_CMD_READ_MULT_BLOCK;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+
+    SDIO_DmaCfgStructInit(&SDIO_DmaCfgStruct);
+    SDIO_DmaCfgStruct.Dma_en = SDIO_CR_DMA_ENABLE;
+    if(write)
+    {
+        SDIO_DmaCfgStruct.Tx_en = SDIO_TX_CFG_EN_ENABLE | ((halves > 2) ? SDIO_TX_CFG_CONTINUOUS_ENABLE : 0);
+        SDIO_DmaCfgStruct.Tx_addr = ADDR32(ring);
+        SDIO_DmaCfgStruct.Tx_size = 2 * half;
+        SDIO_DmaCfgStruct.Tx_datasize = SDIO_TX_CFG_DATASIZE_WORD;
+    }else
+    {
+        SDIO_DmaCfgStruct.Rx_en = SDIO_RX_CFG_EN_ENABLE | ((halves > 2) ? SDIO_RX_CFG_CONTINUOUS_ENABLE : 0);
+        SDIO_DmaCfgStruct.Rx_addr = ADDR32(ring);
+        SDIO_DmaCfgStruct.Rx_size = 2 * half;
+        SDIO_DmaCfgStruct.Rx_datasize = SDIO_RX_CFG_DATASIZE_WORD;
+    }
+    SDIO_DMA_Config(SDIOx, &SDIO_DmaCfgStruct);
+
+    for(k = 0; k < halves; k++)
+    {
+        if(WaitDmaDone(SDIOx, (k & 1) ? ft : ht, SDMMC_DATATIMEOUT) != SDMMC_OK)
         {
-            timeout--;
-            if(timeout == 0)
-            {
-                return SDMMC_DATA_TIMEOUT;
-            }
+            errorstatus = SDMMC_DATA_TIMEOUT;
+            break;
         }
-
-        if((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_HIGH_CAPACITY_SD_CARD == CardType))
+        /* the other half is done as well, the DMA has wrapped into this one */
+        if((k + 2 < halves) && StreamPending((k & 1) ? ht : ft))
         {
-            SDIO_ClearDataSetup(SDIOx);
-            SDIO_Clock_Set(SDIOx, 0x31);
-            errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION);
-            if(errorstatus != SDMMC_OK) return errorstatus;
+            errorstatus = write ? SDMMC_TX_UNDERRUN : SDMMC_RX_OVERRUN;
+            break;
         }
-        SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+        /* the last lap has begun, let the DMA stop at the end of the ring */
+        if(k + 3 == halves) StreamStop(SDIOx);
+        if(!write) cb(ring + (k & 1) * half, k, arg);
+        else if(k + 2 < halves) cb(ring + (k & 1) * half, k + 2, arg);
+    }
+    StreamStop(SDIOx);
+    SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, ht, DISABLE);
+
+    if(errorstatus == SDMMC_OK)
+    {
+        if(WaitTransferEnd(SDIOx, timeout) != SDMMC_OK) errorstatus = SDMMC_DATA_TIMEOUT;
+        else if(SDIO_GetFlagStatus(SDIOx, SDIO_STATUS_DATA_ERR) != RESET) errorstatus = SDMMC_DATA_CRC_FAIL;
     }
     SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+    SDIO_ClearDataSetup(SDIOx);
     SDIO_DmaEn(SDIOx, DISABLE);
+
+    SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+    SDIO_CmdInitStructure.SDIO_Argument = 0x00;
+    SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_STOP_TRANSMISSION;
+    SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+    SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+    SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+    SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+    if((CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION) != SDMMC_OK) && (errorstatus == SDMMC_OK))
+        errorstatus = SDMMC_CMD_RSP_TIMEOUT;
+    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+
+    if(write && (errorstatus == SDMMC_OK))
+    {
+        timeout = SDMMC_DATATIMEOUT;
+        do {
+            errorstatus = IsCardProgramming(SDIOx, &cardstate);
+        } while((errorstatus == SDMMC_OK) && ((SDMMC_CARD_PROGRAMMING == cardstate) ||
+                (SDMMC_CARD_RECEIVING == cardstate)) && (--timeout > 0));
+        if((errorstatus == SDMMC_OK) && (timeout == 0)) errorstatus = SDMMC_DATA_TIMEOUT;
+    }
+    if(errorstatus != SDMMC_OK) SDMMC_BusCfg.Negotiated = 0;
+    if(errorstatus == SDMMC_DATA_CRC_FAIL) BusStepDown();
     return errorstatus;
+}
 
+/**
+  * \brief  Read nblks sectors as one continuous stream, see StreamRun.
+  */
+SDMMC_Error SDMMC_StreamRead(SDIO_TypeDef *SDIOx, uint32_t sector, uint8_t *ring, uint32_t half_blocks,
+                             uint32_t nblks, SDMMC_StreamCallback cb, void *arg)
+{
+    return StreamRun(SDIOx, 0, sector, ring, half_blocks, nblks, cb, arg);
 }
 
-__attribute__ ((aligned (4))) uint8_t SDIO_DATA_BUFFER[512];
+/**
+  * \brief  Write nblks sectors as one continuous stream, see StreamRun.
+  */
+SDMMC_Error SDMMC_StreamWrite(SDIO_TypeDef *SDIOx, uint32_t sector, uint8_t *ring, uint32_t half_blocks,
+                              uint32_t nblks, SDMMC_StreamCallback cb, void *arg)
+{
+    return StreamRun(SDIOx, 1, sector, ring, half_blocks, nblks, cb, arg);
+}
 
-uint8_t SDMMC_ReadDisk(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_t cnt)
+__attribute__ ((aligned (4))) uint8_t SDIO_DATA_BUFFER[SDMMC_BOUNCE_BLOCKS * 512];
+
+/**
+  * \brief  Copy between SDIO_DATA_BUFFER and an unaligned caller buffer.
+  * \details With SDMMC_BOUNCE_M2M the copy runs on an M2M UDMA channel with
+  *          byte wide accesses, so both ends may be unaligned. A channel that
+  *          reports an access error or does not finish in time is not used
+  *          again and the copy falls back to memcpy.
+  */
+static void BounceCopy(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+#if SDMMC_BOUNCE_M2M
+    static uint8_t m2m_failed = 0;
+    UDMA_InitTypeDef udma;
+    uint32_t timeout = SDIO_CMD0TIMEOUT + len;
+    FlagStatus done;
+
+    if(m2m_failed == 0)
+    {
+        UDMA_StructInit(&udma);
+        udma.UDMA_SrcBaseAddr = ADDR32(src);
+        udma.UDMA_DstBaseAddr = ADDR32(dst);
+        udma.UDMA_BufferSize = len;
+        udma.UDMA_SrcInc = UDMA_MSNA_ENABLE;
+        udma.UDMA_DstInc = UDMA_MDNA_ENABLE;
+        UDMA_ClearITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_FTRANS_IRQ_CLR);
+        UDMA_ClearITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_ERR_IRQ_CLR);
+        UDMA_Init(SDMMC_BOUNCE_M2M_CH, &udma);
+        M2M_DMA_Cmd(SDMMC_BOUNCE_M2M_CH, ENABLE);
+        while(((done = UDMA_GetITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_FTRANS_IRQ)) == RESET) &&
+              (UDMA_GetITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_ERR_IRQ) == RESET) && (--timeout > 0));
+        if(UDMA_GetITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_ERR_IRQ) != RESET) done = RESET;
+        M2M_DMA_Cmd(SDMMC_BOUNCE_M2M_CH, DISABLE);
+        UDMA_ClearITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_FTRANS_IRQ_CLR);
+        UDMA_ClearITStatus(SDMMC_BOUNCE_M2M_IRQ, UDMA_ERR_IRQ_CLR);
+        if(done != RESET) return;
+        m2m_failed = 1;
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+/* one read attempt on the negotiated bus, no recovery */
+static uint8_t DiskRead(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_t cnt)
 {
     uint8_t sta = SDMMC_OK;
     long long lsector = sector;
-    uint8_t n;
+    uint8_t n, k;
     lsector <<= 9;
     if(ADDR32(buf)%4 != 0)
     {
-        for(n = 0;n<cnt;n++)
+        /* multi block reads into the bounce pool, one pool at a time */
+        for(n = 0;(n<cnt) && (sta == SDMMC_OK);n += k)
         {
-            sta = SDMMC_ReadBlock(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512);
-            memcpy(buf, SDIO_DATA_BUFFER, 512);
-            buf += 512;
+            k = (cnt - n < SDMMC_BOUNCE_BLOCKS) ? (cnt - n) : SDMMC_BOUNCE_BLOCKS;
+            if(k == 1) sta = SDMMC_ReadBlock(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512);
+            else sta = SDMMC_ReadMultiBlocks(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512, k);
+            if(sta == SDMMC_OK) BounceCopy(buf, SDIO_DATA_BUFFER, 512*k);
+            buf += 512*k;
         }
     }else
     {
@@ -1583,19 +2572,23 @@ uint8_t SDMMC_ReadDisk(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_
     return sta;
 }
 
-uint8_t SDMMC_WriteDisk(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt)
+/* one write attempt on the negotiated bus, no recovery */
+static uint8_t DiskWrite(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt)
 {
     uint8_t sta = SDMMC_OK;
-    uint8_t n;
+    uint8_t n, k;
     long long lsector = sector;
     lsector <<= 9;
     if(ADDR32(buf)%4 != 0)
     {
-        for(n = 0;n<cnt;n++)
+        /* multi block writes out of the bounce pool, one pool at a time */
+        for(n = 0;(n<cnt) && (sta == SDMMC_OK);n += k)
         {
-            memcpy(SDIO_DATA_BUFFER, buf, 512);
-            sta = SDMMC_WriteBlock(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512);
-            buf += 512;
+            k = (cnt - n < SDMMC_BOUNCE_BLOCKS) ? (cnt - n) : SDMMC_BOUNCE_BLOCKS;
+            BounceCopy(SDIO_DATA_BUFFER, buf, 512*k);
+            if(k == 1) sta = SDMMC_WriteBlock(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512);
+            else sta = SDMMC_WriteMultiBlocks(SDIOx, SDIO_DATA_BUFFER, lsector+512*n, 512, k);
+            buf += 512*k;
         }
     }else
     {
@@ -1605,3 +2598,141 @@ uint8_t SDMMC_WriteDisk(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint
     }
     return sta;
 }
+
+uint8_t SDMMC_ReadDisk(SDIO_TypeDef *SDIOx, uint8_t*buf, uint32_t sector, uint8_t cnt)
+{
+    uint8_t sta = SDMMC_OK;
+    if(SDMMC_BusCfg.Negotiated == 0)
+    {
+        sta = SDMMC_Init(SDIOx);
+        if(sta != SDMMC_OK) return sta;
+    }
+    sta = DiskRead(SDIOx, buf, sector, cnt);
+    if(sta != SDMMC_OK) SDMMC_BusCfg.Negotiated = 0;
+    if(sta == SDMMC_DATA_CRC_FAIL) BusStepDown();
+    return sta;
+}
+
+uint8_t SDMMC_WriteDisk(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    uint8_t sta = SDMMC_OK;
+    if(SDMMC_BusCfg.Negotiated == 0)
+    {
+        sta = SDMMC_Init(SDIOx);
+        if(sta != SDMMC_OK) return sta;
+    }
+    sta = DiskWrite(SDIOx, buf, sector, cnt);
+    if(sta != SDMMC_OK) SDMMC_BusCfg.Negotiated = 0;
+    if(sta == SDMMC_DATA_CRC_FAIL) BusStepDown();
+    return sta;
+}
+
+/**
+  * \brief  Bring the card back to transfer state after a failed attempt.
+  * \details Stops the data path and asks the card for its state once it is
+  *          no longer busy. A card still sending or receiving gets CMD12, then
+  *          programming is waited out.
+  * \param  SDIOx select the SDIO peripheral.
+  * \retval SDMMC_OK when the same request can be issued again
+  */
+static SDMMC_Error RecoverTransfer(SDIO_TypeDef *SDIOx)
+{
+    SDMMC_Error errorstatus;
+    uint32_t timeout = SDMMC_DATATIMEOUT;
+    uint8_t cardstate = 0;
+
+    SDIO_ClearDataSetup(SDIOx);
+    SDIO_DmaEn(SDIOx, DISABLE);
+    SDIO_ClearFlag(SDIOx, SDIO_STATIC_FLAGS);
+    /* an open ended write still programs the last block before it waits for more */
+    do {
+        errorstatus = IsCardProgramming(SDIOx, &cardstate);
+    } while((errorstatus == SDMMC_OK) && (cardstate == SDMMC_CARD_PROGRAMMING) && (--timeout > 0));
+    if(errorstatus != SDMMC_OK) return errorstatus;
+    if((cardstate == SDMMC_CARD_SENDING) || (cardstate == SDMMC_CARD_RECEIVING))
+    {
+        SDIO_CmdInitStructInit(SDIOx, &SDIO_CmdInitStructure);
+        SDIO_CmdInitStructure.SDIO_Argument = 0x00;
+        SDIO_CmdInitStructure.SDIO_CmdIndex = SDMMC_CMD_STOP_TRANSMISSION;
+        SDIO_CmdInitStructure.SDIO_No_Rsp = SDIO_CMD_OP_RSP_YES;
+        SDIO_CmdInitStructure.SDIO_No_Rsp_Len = SDIO_CMD_OP_RSP_LEN_48;
+        SDIO_CmdInitStructure.SDIO_CrcEn = SDIO_CMD_OP_CRC_ENABLE;
+        SDIO_SendCommand(SDIOx, &SDIO_CmdInitStructure);
+        errorstatus = CmdResp1Error(SDIOx, SDMMC_CMD_STOP_TRANSMISSION);
+        if(errorstatus != SDMMC_OK) return errorstatus;
+    }
+    timeout = SDMMC_DATATIMEOUT;
+    do {
+        errorstatus = IsCardProgramming(SDIOx, &cardstate);
+    } while((errorstatus == SDMMC_OK) && (cardstate != SDMMC_CARD_TRANSFER) && (--timeout > 0));
+    if((errorstatus == SDMMC_OK) && (timeout == 0)) errorstatus = SDMMC_DATA_TIMEOUT;
+    return errorstatus;
+}
+
+/**
+  * \brief  Read or write with the bounded recovery of SDMMC_Retry.
+  * \details A failed attempt is first repeated as is, up to
+  *          SDMMC_Retry.MaxRetries times, as long as the card can be brought
+  *          back to transfer state without a re-initialisation. After that the
+  *          bus is stepped down one level (BusStepDown) and the card is
+  *          initialised again, up to SDMMC_Retry.MaxReinits times, each step
+  *          getting a fresh set of retries. The last error is returned once
+  *          both budgets are spent, the counters in SDMMC_Retry tell how often
+  *          each stage was needed. CRC errors, and DMA completions or EOT
+  *          that did not arrive in time (SDMMC_DATA_TIMEOUT), are retried the
+  *          same way, only a rejected request is returned at once.
+  */
+static uint8_t DiskRetry(SDIO_TypeDef *SDIOx, uint8_t write, uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    uint8_t sta = SDMMC_OK;
+    uint8_t retries = 0, reinits = 0;
+    uint32_t attempts = 0;
+
+    SDMMC_Retry.Requests++;
+    for(;;)
+    {
+        if(SDMMC_BusCfg.Negotiated == 0) sta = SDMMC_Init(SDIOx);
+        if(SDMMC_BusCfg.Negotiated != 0)
+            sta = write ? DiskWrite(SDIOx, buf, sector, cnt) : DiskRead(SDIOx, buf, sector, cnt);
+        attempts++;
+        if(sta == SDMMC_OK) break;
+        SDMMC_Retry.Errors++;
+        if((sta == SDMMC_INVALID_PARAMETER) || (sta == SDMMC_REQUEST_NOT_APPLICABLE)) break;
+        if((retries < SDMMC_Retry.MaxRetries) && (SDMMC_BusCfg.Negotiated != 0) &&
+           (RecoverTransfer(SDIOx) == SDMMC_OK))
+        {
+            retries++;
+            SDMMC_Retry.Retries++;
+            continue;
+        }
+        if(reinits >= SDMMC_Retry.MaxReinits)
+        {
+            SDMMC_Retry.Failures++;
+            break;
+        }
+        reinits++;
+        retries = 0;
+        SDMMC_Retry.Reinits++;
+        if(BusStepDown()) SDMMC_Retry.StepDowns++;
+        SDMMC_BusCfg.Negotiated = 0;
+    }
+    if(sta != SDMMC_OK) SDMMC_BusCfg.Negotiated = 0;
+    if(attempts > SDMMC_Retry.MaxAttempts) SDMMC_Retry.MaxAttempts = attempts;
+    return sta;
+}
+
+/**
+  * \brief  SDMMC_ReadDisk with bounded retries and bus step down, see DiskRetry.
+  */
+uint8_t SDMMC_ReadDiskRetry(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    return DiskRetry(SDIOx, 0, buf, sector, cnt);
+}
+
+/**
+  * \brief  SDMMC_WriteDisk with bounded retries and bus step down, see DiskRetry.
+  */
+uint8_t SDMMC_WriteDiskRetry(SDIO_TypeDef *SDIOx, uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    return DiskRetry(SDIOx, 1, buf, sector, cnt);
+}
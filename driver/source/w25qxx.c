@@ -1,7 +1,19 @@
+#include <string.h>
 #include "w25qxx.h"
 #include "ns_qspi.h"
+#include "ns_qspi_xip.h"
 
 uint16_t W25QXX_TYPE = W25Q128;    //Default is W25Q128
+uint8_t W25QXX_READ_CMD = W25X_FastReadData;    //read command W25QXX_Read uses, picked at init
+uint8_t W25QXX_PROG_CMD = W25X_PageProgram;     //page program command W25QXX_Write_Page uses, picked at init
+W25QXX_InfoTypeDef W25QXX_Info;                 //filled in by W25QXX_Init
+static uint8_t W25QXX_Pending;                  //a page program or background erase may still run
+static uint32_t W25QXX_PendAddr;                //first byte the pending program or erase changes
+static uint32_t W25QXX_PendLen;                 //bytes it changes
+static uint8_t W25QXX_Suspended;                //the pending erase is suspended
+static uint32_t W25QXX_XipWindow;               //flash address 0 in the memory map, 0 without XIP
+static uint8_t W25QXX_XipOn;                    //controller is in flash mode
+static struct { uint32_t Sec, End; } W25QXX_EraseQ[W25QXX_ERASE_QUEUE];    //freed 4KB sectors [Sec, End) to erase ahead
 
 uint8_t Spi_readwrite(QSPI_TypeDef* QSPIx, uint8_t Txdata){
     uint8_t Rxdata;
@@ -9,11 +21,186 @@ uint8_t Spi_readwrite(QSPI_TypeDef* QSPIx, uint8_t Txdata){
     return Rxdata;
 }
 
+// transmit only frame, with FMT.DIR set to TX the receive FIFO is not filled.
+// Only waits for room in the transmit FIFO, Spi_setproto waits for the frames
+// to leave before the lines are switched.
+static void Spi_write(QSPI_TypeDef* QSPIx, uint8_t Txdata){
+    while(SET == QSPI_GetFlag(QSPIx, QSPI_STATUS_TX_FULL));
+    QSPI_SendData(QSPIx, Txdata);
+}
+
+// lines and direction of the following frames, single line frames run full duplex
+static void Spi_setproto(QSPI_TypeDef* QSPIx, uint32_t proto, uint32_t dir){
+    while(SET == QSPI_GetFlag(QSPIx, QSPI_STATUS_BUSY));
+    QSPIx->FMT = (QSPIx->FMT & ~(QSPI_FMT_PROTO_MASK | QSPI_FMT_DIR)) | proto | dir;
+}
+
+// a page program W25QXX_Write_Page or an erase W25QXX_Erase_Idle started may
+// still run, commands other than the status reads wait for it here
+static void W25QXX_Ready(QSPI_TypeDef* QSPIx){
+    if(W25QXX_Pending)W25QXX_Wait_Busy(QSPIx);
+}
+
+// resume an erase W25QXX_ReadReady suspended
+static void W25QXX_Resume(QSPI_TypeDef* QSPIx){
+    W25QXX_CS(QSPIx, 0);
+    Spi_readwrite(QSPIx, W25X_Resume);
+    W25QXX_CS(QSPIx, 1);
+    W25QXX_Suspended = 0;
+}
+
+// reads do not wait for an erase: outside the range it changes the erase is
+// suspended (0x75) and the read goes ahead once BUSY drops, within tSUS. It
+// stays suspended until a command that is not a read, which resumes it in
+// W25QXX_Wait_Busy, or W25QXX_Erase_Idle. A page program is over sooner than
+// a suspend and resume would save, reads wait for it.
+static void W25QXX_ReadReady(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len){
+    if(!W25QXX_Pending)return;
+#if W25QXX_SUSPEND
+    if(W25QXX_PendLen < 4096 || (Addr < W25QXX_PendAddr + W25QXX_PendLen && Addr + Len > W25QXX_PendAddr))
+    {
+        W25QXX_Wait_Busy(QSPIx);        //a page program, or the data is changing
+        return;
+    }
+    if(W25QXX_Suspended)return;
+    if(!(W25QXX_ReadSR(QSPIx, 1) & 0x01))
+    {
+        W25QXX_Pending = 0;
+        return;
+    }
+    W25QXX_CS(QSPIx, 0);
+    Spi_readwrite(QSPIx, W25X_Suspend);
+    W25QXX_CS(QSPIx, 1);
+    while((W25QXX_ReadSR(QSPIx, 1) & 0x01) == 0x01);
+    //finished before the suspend arrived, then SUS stays clear
+    W25QXX_Suspended = (W25QXX_ReadSR(QSPIx, 2) & W25X_SR2_SUS) != 0;
+    if(!W25QXX_Suspended)W25QXX_Pending = 0;
+#else
+    W25QXX_Wait_Busy(QSPIx);
+#endif
+}
+
+// back from flash mode to register mode
+static void W25QXX_XIP_Leave(QSPI_TypeDef* QSPIx){
+    if(!W25QXX_XipOn)return;
+    while(SET == QSPI_GetFlag(QSPIx, QSPI_STATUS_BUSY));
+    QSPI_XIP_Enable((QSPI_XIP_TypeDef*)QSPIx, DISABLE);
+    W25QXX_XipOn = 0;
+}
+
+// mode and dummy clocks between the address and the data of a read command
+static uint8_t W25QXX_ReadClocks(uint8_t cmd){
+    switch(cmd)
+    {
+        case W25X_FastReadDual: return W25QXX_Info.Clocks[W25QXX_READ_112];
+        case W25X_FastReadDualIO: return W25QXX_Info.Clocks[W25QXX_READ_122];
+        case W25X_FastReadQuad: return W25QXX_Info.Clocks[W25QXX_READ_114];
+        case W25X_FastReadQuadIO: return W25QXX_Info.Clocks[W25QXX_READ_144];
+        case W25X_ReadData: return 0;
+        default: return 8;
+    }
+}
+
+static uint32_t W25QXX_Dword(const uint8_t* p){
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// JESD216 basic flash parameter table, the first one the SFDP header lists.
+// Only the standard read opcodes are taken, W25QXX_Read frames them by opcode.
+// Parts without SFDP keep what W25QXX_Init derived from the ID.
+static void W25QXX_ParseSFDP(QSPI_TypeDef* QSPIx)
+{
+    uint8_t hdr[16];
+    uint8_t t[64];
+    uint32_t d, len, i;
+
+    W25QXX_ReadSFDP(QSPIx, hdr, 0, sizeof(hdr));
+    if(W25QXX_Dword(hdr) != 0x50444653 || hdr[8] != 0x00)return;     //"SFDP", table ID 0x00
+    len = hdr[11] * 4;
+    if(len < 36)return;                                                 //JESD216 has nine DWORDs
+    if(len > sizeof(t))len = sizeof(t);
+    memset(t, 0, sizeof(t));
+    W25QXX_ReadSFDP(QSPIx, t, hdr[12] | ((uint32_t)hdr[13] << 8) | ((uint32_t)hdr[14] << 16), len);
+
+    d = W25QXX_Dword(t + 4);                                            //DWORD2, density in bits
+    W25QXX_Info.Size = (d & 0x80000000) ? (1UL << ((d & 0x7FFFFFFF) - 3)) : (d + 1) / 8;
+    d = W25QXX_Dword(t);                                                //DWORD1
+    W25QXX_Info.AddrBytes = (((d >> 17) & 3) == 2 || (((d >> 17) & 3) == 1 && W25QXX_Info.Size > 0x1000000)) ? 4 : 3;
+    W25QXX_Info.Enter4B = (((d >> 17) & 3) == 1 && W25QXX_Info.AddrBytes == 4) ? 1 : 0;
+    W25QXX_Info.Reads = 0;
+    if((d & (1UL << 16)) && t[13] == W25X_FastReadDual)
+    {
+        W25QXX_Info.Reads |= 1 << W25QXX_READ_112;
+        W25QXX_Info.Clocks[W25QXX_READ_112] = (t[12] & 0x1F) + (t[12] >> 5);
+    }
+    if((d & (1UL << 20)) && t[15] == W25X_FastReadDualIO)
+    {
+        W25QXX_Info.Reads |= 1 << W25QXX_READ_122;
+        W25QXX_Info.Clocks[W25QXX_READ_122] = (t[14] & 0x1F) + (t[14] >> 5);
+    }
+    if((d & (1UL << 22)) && t[11] == W25X_FastReadQuad)
+    {
+        W25QXX_Info.Reads |= 1 << W25QXX_READ_114;
+        W25QXX_Info.Clocks[W25QXX_READ_114] = (t[10] & 0x1F) + (t[10] >> 5);
+    }
+    if((d & (1UL << 21)) && t[9] == W25X_FastReadQuadIO)
+    {
+        W25QXX_Info.Reads |= 1 << W25QXX_READ_144;
+        W25QXX_Info.Clocks[W25QXX_READ_144] = (t[8] & 0x1F) + (t[8] >> 5);
+    }
+    W25QXX_Info.Erase64K = 0;
+    for(i = 0; i < 4; i++)                                              //DWORD8-9, erase types
+    {
+        if(t[28 + 2 * i] == 12)W25QXX_Info.Erase4K = t[29 + 2 * i];
+        if(t[28 + 2 * i] == 16)W25QXX_Info.Erase64K = t[29 + 2 * i];
+    }
+    if(len >= 44 && ((t[40] >> 4) & 0x0F) >= 8)W25QXX_Info.PageSize = 1 << ((t[40] >> 4) & 0x0F);    //DWORD11
+    if(len >= 64 && W25QXX_Info.Enter4B)                                //DWORD16, how to enter 4-byte mode
+    {
+        if(t[63] & 0x01)W25QXX_Info.Enter4B = 1;
+        else if(t[63] & 0x02)W25QXX_Info.Enter4B = 2;
+        else W25QXX_Info.Enter4B = 0;
+    }
+    W25QXX_Info.Sfdp = 1;
+}
+
+// fastest read that returns the same data as the single line fast read.
+// Quad reads need QE in status register 2, which also turns /WP and /HOLD
+// into IO2 and IO3. A blank flash reads the same over unconnected lines, so
+// the check only catches wiring faults once the first bytes hold data.
+// Once a quad read works the quad page program is used as well.
+static void W25QXX_PickModes(QSPI_TypeDef* QSPIx)
+{
+    static const uint8_t cmds[] = { W25X_FastReadQuadIO, W25X_FastReadQuad, W25X_FastReadDualIO, W25X_FastReadDual };
+    uint8_t ref[16], tst[16];
+    uint8_t sr2, i;
+
+    sr2 = W25QXX_ReadSR(QSPIx, 2);
+    if(!(sr2 & W25X_SR2_QE))
+    {
+        W25QXX_Write_SR(QSPIx, 2, sr2 | W25X_SR2_QE);
+        sr2 = W25QXX_ReadSR(QSPIx, 2);
+    }
+    W25QXX_READ_CMD = W25X_FastReadData;
+    W25QXX_Read(QSPIx, ref, 0, sizeof(ref));
+    for(i = 0; i < sizeof(cmds); i++)
+    {
+        if(!(W25QXX_Info.Reads & (8 >> i)))continue;       //cmds[] runs from W25QXX_READ_144 down
+        if(!(sr2 & W25X_SR2_QE) && (cmds[i] == W25X_FastReadQuadIO || cmds[i] == W25X_FastReadQuad))continue;
+        W25QXX_READ_CMD = cmds[i];
+        W25QXX_Read(QSPIx, tst, 0, sizeof(tst));
+        if(memcmp(ref, tst, sizeof(ref)) == 0)break;
+    }
+    if(i == sizeof(cmds))W25QXX_READ_CMD = W25X_FastReadData;
+    W25QXX_PROG_CMD = (W25QXX_READ_CMD == W25X_FastReadQuadIO || W25QXX_READ_CMD == W25X_FastReadQuad) ? W25X_PageProgramQuad : W25X_PageProgram;
+}
+
 void Spi_setspeed(QSPI_TypeDef* QSPIx, uint8_t speed){
     QSPIx->SCKDIV = speed;
 }
 
 void W25QXX_CS(QSPI_TypeDef* QSPIx, uint8_t p){
+    if(p == 0)W25QXX_XIP_Leave(QSPIx);     //commands are framed by hand
     if(p == 1){
         QSPI_CS_Enable(QSPIx, QSPI_CSID_NUM_CS0, DISABLE);
     }else{
@@ -23,7 +210,11 @@ void W25QXX_CS(QSPI_TypeDef* QSPIx, uint8_t p){
 
 void W25QXX_Init(QSPI_TypeDef* QSPIx)
 {
-    uint8_t temp;
+    W25QXX_XIP_Leave(QSPIx);
+    W25QXX_XipWindow = 0;
+    W25QXX_Pending = 0;
+    W25QXX_Suspended = 0;
+    memset(W25QXX_EraseQ, 0, sizeof(W25QXX_EraseQ));
     W25QXX_CS(QSPIx, 1);
     QSPI_InitTypeDef spi_init_struct;
     /* deinitilize SPI and the parameters */
@@ -43,16 +234,47 @@ void W25QXX_Init(QSPI_TypeDef* QSPIx)
 
     Spi_setspeed(QSPIx, QSPI_SCKDIV_PRESCALER_2);
     W25QXX_TYPE = W25QXX_ReadID(QSPIx);
-    if(W25QXX_TYPE == W25Q256)
-    {
-        temp=W25QXX_ReadSR(QSPIx, 3);
-        if((temp & 0X01) != 1)  //If it is a 4-byte address mode, enter the 4-byte address mode
-        {
-            W25QXX_CS(QSPIx, 0);
-            Spi_readwrite(QSPIx, W25X_Enable4ByteAddr);
-            W25QXX_CS(QSPIx, 1);
-        }
-    }
+    //the low byte of the ID is the capacity code of W25Q80..W25Q256, log2 of the size - 1
+    memset(&W25QXX_Info, 0, sizeof(W25QXX_Info));
+    W25QXX_Info.Size = ((W25QXX_TYPE & 0xFF) >= 0x10 && (W25QXX_TYPE & 0xFF) <= 0x1F) ? 1UL << ((W25QXX_TYPE & 0xFF) + 1) : 0x1000000;
+    W25QXX_Info.PageSize = 256;
+    W25QXX_Info.AddrBytes = (W25QXX_Info.Size > 0x1000000) ? 4 : 3;
+    W25QXX_Info.Enter4B = (W25QXX_Info.AddrBytes == 4) ? 1 : 0;
+    W25QXX_Info.Erase4K = W25X_SectorErase;
+    W25QXX_Info.Erase64K = W25X_BlockErase;
+    W25QXX_Info.Reads = 0x0F;
+    W25QXX_Info.Clocks[W25QXX_READ_112] = 8;
+    W25QXX_Info.Clocks[W25QXX_READ_122] = 4;
+    W25QXX_Info.Clocks[W25QXX_READ_114] = 8;
+    W25QXX_Info.Clocks[W25QXX_READ_144] = 6;
+    W25QXX_ParseSFDP(QSPIx);
+    if(W25QXX_Info.AddrBytes == 4)W25QXX_4ByteAddr_Enable(QSPIx);
+    W25QXX_PickModes(QSPIx);
+}
+
+// 4-byte addresses above 16MB, the way SFDP says the part enters the mode
+void W25QXX_4ByteAddr_Enable(QSPI_TypeDef* QSPIx)
+{
+    if(!W25QXX_Info.Enter4B)return;
+    if(W25QXX_Info.Enter4B == 2)W25QXX_Write_Enable(QSPIx);
+    W25QXX_Ready(QSPIx);
+    W25QXX_CS(QSPIx, 0);
+    Spi_readwrite(QSPIx, W25X_Enable4ByteAddr);
+    W25QXX_CS(QSPIx, 1);
+}
+
+// SFDP reads like the fast read: 3 address bytes and 8 dummy clocks
+void W25QXX_ReadSFDP(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t Addr, uint16_t Len)
+{
+    W25QXX_Ready(QSPIx);
+    W25QXX_CS(QSPIx, 0);
+    Spi_readwrite(QSPIx, W25X_ReadSFDP);
+    Spi_readwrite(QSPIx, (uint8_t)(Addr >> 16));
+    Spi_readwrite(QSPIx, (uint8_t)(Addr >> 8));
+    Spi_readwrite(QSPIx, (uint8_t)Addr);
+    Spi_readwrite(QSPIx, 0XFF);
+    while(Len--)*pBuffer++ = Spi_readwrite(QSPIx, 0XFF);
+    W25QXX_CS(QSPIx, 1);
 }
 
 uint8_t W25QXX_ReadSR(QSPI_TypeDef* QSPIx, uint8_t regno)
@@ -98,14 +320,17 @@ void W25QXX_Write_SR(QSPI_TypeDef* QSPIx, uint8_t regno,uint8_t sr)
             command=W25X_WriteStatusReg1;
             break;
     }
+    W25QXX_Write_Enable(QSPIx);
     W25QXX_CS(QSPIx, 0);
     Spi_readwrite(QSPIx, command);
     Spi_readwrite(QSPIx, sr);
     W25QXX_CS(QSPIx, 1);
+    W25QXX_Wait_Busy(QSPIx);
 }
 
 void W25QXX_Write_Enable(QSPI_TypeDef* QSPIx)
 {
+    W25QXX_Ready(QSPIx);
     W25QXX_CS(QSPIx, 0);
     Spi_readwrite(QSPIx, W25X_WriteEnable);
     W25QXX_CS(QSPIx, 1);
@@ -113,6 +338,7 @@ void W25QXX_Write_Enable(QSPI_TypeDef* QSPIx)
 
 void W25QXX_Write_Disable(QSPI_TypeDef* QSPIx)
 {
+    W25QXX_Ready(QSPIx);
     W25QXX_CS(QSPIx, 0);
     Spi_readwrite(QSPIx, W25X_WriteDisable);
     W25QXX_CS(QSPIx, 1);
@@ -121,6 +347,7 @@ void W25QXX_Write_Disable(QSPI_TypeDef* QSPIx)
 uint16_t W25QXX_ReadID(QSPI_TypeDef* QSPIx)
 {
     uint16_t Temp = 0;
+    W25QXX_Ready(QSPIx);
     W25QXX_CS(QSPIx, 0);
     Spi_readwrite(QSPIx, W25X_ManufactDeviceID);
     Spi_readwrite(QSPIx, 0x00);
@@ -132,48 +359,152 @@ uint16_t W25QXX_ReadID(QSPI_TypeDef* QSPIx)
     return Temp;
 }
 
+// command and address phases per W25QXX_READ_CMD, the clocks after the address
+// come from SFDP, these are the W25Q ones:
+//   0x0B  1-1-1, 8 dummy clocks       0x3B  1-1-2, 8 dummy clocks
+//   0xBB  1-2-2, mode byte            0x6B  1-1-4, 8 dummy clocks
+//   0xEB  1-4-4, mode byte and 4 dummy clocks
 void W25QXX_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t ReadAddr,uint16_t NumByteToRead)
 {
     uint16_t i;
+    uint8_t cmd = W25QXX_READ_CMD;
+    uint32_t aproto = QSPI_FMT_PROTO_SINGLE;
+    uint32_t dproto = QSPI_FMT_PROTO_SINGLE;
+    uint8_t abytes = W25QXX_Info.AddrBytes;
+    uint8_t pad = W25QXX_ReadClocks(cmd);
+
+    if(cmd == W25X_FastReadDualIO)aproto = QSPI_FMT_PROTO_DUAL;
+    if(cmd == W25X_FastReadQuadIO)aproto = QSPI_FMT_PROTO_QUAD;
+    if(cmd == W25X_FastReadDual || cmd == W25X_FastReadDualIO)dproto = QSPI_FMT_PROTO_DUAL;
+    if(cmd == W25X_FastReadQuad || cmd == W25X_FastReadQuadIO)dproto = QSPI_FMT_PROTO_QUAD;
+
+    if(W25QXX_XipWindow)
+    {
+        memcpy(pBuffer, W25QXX_XIP_Map(QSPIx, ReadAddr, NumByteToRead), NumByteToRead);
+        return;
+    }
+    W25QXX_ReadReady(QSPIx, ReadAddr, NumByteToRead);
     W25QXX_CS(QSPIx, 0);
-    Spi_readwrite(QSPIx, W25X_FastReadData);
-    if(W25QXX_TYPE == W25Q256)
+    Spi_readwrite(QSPIx, cmd);
+    if(aproto == QSPI_FMT_PROTO_SINGLE)
     {
-        Spi_readwrite(QSPIx, (uint8_t)((ReadAddr)>>24));
+        while(abytes--)Spi_readwrite(QSPIx, (uint8_t)(ReadAddr >> (8 * abytes)));
+        for(pad /= 8; pad; pad--)Spi_readwrite(QSPIx, 0XFF);
+    }else
+    {
+        Spi_setproto(QSPIx, aproto, QSPI_FMT_DIR_TX);
+        while(abytes--)Spi_write(QSPIx, (uint8_t)(ReadAddr >> (8 * abytes)));
+        //mode bits first, 0xFF is not continuous read, then dummy clocks
+        for(pad = pad * (aproto == QSPI_FMT_PROTO_QUAD ? 4 : 2) / 8; pad; pad--)Spi_write(QSPIx, 0XFF);
     }
-    Spi_readwrite(QSPIx, (uint8_t)((ReadAddr)>>16));
-    Spi_readwrite(QSPIx, (uint8_t)((ReadAddr)>>8));
-    Spi_readwrite(QSPIx, (uint8_t)ReadAddr);
-    Spi_readwrite(QSPIx, 0XFF);
+    Spi_setproto(QSPIx, dproto, QSPI_FMT_DIR_RX);
     for(i=0;i<NumByteToRead;i++)
     {
         pBuffer[i]=Spi_readwrite(QSPIx, 0XFF);
     }
+    Spi_setproto(QSPIx, QSPI_FMT_PROTO_SINGLE, QSPI_FMT_DIR_RX);
     W25QXX_CS(QSPIx, 1);
 }
 
+// Memory mapped reads: the controller sends W25QXX_READ_CMD by itself and the
+// flash appears at Window, W25QXX_Read copies from there. Call after
+// W25QXX_Init, which picks the read command. Every other command leaves flash
+// mode in W25QXX_CS, the next read enters it again.
+void W25QXX_XIP_Init(QSPI_TypeDef* QSPIx, uint32_t Window)
+{
+    QSPI_XIP_ReadStruct rd;
+    uint8_t cmd = W25QXX_READ_CMD;
+
+    memset(&rd, 0, sizeof(rd));
+    rd.CMD_EN = 1;
+    rd.CMD_CODE = cmd;
+    rd.CMD_PROTO = QSPI_XIP_FMT_PROTO_SINGLE;
+    rd.ADDR_LEN = W25QXX_Info.AddrBytes;
+    rd.ADDR_PROTO = QSPI_XIP_FMT_PROTO_SINGLE;
+    rd.DATA_PROTO = QSPI_XIP_FMT_PROTO_SINGLE;
+    rd.PAD_CNT = W25QXX_ReadClocks(cmd);    //mode and dummy clocks
+    rd.PAD_CODE = 0xFF;                 //mode bits of 0xBB/0xEB, not continuous read
+    if(cmd == W25X_FastReadDual || cmd == W25X_FastReadDualIO)rd.DATA_PROTO = QSPI_XIP_FMT_PROTO_DUAL;
+    if(cmd == W25X_FastReadQuad || cmd == W25X_FastReadQuadIO)rd.DATA_PROTO = QSPI_XIP_FMT_PROTO_QUAD;
+    if(cmd == W25X_FastReadDualIO)rd.ADDR_PROTO = QSPI_XIP_FMT_PROTO_DUAL;
+    if(cmd == W25X_FastReadQuadIO)rd.ADDR_PROTO = QSPI_XIP_FMT_PROTO_QUAD;
+    W25QXX_Ready(QSPIx);
+    W25QXX_XIP_Leave(QSPIx);
+    QSPI_XIP_RDConfig((QSPI_XIP_TypeDef*)QSPIx, &rd);
+    W25QXX_XipWindow = Window;
+}
+
+// address of Addr in the memory mapped window, NULL without W25QXX_XIP_Init.
+// Switches the controller to flash mode, the pointer reads the flash until the
+// next program, erase or register mode command leaves it again.
+const uint8_t* W25QXX_XIP_Map(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len)
+{
+    if(!W25QXX_XipWindow)return NULL;
+    W25QXX_ReadReady(QSPIx, Addr, Len);
+    if(!W25QXX_XipOn)
+    {
+        QSPI_XIP_Enable((QSPI_XIP_TypeDef*)QSPIx, ENABLE);
+        W25QXX_XipOn = 1;
+    }
+#if defined(__CCM_PRESENT) && (__CCM_PRESENT == 1)
+    // lines of the window may predate the last program or erase
+    if(Len)MInvalDCacheLines(W25QXX_XipWindow + Addr, (Addr % 32 + Len + 31) / 32);
+#endif
+    return (const uint8_t*)(uintptr_t)(W25QXX_XipWindow + Addr);
+}
+
+// take a sector out of the queue. Not erasing a freed sector is always safe,
+// a run that cannot be split loses its tail.
+static void W25QXX_Erase_Drop(uint32_t Sec)
+{
+    uint8_t i, j;
+    for(i = 0; i < W25QXX_ERASE_QUEUE; i++)
+    {
+        if(Sec < W25QXX_EraseQ[i].Sec || Sec >= W25QXX_EraseQ[i].End)continue;
+        if(Sec == W25QXX_EraseQ[i].Sec)W25QXX_EraseQ[i].Sec++;
+        else
+        {
+            for(j = 0; j < W25QXX_ERASE_QUEUE && W25QXX_EraseQ[j].Sec != W25QXX_EraseQ[j].End; j++);
+            if(j < W25QXX_ERASE_QUEUE)
+            {
+                W25QXX_EraseQ[j].Sec = Sec + 1;
+                W25QXX_EraseQ[j].End = W25QXX_EraseQ[i].End;
+            }
+            W25QXX_EraseQ[i].End = Sec;
+        }
+    }
+}
+
+// The data goes out through the transmit FIFO without waiting for each byte,
+// on four lines with 0x32. The function returns while the page programs, the
+// next command waits in W25QXX_Ready, so the caller can prepare the next page.
 void W25QXX_Write_Page(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t WriteAddr,uint16_t NumByteToWrite)
 {
     uint16_t i;
+    W25QXX_Erase_Drop(WriteAddr / 4096);
     W25QXX_Write_Enable(QSPIx);
     W25QXX_CS(QSPIx, 0);
-    Spi_readwrite(QSPIx, W25X_PageProgram);
-    if(W25QXX_TYPE == W25Q256)
+    Spi_readwrite(QSPIx, W25QXX_PROG_CMD);
+    if(W25QXX_Info.AddrBytes == 4)
     {
         Spi_readwrite(QSPIx, (uint8_t)((WriteAddr)>>24));
     }
     Spi_readwrite(QSPIx, (uint8_t)((WriteAddr)>>16));
     Spi_readwrite(QSPIx, (uint8_t)((WriteAddr)>>8));
     Spi_readwrite(QSPIx, (uint8_t)WriteAddr);
-    for(i=0;i<NumByteToWrite;i++)Spi_readwrite(QSPIx, pBuffer[i]);
+    Spi_setproto(QSPIx, (W25QXX_PROG_CMD == W25X_PageProgramQuad) ? QSPI_FMT_PROTO_QUAD : QSPI_FMT_PROTO_SINGLE, QSPI_FMT_DIR_TX);
+    for(i=0;i<NumByteToWrite;i++)Spi_write(QSPIx, pBuffer[i]);
+    Spi_setproto(QSPIx, QSPI_FMT_PROTO_SINGLE, QSPI_FMT_DIR_RX);
     W25QXX_CS(QSPIx, 1);
-    W25QXX_Wait_Busy(QSPIx);
+    W25QXX_Pending = 1;
+    W25QXX_PendAddr = WriteAddr & ~(W25QXX_Info.PageSize - 1U);
+    W25QXX_PendLen = W25QXX_Info.PageSize;
 }
 
 void W25QXX_Write_NoCheck(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t WriteAddr,uint16_t NumByteToWrite)
 {
     uint16_t pageremain;
-    pageremain=256-WriteAddr%256;
+    pageremain=W25QXX_Info.PageSize-WriteAddr%W25QXX_Info.PageSize;
     if(NumByteToWrite<=pageremain)pageremain=NumByteToWrite;
     while(1)
     {
@@ -185,7 +516,7 @@ void W25QXX_Write_NoCheck(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t WriteAd
             WriteAddr+=pageremain;
 
             NumByteToWrite-=pageremain;
-            if(NumByteToWrite>256)pageremain=256;
+            if(NumByteToWrite>W25QXX_Info.PageSize)pageremain=W25QXX_Info.PageSize;
             else pageremain=NumByteToWrite;
         }
     };
@@ -237,9 +568,105 @@ void W25QXX_Write(QSPI_TypeDef* QSPIx, uint8_t* pBuffer,uint32_t WriteAddr,uint1
     };
 }
 
+// write-back cache of one 4KB erase sector. FatFs writes the eight 512 byte
+// sectors of an erase sector one call at a time, they are merged here and the
+// sector is written once, on eviction or W25QXX_Cache_Flush.
+static uint32_t W25QXX_CacheSec = 0xFFFFFFFF;    //sector held, 0xFFFFFFFF for none
+static uint8_t W25QXX_CacheDirty;
+uint8_t W25QXX_CACHE[4096];
+
+// write the cached sector back. When the new data only clears bits the pages
+// that changed are programmed over the old contents, no erase needed.
+void W25QXX_Cache_Flush(QSPI_TypeDef* QSPIx)
+{
+    uint8_t old[256];
+    uint16_t changed = 0;
+    uint8_t erase = 0;
+    uint16_t pg, i;
+    uint8_t* page;
+
+    if(!W25QXX_CacheDirty)return;
+    for(pg = 0; pg < 16 && !erase; pg++)
+    {
+        page = W25QXX_CACHE + pg * 256;
+        W25QXX_Read(QSPIx, old, W25QXX_CacheSec * 4096 + pg * 256, 256);
+        for(i = 0; i < 256; i++)
+        {
+            if((old[i] & page[i]) != page[i])erase = 1;    //a 0 would have to become 1
+            if(old[i] != page[i])changed |= 1 << pg;
+        }
+    }
+    if(erase)
+    {
+        W25QXX_Erase_Sector(QSPIx, W25QXX_CacheSec);
+        changed = 0;
+        for(pg = 0; pg < 16; pg++)
+        {
+            page = W25QXX_CACHE + pg * 256;
+            for(i = 0; i < 256 && page[i] == 0xFF; i++);
+            if(i < 256)changed |= 1 << pg;                //blank pages stay as erased
+        }
+    }
+    for(pg = 0; pg < 16; pg++)
+    {
+        if(changed & (1 << pg))W25QXX_Write_Page(QSPIx, W25QXX_CACHE + pg * 256, W25QXX_CacheSec * 4096 + pg * 256, 256);
+    }
+    W25QXX_CacheDirty = 0;
+}
+
+void W25QXX_Cache_Write(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t WriteAddr, uint32_t NumByteToWrite)
+{
+    uint32_t secpos, secoff, secremain;
+    while(NumByteToWrite)
+    {
+        secpos = WriteAddr / 4096;
+        secoff = WriteAddr % 4096;
+        secremain = 4096 - secoff;
+        if(NumByteToWrite < secremain)secremain = NumByteToWrite;
+        if(secpos != W25QXX_CacheSec)
+        {
+            W25QXX_Cache_Flush(QSPIx);
+            //a write covering the whole sector does not need the old contents
+            if(secremain < 4096)W25QXX_Read(QSPIx, W25QXX_CACHE, secpos * 4096, 4096);
+            W25QXX_CacheSec = secpos;
+        }
+        //the flush may find nothing to program, the sector is live all the same
+        W25QXX_Erase_Drop(secpos);
+        memcpy(W25QXX_CACHE + secoff, pBuffer, secremain);
+        W25QXX_CacheDirty = 1;
+        pBuffer += secremain;
+        WriteAddr += secremain;
+        NumByteToWrite -= secremain;
+    }
+}
+
+// reads see data still waiting in the cache
+void W25QXX_Cache_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t ReadAddr, uint32_t NumByteToRead)
+{
+    uint32_t base = W25QXX_CacheSec * 4096;
+    uint32_t from, to;
+    while(NumByteToRead)
+    {
+        to = NumByteToRead > 0x8000 ? 0x8000 : NumByteToRead;
+        W25QXX_Read(QSPIx, pBuffer, ReadAddr, (uint16_t)to);
+        if(W25QXX_CacheSec != 0xFFFFFFFF && ReadAddr < base + 4096 && ReadAddr + to > base)
+        {
+            from = ReadAddr > base ? ReadAddr : base;
+            memcpy(pBuffer + (from - ReadAddr), W25QXX_CACHE + (from - base),
+                   (ReadAddr + to < base + 4096 ? ReadAddr + to : base + 4096) - from);
+        }
+        pBuffer += to;
+        ReadAddr += to;
+        NumByteToRead -= to;
+    }
+}
+
 // erase the whole chip, waiting too long...
 void W25QXX_Erase_Chip(QSPI_TypeDef* QSPIx)
 {
+    W25QXX_CacheSec = 0xFFFFFFFF;
+    W25QXX_CacheDirty = 0;
+    memset(W25QXX_EraseQ, 0, sizeof(W25QXX_EraseQ));
     W25QXX_Write_Enable(QSPIx);
     W25QXX_Wait_Busy(QSPIx);
       W25QXX_CS(QSPIx, 0);
@@ -248,14 +675,15 @@ void W25QXX_Erase_Chip(QSPI_TypeDef* QSPIx)
     W25QXX_Wait_Busy(QSPIx);
 }
 
-void W25QXX_Erase_Sector(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr)
+// send an erase command and return while it runs, the next command waits
+// for it in W25QXX_Ready
+static void W25QXX_Erase_Start(QSPI_TypeDef* QSPIx, uint8_t Cmd, uint32_t Dst_Addr)
 {
-    Dst_Addr*=4096;
     W25QXX_Write_Enable(QSPIx);
     W25QXX_Wait_Busy(QSPIx);
     W25QXX_CS(QSPIx, 0);
-    Spi_readwrite(QSPIx, W25X_SectorErase);
-    if(W25QXX_TYPE == W25Q256)
+    Spi_readwrite(QSPIx, Cmd);
+    if(W25QXX_Info.AddrBytes == 4)
     {
         Spi_readwrite(QSPIx, (uint8_t)((Dst_Addr)>>24));
     }
@@ -263,16 +691,145 @@ void W25QXX_Erase_Sector(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr)
     Spi_readwrite(QSPIx, (uint8_t)((Dst_Addr)>>8));
     Spi_readwrite(QSPIx, (uint8_t)Dst_Addr);
     W25QXX_CS(QSPIx, 1);
+    W25QXX_Pending = 1;
+    W25QXX_PendLen = (Cmd == W25QXX_Info.Erase64K) ? 65536 : 4096;
+    W25QXX_PendAddr = Dst_Addr & ~(W25QXX_PendLen - 1);
+}
+
+void W25QXX_Erase_Sector(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr)
+{
+    W25QXX_Erase_Start(QSPIx, W25QXX_Info.Erase4K, Dst_Addr * 4096);
     W25QXX_Wait_Busy(QSPIx);
 }
 
+// erase a 64KB block, Dst_Addr is the block number. Sixteen 4KB erases on a
+// part without a 64KB erase.
+void W25QXX_Erase_Block(QSPI_TypeDef* QSPIx, uint32_t Dst_Addr)
+{
+    uint8_t i;
+    if(!W25QXX_Info.Erase64K)
+    {
+        for(i = 0; i < 16; i++)W25QXX_Erase_Sector(QSPIx, Dst_Addr * 16 + i);
+        return;
+    }
+    W25QXX_Erase_Start(QSPIx, W25QXX_Info.Erase64K, Dst_Addr * 65536);
+    W25QXX_Wait_Busy(QSPIx);
+}
+
+// erase the 4KB sectors lying completely inside [Addr, Addr+Len), whole 64KB
+// blocks with one block erase. Partly covered sectors are left alone, they
+// still hold live data. W25QXX_Write skips the erase for blank sectors later.
+void W25QXX_Erase_Range(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len)
+{
+    uint32_t sec = (Addr + 4095) / 4096;
+    uint32_t end = (Addr + Len) / 4096;
+
+    if(W25QXX_CacheSec >= sec && W25QXX_CacheSec < end)
+    {
+        //the cached sector is erased as a whole, its pending data is dropped
+        W25QXX_CacheSec = 0xFFFFFFFF;
+        W25QXX_CacheDirty = 0;
+    }
+    while(sec < end)
+    {
+        if(sec % 16 == 0 && end - sec >= 16)
+        {
+            W25QXX_Erase_Block(QSPIx, sec / 16);
+            sec += 16;
+        }else
+        {
+            W25QXX_Erase_Sector(QSPIx, sec);
+            sec++;
+        }
+    }
+}
+
+// queue the 4KB sectors lying completely inside [Addr, Addr+Len) for
+// W25QXX_Erase_Idle. Runs touching a queued one are merged, when the queue is
+// full the range is erased right away with W25QXX_Erase_Range.
+void W25QXX_Erase_Defer(QSPI_TypeDef* QSPIx, uint32_t Addr, uint32_t Len)
+{
+    uint32_t sec = (Addr + 4095) / 4096;
+    uint32_t end = (Addr + Len) / 4096;
+    uint8_t i, j = W25QXX_ERASE_QUEUE;
+
+    if(sec >= end)return;
+    if(W25QXX_CacheSec >= sec && W25QXX_CacheSec < end)
+    {
+        //the cached sector is freed as a whole, its pending data is dropped
+        W25QXX_CacheSec = 0xFFFFFFFF;
+        W25QXX_CacheDirty = 0;
+    }
+    for(i = 0; i < W25QXX_ERASE_QUEUE; i++)
+    {
+        if(W25QXX_EraseQ[i].Sec == W25QXX_EraseQ[i].End)
+        {
+            if(j == W25QXX_ERASE_QUEUE)j = i;
+            continue;
+        }
+        if(sec <= W25QXX_EraseQ[i].End && end >= W25QXX_EraseQ[i].Sec)
+        {
+            if(W25QXX_EraseQ[i].Sec < sec)sec = W25QXX_EraseQ[i].Sec;
+            if(W25QXX_EraseQ[i].End > end)end = W25QXX_EraseQ[i].End;
+            W25QXX_EraseQ[i].Sec = W25QXX_EraseQ[i].End = 0;
+            if(j == W25QXX_ERASE_QUEUE)j = i;
+        }
+    }
+    if(j == W25QXX_ERASE_QUEUE)
+    {
+        W25QXX_Erase_Range(QSPIx, sec * 4096, (end - sec) * 4096);
+        return;
+    }
+    W25QXX_EraseQ[j].Sec = sec;
+    W25QXX_EraseQ[j].End = end;
+}
+
+// call from the idle loop until it returns 0. Each call starts one erase from
+// the queue without waiting for it, a whole 64KB block where a run covers
+// one, and returns 1 at once while the previous erase still runs.
+uint8_t W25QXX_Erase_Idle(QSPI_TypeDef* QSPIx)
+{
+    uint8_t i;
+    uint32_t sec;
+
+    if(W25QXX_Pending)
+    {
+        if(W25QXX_Suspended)
+        {
+            //reads are done, let the erase go on
+            W25QXX_Resume(QSPIx);
+            return 1;
+        }
+        if(W25QXX_ReadSR(QSPIx, 1) & 0x01)return 1;
+        W25QXX_Pending = 0;
+    }
+    for(i = 0; i < W25QXX_ERASE_QUEUE && W25QXX_EraseQ[i].Sec == W25QXX_EraseQ[i].End; i++);
+    if(i == W25QXX_ERASE_QUEUE)return 0;
+    sec = W25QXX_EraseQ[i].Sec;
+    if(W25QXX_Info.Erase64K && sec % 16 == 0 && W25QXX_EraseQ[i].End - sec >= 16)
+    {
+        W25QXX_Erase_Start(QSPIx, W25QXX_Info.Erase64K, sec * 4096);
+        W25QXX_EraseQ[i].Sec += 16;
+    }else
+    {
+        W25QXX_Erase_Start(QSPIx, W25QXX_Info.Erase4K, sec * 4096);
+        W25QXX_EraseQ[i].Sec++;
+    }
+    return 1;
+}
+
 void W25QXX_Wait_Busy(QSPI_TypeDef* QSPIx)
 {
-    while(W25QXX_ReadSR(QSPIx, (1) & 0x01 ) == 0x01);
+    // a suspended operation reads as idle, it has to finish first
+    if(W25QXX_Suspended)W25QXX_Resume(QSPIx);
+    // WEL stays set while a program or erase runs, only look at BUSY
+    while((W25QXX_ReadSR(QSPIx, 1) & 0x01) == 0x01);
+    W25QXX_Pending = 0;
 }
 
 void W25QXX_PowerDown(QSPI_TypeDef* QSPIx)
 {
+    W25QXX_Ready(QSPIx);
     W25QXX_CS(QSPIx, 0);
     Spi_readwrite(QSPIx, W25X_PowerDown);
     W25QXX_CS(QSPIx, 1);
@@ -0,0 +1,445 @@
+#include <string.h>
+#include "w25qxx_ftl.h"
+
+#define FTL_MAGIC       0x4C544657      //"WFTL"
+#define FTL_HDR_LEN     (16 + 4 * W25QXX_FTL_SLOTS)
+#define FTL_OFF_EC      4               //erase count, written right after the erase
+#define FTL_OFF_SEQ     8               //open sequence, written when the unit is opened
+#define FTL_OFF_TAG     16              //one tag per slot
+#define FTL_NONE        0xFFFF
+#define FTL_BLANK       0xFFFFFFFF
+#define FTL_TAG_LIVE    0x80000000      //cleared in place when the slot goes stale
+#define FTL_BLOCK_UNITS (65536 / W25QXX_FTL_UNIT_SIZE)     //units in one 64KB block erase
+
+//unit states, bit flags so lookups can take several
+#define FTL_ERASED      0x01            //erased and stamped, ready to open
+#define FTL_DIRTY       0x02            //no live sectors, needs an erase
+#define FTL_RAW         0x04            //no header, contents unknown
+#define FTL_USED        0x08            //holds sectors, closed for appends
+#define FTL_HEAD        0x10            //open for appends
+#define FTL_RECLAIM     (FTL_DIRTY | FTL_RAW)
+
+W25QXX_FTL_StatTypeDef W25QXX_FTL_Stat;
+
+static uint16_t ftl_map[W25QXX_FTL_SECTORS];       //logical sector -> unit * SLOTS + slot
+static uint32_t ftl_ec[W25QXX_FTL_UNITS];
+static uint32_t ftl_seq[W25QXX_FTL_UNITS];
+static uint8_t ftl_valid[W25QXX_FTL_UNITS];
+static uint8_t ftl_state[W25QXX_FTL_UNITS];
+static uint32_t ftl_head = W25QXX_FTL_UNITS;        //open unit, W25QXX_FTL_UNITS for none
+static uint8_t ftl_fill;                            //slots used in the open unit
+static uint32_t ftl_next_seq;
+static uint8_t ftl_in_gc;
+static uint8_t ftl_mounted;
+static uint8_t ftl_buf[512];
+
+static uint8_t ftl_append(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t lsn);
+
+static uint32_t ftl_get32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void ftl_put32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t ftl_unit_addr(uint32_t unit)
+{
+    return W25QXX_FTL_BASE + unit * W25QXX_FTL_UNIT_SIZE;
+}
+
+static uint32_t ftl_slot_addr(uint16_t p)
+{
+    return ftl_unit_addr(p / W25QXX_FTL_SLOTS) + (p % W25QXX_FTL_SLOTS + 1) * 512;
+}
+
+static uint32_t ftl_tag_addr(uint16_t p)
+{
+    return ftl_unit_addr(p / W25QXX_FTL_SLOTS) + FTL_OFF_TAG + (p % W25QXX_FTL_SLOTS) * 4;
+}
+
+static uint32_t ftl_count(uint8_t states)
+{
+    uint32_t u, n = 0;
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        if(ftl_state[u] & states)n++;
+    }
+    return n;
+}
+
+static uint32_t ftl_free(void)
+{
+    return ftl_count(FTL_ERASED | FTL_RECLAIM);
+}
+
+//lowest erase count among the units in the given states, W25QXX_FTL_UNITS if there is none
+static uint32_t ftl_coldest(uint8_t states)
+{
+    uint32_t u, best = W25QXX_FTL_UNITS;
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        if((ftl_state[u] & states) && (best == W25QXX_FTL_UNITS || ftl_ec[u] < ftl_ec[best]))best = u;
+    }
+    return best;
+}
+
+static void ftl_update_stat(void)
+{
+    uint32_t u;
+    W25QXX_FTL_Stat.FreeUnits = ftl_free();
+    W25QXX_FTL_Stat.MinErase = ftl_ec[0];
+    W25QXX_FTL_Stat.MaxErase = ftl_ec[0];
+    for(u = 1; u < W25QXX_FTL_UNITS; u++)
+    {
+        if(ftl_ec[u] < W25QXX_FTL_Stat.MinErase)W25QXX_FTL_Stat.MinErase = ftl_ec[u];
+        if(ftl_ec[u] > W25QXX_FTL_Stat.MaxErase)W25QXX_FTL_Stat.MaxErase = ftl_ec[u];
+    }
+}
+
+//a unit the FTL never stamped is often still blank from the factory
+static uint8_t ftl_blank(QSPI_TypeDef* QSPIx, uint32_t unit)
+{
+    uint8_t chk[256];       //ftl_buf may hold a sector garbage collection is moving
+    uint32_t off, i;
+    for(off = 0; off < W25QXX_FTL_UNIT_SIZE; off += sizeof(chk))
+    {
+        W25QXX_Read(QSPIx, chk, ftl_unit_addr(unit) + off, sizeof(chk));
+        for(i = 0; i < sizeof(chk); i++)
+        {
+            if(chk[i] != 0xFF)return 0;
+        }
+    }
+    return 1;
+}
+
+//stamp the header of an erased unit with its erase count
+static void ftl_stamp(QSPI_TypeDef* QSPIx, uint32_t unit)
+{
+    uint8_t hdr[8];
+    ftl_put32(hdr, FTL_MAGIC);
+    ftl_put32(hdr + FTL_OFF_EC, ftl_ec[unit]);
+    W25QXX_Write_NoCheck(QSPIx, hdr, ftl_unit_addr(unit), sizeof(hdr));
+    ftl_state[unit] = FTL_ERASED;
+    ftl_valid[unit] = 0;
+    ftl_seq[unit] = FTL_BLANK;
+}
+
+//erase a unit and stamp the header with its new erase count
+static void ftl_erase(QSPI_TypeDef* QSPIx, uint32_t unit)
+{
+    if(ftl_state[unit] != FTL_RAW || !ftl_blank(QSPIx, unit))
+    {
+        W25QXX_Erase_Sector(QSPIx, ftl_unit_addr(unit) / 4096);
+        ftl_ec[unit]++;
+        W25QXX_FTL_Stat.Erases++;
+    }
+    ftl_stamp(QSPIx, unit);
+}
+
+//first unit of a 64KB block whose units are all dirty, W25QXX_FTL_UNITS if
+//there is none. Units never stamped are left to ftl_erase, they may be blank.
+static uint32_t ftl_dirty_block(void)
+{
+    uint32_t u, first = (FTL_BLOCK_UNITS - W25QXX_FTL_BASE / W25QXX_FTL_UNIT_SIZE % FTL_BLOCK_UNITS) % FTL_BLOCK_UNITS;
+    for(; first + FTL_BLOCK_UNITS <= W25QXX_FTL_UNITS; first += FTL_BLOCK_UNITS)
+    {
+        for(u = first; u < first + FTL_BLOCK_UNITS && ftl_state[u] == FTL_DIRTY; u++);
+        if(u == first + FTL_BLOCK_UNITS)return first;
+    }
+    return W25QXX_FTL_UNITS;
+}
+
+//erase sixteen dirty units with one 64KB block erase
+static void ftl_erase_block(QSPI_TypeDef* QSPIx, uint32_t first)
+{
+    uint32_t u;
+    W25QXX_Erase_Block(QSPIx, ftl_unit_addr(first) / 65536);
+    for(u = first; u < first + FTL_BLOCK_UNITS; u++)
+    {
+        ftl_ec[u]++;
+        W25QXX_FTL_Stat.Erases++;
+        ftl_stamp(QSPIx, u);
+    }
+}
+
+//take the least worn erased unit, or erase the least worn dirty one
+static uint8_t ftl_open(QSPI_TypeDef* QSPIx)
+{
+    uint8_t seq[4];
+    uint32_t unit = ftl_coldest(FTL_ERASED);
+    uint32_t raw;
+    if(unit == W25QXX_FTL_UNITS)
+    {
+        //on a tie a unit never stamped goes first, it may not need the erase
+        unit = ftl_coldest(FTL_RECLAIM);
+        raw = ftl_coldest(FTL_RAW);
+        if(raw != W25QXX_FTL_UNITS && ftl_ec[raw] == ftl_ec[unit])unit = raw;
+        if(unit == W25QXX_FTL_UNITS)return 1;
+        ftl_erase(QSPIx, unit);
+    }
+    ftl_put32(seq, ftl_next_seq);
+    W25QXX_Write_NoCheck(QSPIx, seq, ftl_unit_addr(unit) + FTL_OFF_SEQ, 4);
+    ftl_seq[unit] = ftl_next_seq++;
+    ftl_state[unit] = FTL_HEAD;
+    ftl_head = unit;
+    ftl_fill = 0;
+    return 0;
+}
+
+//clear the live bit of a stale slot, it only takes a one byte program
+static void ftl_kill(QSPI_TypeDef* QSPIx, uint16_t p, uint32_t lsn)
+{
+    uint32_t unit = p / W25QXX_FTL_SLOTS;
+    uint8_t top = (uint8_t)((lsn & ~FTL_TAG_LIVE) >> 24);
+    W25QXX_Write_NoCheck(QSPIx, &top, ftl_tag_addr(p) + 3, 1);
+    ftl_valid[unit]--;
+    if(ftl_valid[unit] == 0 && ftl_state[unit] == FTL_USED)ftl_state[unit] = FTL_DIRTY;
+}
+
+//closed unit with the fewest live sectors, W25QXX_FTL_UNITS if none would free a slot
+static uint32_t ftl_victim(void)
+{
+    uint32_t u, best = W25QXX_FTL_UNITS;
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        if(ftl_state[u] != FTL_USED || ftl_valid[u] == W25QXX_FTL_SLOTS)continue;
+        if(best == W25QXX_FTL_UNITS || ftl_valid[u] < ftl_valid[best] ||
+           (ftl_valid[u] == ftl_valid[best] && ftl_ec[u] < ftl_ec[best]))best = u;
+    }
+    return best;
+}
+
+//move the live sectors of a unit to the open unit, the unit ends up dirty
+static uint8_t ftl_gc(QSPI_TypeDef* QSPIx, uint32_t unit)
+{
+    uint8_t hdr[FTL_HDR_LEN];
+    uint32_t s, tag;
+    uint16_t p;
+    if(unit >= W25QXX_FTL_UNITS)return 1;
+    W25QXX_Read(QSPIx, hdr, ftl_unit_addr(unit), FTL_HDR_LEN);
+    for(s = 0; s < W25QXX_FTL_SLOTS && ftl_valid[unit] != 0; s++)
+    {
+        tag = ftl_get32(hdr + FTL_OFF_TAG + 4 * s);
+        p = unit * W25QXX_FTL_SLOTS + s;
+        if(tag == FTL_BLANK || !(tag & FTL_TAG_LIVE))continue;
+        tag &= ~FTL_TAG_LIVE;
+        if(tag >= W25QXX_FTL_SECTORS || ftl_map[tag] != p)continue;
+        W25QXX_Read(QSPIx, ftl_buf, ftl_slot_addr(p), 512);
+        if(ftl_append(QSPIx, ftl_buf, tag))return 1;
+        W25QXX_FTL_Stat.GcCopies++;
+    }
+    W25QXX_FTL_Stat.Gc++;
+    return 0;
+}
+
+//make sure there is an open unit, collecting garbage first when free units run low
+static uint8_t ftl_room(QSPI_TypeDef* QSPIx)
+{
+    uint32_t cold, u, max = 0;
+    if(!ftl_in_gc)
+    {
+        ftl_in_gc = 1;
+        while(ftl_free() <= W25QXX_FTL_RESERVE && ftl_gc(QSPIx, ftl_victim()) == 0);
+        //static wear leveling: cold data parked in a little worn unit gets moved
+        //so the unit goes back into rotation
+        cold = ftl_coldest(FTL_USED);
+        if(cold != W25QXX_FTL_UNITS)
+        {
+            for(u = 0; u < W25QXX_FTL_UNITS; u++)
+            {
+                if(ftl_ec[u] > max)max = ftl_ec[u];
+            }
+            if(max - ftl_ec[cold] > W25QXX_FTL_WL_DELTA && ftl_gc(QSPIx, cold) == 0)W25QXX_FTL_Stat.WlMoves++;
+        }
+        ftl_in_gc = 0;
+        if(ftl_head != W25QXX_FTL_UNITS)return 0;
+    }
+    return ftl_open(QSPIx);
+}
+
+//program a sector into the next slot, then retire its previous copy
+static uint8_t ftl_append(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t lsn)
+{
+    uint8_t tag[4];
+    uint16_t p, old;
+    if(ftl_head == W25QXX_FTL_UNITS && ftl_room(QSPIx))return 1;
+    p = ftl_head * W25QXX_FTL_SLOTS + ftl_fill;
+    W25QXX_Write_NoCheck(QSPIx, (uint8_t*)pBuffer, ftl_slot_addr(p), 512);
+    ftl_put32(tag, lsn | FTL_TAG_LIVE);
+    W25QXX_Write_NoCheck(QSPIx, tag, ftl_tag_addr(p), 4);
+    ftl_valid[ftl_head]++;
+    ftl_fill++;
+    old = ftl_map[lsn];
+    ftl_map[lsn] = p;
+    if(old != FTL_NONE)ftl_kill(QSPIx, old, lsn);
+    if(ftl_fill == W25QXX_FTL_SLOTS)
+    {
+        ftl_state[ftl_head] = ftl_valid[ftl_head] ? FTL_USED : FTL_DIRTY;
+        ftl_head = W25QXX_FTL_UNITS;
+    }
+    return 0;
+}
+
+// scan the unit headers and rebuild the map. A sector live in two slots,
+// left behind by a power loss between the program and the retire, resolves to
+// the later one. A partly filled unit is never appended to again, its first
+// blank slot may hold an interrupted program.
+uint8_t W25QXX_FTL_Mount(QSPI_TypeDef* QSPIx)
+{
+    uint8_t hdr[FTL_HDR_LEN];
+    uint32_t u, s, tag, seq, sum = 0, known = 0;
+    uint16_t p, old;
+
+    //the region has to fit the part W25QXX_Init found
+    if(W25QXX_FTL_BASE + (uint32_t)W25QXX_FTL_UNITS * 4096 > W25QXX_Info.Size)return 1;
+    memset(ftl_map, 0xFF, sizeof(ftl_map));
+    ftl_head = W25QXX_FTL_UNITS;
+    ftl_fill = 0;
+    ftl_next_seq = 0;
+    ftl_in_gc = 0;
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        W25QXX_Read(QSPIx, hdr, ftl_unit_addr(u), FTL_HDR_LEN);
+        ftl_valid[u] = 0;
+        ftl_seq[u] = FTL_BLANK;
+        if(ftl_get32(hdr) != FTL_MAGIC)
+        {
+            //never used by the FTL or the erase was cut short
+            ftl_state[u] = FTL_RAW;
+            ftl_ec[u] = FTL_BLANK;
+            continue;
+        }
+        ftl_ec[u] = ftl_get32(hdr + FTL_OFF_EC);
+        sum += ftl_ec[u];
+        known++;
+        seq = ftl_get32(hdr + FTL_OFF_SEQ);
+        if(seq == FTL_BLANK)
+        {
+            ftl_state[u] = FTL_ERASED;
+            continue;
+        }
+        ftl_state[u] = FTL_USED;
+        ftl_seq[u] = seq;
+        if(seq >= ftl_next_seq)ftl_next_seq = seq + 1;
+        for(s = 0; s < W25QXX_FTL_SLOTS; s++)
+        {
+            tag = ftl_get32(hdr + FTL_OFF_TAG + 4 * s);
+            if(tag == FTL_BLANK || !(tag & FTL_TAG_LIVE))continue;
+            tag &= ~FTL_TAG_LIVE;
+            if(tag >= W25QXX_FTL_SECTORS)continue;
+            p = u * W25QXX_FTL_SLOTS + s;
+            old = ftl_map[tag];
+            if(old != FTL_NONE)
+            {
+                if(ftl_seq[old / W25QXX_FTL_SLOTS] > seq)continue;
+                ftl_valid[old / W25QXX_FTL_SLOTS]--;
+            }
+            ftl_map[tag] = p;
+            ftl_valid[u]++;
+        }
+    }
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        if(ftl_ec[u] == FTL_BLANK)ftl_ec[u] = known ? sum / known : 0;
+    }
+    for(u = 0; u < W25QXX_FTL_UNITS; u++)
+    {
+        if(ftl_state[u] == FTL_USED && ftl_valid[u] == 0)ftl_state[u] = FTL_DIRTY;
+    }
+    ftl_mounted = 1;
+    ftl_update_stat();
+    return 0;
+}
+
+uint8_t W25QXX_FTL_Read(QSPI_TypeDef* QSPIx, uint8_t* pBuffer, uint32_t Sector, uint32_t Count)
+{
+    uint32_t n;
+    uint16_t p;
+    if(!ftl_mounted || Sector >= W25QXX_FTL_SECTORS || Count > W25QXX_FTL_SECTORS - Sector)return 1;
+    while(Count)
+    {
+        p = ftl_map[Sector];
+        n = 1;
+        if(p == FTL_NONE)
+        {
+            memset(pBuffer, 0xFF, 512);
+        }else
+        {
+            //sectors written in a row sit in neighbouring slots, read them in one go
+            while(n < Count && p % W25QXX_FTL_SLOTS + n < W25QXX_FTL_SLOTS && ftl_map[Sector + n] == p + n)n++;
+            W25QXX_Read(QSPIx, pBuffer, ftl_slot_addr(p), n * 512);
+        }
+        pBuffer += n * 512;
+        Sector += n;
+        Count -= n;
+    }
+    return 0;
+}
+
+uint8_t W25QXX_FTL_Write(QSPI_TypeDef* QSPIx, const uint8_t* pBuffer, uint32_t Sector, uint32_t Count)
+{
+    if(!ftl_mounted || Sector >= W25QXX_FTL_SECTORS || Count > W25QXX_FTL_SECTORS - Sector)return 1;
+    for(; Count > 0; Count--)
+    {
+        if(ftl_append(QSPIx, pBuffer, Sector))return 1;
+        Sector++;
+        pBuffer += 512;
+    }
+    ftl_update_stat();
+    return 0;
+}
+
+// the retired slots stay retired across a remount, the sectors read back blank
+uint8_t W25QXX_FTL_Trim(QSPI_TypeDef* QSPIx, uint32_t Start, uint32_t End)
+{
+    uint16_t p;
+    if(!ftl_mounted || Start > End || End >= W25QXX_FTL_SECTORS)return 1;
+    for(; Start <= End; Start++)
+    {
+        p = ftl_map[Start];
+        if(p == FTL_NONE)continue;
+        ftl_map[Start] = FTL_NONE;
+        ftl_kill(QSPIx, p, Start);
+    }
+    ftl_update_stat();
+    return 0;
+}
+
+// call from the idle loop until it returns 0. Each call erases a 64KB block
+// of dirty units, one dirty unit or, when fewer than W25QXX_FTL_IDLE_FREE units
+// are erased, reclaims a mostly stale one, so later writes find erased units
+// and skip the erase. Writes that run out of erased units still erase 4KB at a
+// time, the block erase takes several times longer.
+uint8_t W25QXX_FTL_Idle(QSPI_TypeDef* QSPIx)
+{
+    uint32_t unit;
+    uint8_t res = 0;
+    if(!ftl_mounted)return 0;
+    unit = ftl_dirty_block();
+    if(unit != W25QXX_FTL_UNITS)
+    {
+        ftl_erase_block(QSPIx, unit);
+        res = 1;
+    }else if((unit = ftl_coldest(FTL_RECLAIM)) != W25QXX_FTL_UNITS)
+    {
+        ftl_erase(QSPIx, unit);
+        res = 1;
+    }else if(ftl_count(FTL_ERASED) < W25QXX_FTL_IDLE_FREE)
+    {
+        unit = ftl_victim();
+        if(unit != W25QXX_FTL_UNITS && ftl_valid[unit] <= W25QXX_FTL_SLOTS / 2)
+        {
+            ftl_in_gc = 1;
+            res = ftl_gc(QSPIx, unit) == 0;
+            ftl_in_gc = 0;
+        }
+    }
+    ftl_update_stat();
+    return res;
+}
@@ -10,10 +10,97 @@
 #include "diskio.h" /* FatFs lower layer API */
 #include "malloc.h"
 #include "nuclei_sdk_hal.h"
+#include <string.h>
 
 #define SDMMC_CARD 0
 extern SDMMC_CardInfo SDCardInfo;
 
+/*
+ * Single sector writes (FAT, directory and small file updates) are held back
+ * here and sent to an eMMC as one packed write, so the card leaves programming
+ * once per batch instead of once per sector. FatFs has no vectored write call,
+ * the batching has to happen below disk_write.
+ */
+#define DISK_PACK_SLOTS 8
+
+__attribute__ ((aligned (4))) static BYTE DiskPackPool[DISK_PACK_SLOTS][512];
+static DWORD DiskPackSector[DISK_PACK_SLOTS];
+static UINT DiskPackNum;
+
+static int disk_pack_find(DWORD sector)
+{
+    UINT i;
+
+    for (i = 0; i < DiskPackNum; i++) {
+        if (DiskPackSector[i] == sector)
+            return i;
+    }
+    return -1;
+}
+
+static uint8_t disk_pack_flush(void)
+{
+    SDMMC_PackedEntryTypeDef entry[DISK_PACK_SLOTS];
+    uint8_t res = 0;
+    UINT i, num = 0;
+
+    if (DiskPackNum == 0)
+        return 0;
+    /* neighbouring slots holding consecutive sectors go out as one entry */
+    for (i = 0; i < DiskPackNum; i++) {
+        if (num && DiskPackSector[i] == entry[num - 1].sector + entry[num - 1].count) {
+            entry[num - 1].count++;
+            continue;
+        }
+        entry[num].buf = DiskPackPool[i];
+        entry[num].sector = DiskPackSector[i];
+        entry[num].count = 1;
+        num++;
+    }
+    if (num == 1 || SDMMC_WritePacked(SDIO0, entry, num) != SDMMC_OK) {
+        for (i = 0; i < num && res == 0; i++) {
+            res = SDMMC_WriteDiskRetry(SDIO0, entry[i].buf, entry[i].sector, entry[i].count);
+        }
+    }
+    if (res == 0)
+        DiskPackNum = 0;
+    return res;
+}
+
+static uint8_t disk_pack_write(const BYTE *buff, DWORD sector)
+{
+    UINT max = SDMMC_PackedWriteMax();
+    int slot = disk_pack_find(sector);
+
+    if (slot < 0) {
+        if (max > DISK_PACK_SLOTS)
+            max = DISK_PACK_SLOTS;
+        if (DiskPackNum >= max && disk_pack_flush())
+            return 1;
+        slot = DiskPackNum++;
+        DiskPackSector[slot] = sector;
+    }
+    memcpy(DiskPackPool[slot], buff, 512);
+    return 0;
+}
+
+/* a direct write supersedes whatever is queued for the same sectors */
+static void disk_pack_drop(DWORD sector, UINT count)
+{
+    UINT i, n = 0;
+
+    for (i = 0; i < DiskPackNum; i++) {
+        if (DiskPackSector[i] >= sector && DiskPackSector[i] - sector < count)
+            continue;
+        if (n != i) {
+            DiskPackSector[n] = DiskPackSector[i];
+            memcpy(DiskPackPool[n], DiskPackPool[i], 512);
+        }
+        n++;
+    }
+    DiskPackNum = n;
+}
+
 DSTATUS disk_initialize(BYTE pdrv /* Physical drive nmuber (0..) */
 )
 {
@@ -40,14 +127,18 @@ DRESULT disk_read(BYTE pdrv,    /* Physical drive nmuber (0..) */
 )
 {
     uint8_t res = 0;
+    UINT i;
+    int slot;
     if (!count)
         return RES_PARERR;
     switch (pdrv) {
         case SDMMC_CARD:
-            res = SDMMC_ReadDisk(SDIO0, buff, sector, count);
-            while (res) {
-                SDMMC_Init(SDIO0);
-                res = SDMMC_ReadDisk(SDIO0, buff, sector, count);
+            res = SDMMC_ReadDiskRetry(SDIO0, buff, sector, count);
+            /* queued writes are newer than the medium */
+            for (i = 0; i < count && DiskPackNum; i++) {
+                slot = disk_pack_find(sector + i);
+                if (slot >= 0)
+                    memcpy(buff + i * 512, DiskPackPool[slot], 512);
             }
             break;
         default:
@@ -71,11 +162,12 @@ DRESULT disk_write(BYTE pdrv,        /* Physical drive nmuber (0..) */
         return RES_PARERR;
     switch (pdrv) {
         case SDMMC_CARD:
-            res = SDMMC_WriteDisk(SDIO0, (uint8_t *)buff, sector, count);
-            while (res) {
-                SDMMC_Init(SDIO0);
-                res = SDMMC_WriteDisk(SDIO0, (uint8_t *)buff, sector, count);
+            if (count == 1 && SDMMC_PackedWriteMax() > 1) {
+                res = disk_pack_write(buff, sector);
+                break;
             }
+            disk_pack_drop(sector, count);
+            res = SDMMC_WriteDiskRetry(SDIO0, (uint8_t *)buff, sector, count);
             break;
         default:
             res = 1;
@@ -98,7 +190,16 @@ DRESULT disk_ioctl(BYTE pdrv, /* Physical drive nmuber (0..) */
     if (pdrv == SDMMC_CARD) {
         switch (cmd) {
             case CTRL_SYNC:
-                res = RES_OK;
+                /* data may still sit in the write queue or the eMMC cache */
+                if (disk_pack_flush())
+                    res = RES_ERROR;
+                else
+                    res = (SDMMC_FlushCache(SDIO0) == SDMMC_OK) ? RES_OK : RES_ERROR;
+                break;
+            case CTRL_TRIM:
+                /* queued writes to freed sectors are dead, do not send them */
+                disk_pack_drop(((LBA_t *)buff)[0], ((LBA_t *)buff)[1] - ((LBA_t *)buff)[0] + 1);
+                res = (SDMMC_Erase(SDIO0, ((LBA_t *)buff)[0], ((LBA_t *)buff)[1]) == SDMMC_OK) ? RES_OK : RES_ERROR;
                 break;
             case GET_SECTOR_SIZE:
                 *(DWORD *)buff = 512;
@@ -48,6 +48,10 @@ enable this option. */
 #define FF_USE_FORWARD 0
 /* This option switches f_forward() function. (0:Disable or 1:Enable) */
 
+#define FF_USE_MMAP 0
+/* This option switches f_mmap() function, which needs a disk_ioctl() that
+/  handles CTRL_MMAP. (0:Disable or 1:Enable) */
+
 #define FF_USE_STRFUNC 0
 #define FF_PRINT_LLI 0
 #define FF_PRINT_FLOAT 0
@@ -198,7 +202,7 @@ function needs to implement /  GET_SECTOR_SIZE command. */
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 ==
 0. */
 
-#define FF_USE_TRIM 0
+#define FF_USE_TRIM 1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -76,6 +76,9 @@ void copyfile(uint8_t *srcfilename, uint8_t *destfilename)
     f_close(&file_src);
     f_close(&file_dest);
     printf("\r\ncopyfile finish\r\n");
+    printf("retries %u, reinits %u, step downs %u, failures %u, max attempts %u\r\n",
+           SDMMC_Retry.Retries, SDMMC_Retry.Reinits, SDMMC_Retry.StepDowns,
+           SDMMC_Retry.Failures, SDMMC_Retry.MaxAttempts);
 }
 
 void sdio_config(void)
@@ -85,6 +88,8 @@ void sdio_config(void)
     SDIO_StopClkEn(SDIO0, ENABLE);
     SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_EN, ENABLE);
     SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_EN, ENABLE);
+    /* DMA and end of transfer wake the core from WFI instead of being polled */
+    SDMMC_IrqInit(SDIO0);
 }
 
 int main(void)
@@ -102,11 +107,11 @@ int main(void)
     
     sdio_config();
 
-    /* default:dma 8 line mode */
+    /* default:dma, up to 8 lines, DDR52 allowed if the device reports it */
     CardType = SDIO_MULTIMEDIA_CARD;
     DeviceMode = SD_DMA_MODE;
     BusWidth = SDIO_DATA_SETUP_MODE_OCTOL;
-    BusMode = SDIO_SDR_MODE;
+    BusMode = SDIO_DDR_MODE;
 
     int i, j;
     FIL file;
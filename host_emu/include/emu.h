@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*!
+ * @file     emu.h
+ * @brief    Host emulation of the QSPI1/SDIO0 register interface and a
+ *           behavioural SD/MMC card model backed by an image file
+ */
+
+#ifndef _EMU_H
+#define _EMU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef enum {
+    EMU_CARD_SDHC = 0,      /*!< SD v2 high capacity, block addressed */
+    EMU_CARD_SDSC,          /*!< SD v2 standard capacity, byte addressed */
+    EMU_CARD_MMC,           /*!< eMMC up to 2GB, byte addressed */
+    EMU_CARD_NOR,           /*!< W25Q serial NOR flash up to 32MB behind QSPI1 */
+} EMU_CardType;
+
+typedef struct {
+    EMU_CardType type;
+    const char *image;          /*!< backing file, created when missing */
+    uint64_t capacity;          /*!< card size in bytes */
+    uint32_t init_polls;        /*!< ACMD41/CMD1 polls before power up completes */
+    uint32_t rd_access_us;      /*!< CMD17/CMD18 access time before the first block */
+    uint32_t rd_block_us;       /*!< gap between two blocks of a CMD18 */
+    uint32_t wr_single_us;      /*!< programming busy after a CMD24 block */
+    uint32_t wr_block_us;       /*!< programming busy between CMD25 blocks */
+    uint32_t wr_stop_us;        /*!< busy after the last CMD25 block */
+    uint32_t erase_us;          /*!< busy after CMD38 */
+    uint32_t cache_kb;          /*!< eMMC volatile cache size, 0 for none */
+    uint32_t spi_max_hz;        /*!< SPI clock above which blocks get corrupted, 0 for no limit */
+    uint32_t byte_cycles;       /*!< core cycles the driver spends per SPI byte */
+    uint8_t  strict;            /*!< refuse commands that are illegal in the current state */
+    uint32_t fault_every;       /*!< corrupt every n-th SD bus data transfer of the image, 0 for none */
+    uint32_t drop_every;        /*!< lose the DMA completion of every n-th SD bus data transfer of the image */
+} EMU_Config;
+
+typedef struct {
+    uint64_t cmd[64];           /*!< commands per index, CMDn and ACMDn share a slot */
+    uint64_t acmd;              /*!< application commands */
+    uint64_t rd_blocks;
+    uint64_t wr_blocks;
+    uint64_t erase_blocks;
+    uint64_t spi_bytes;
+    uint64_t bus_ns;            /*!< time spent clocking the bus */
+    uint64_t busy_ns;           /*!< time the host waited on card busy */
+    uint64_t delay_ns;          /*!< time spent in delay_1ms */
+    uint64_t crc_errors;        /*!< blocks corrupted by clock or bus width violations */
+    uint64_t implicit;          /*!< protocol violations forgiven in lenient mode */
+    uint64_t packed;            /*!< eMMC packed write groups */
+    uint64_t irqs;              /*!< interrupt handler calls */
+    uint64_t wfi;               /*!< WFI executed by the drivers */
+    uint64_t m2m_bytes;         /*!< bytes copied by M2M UDMA channels */
+    uint64_t dma_dropped;       /*!< SDIO DMA completions lost on purpose (-G) */
+    uint64_t nor_programs;      /*!< NOR page program commands */
+    uint64_t nor_prog_bytes;    /*!< bytes they carried */
+    uint64_t nor_erase_4k;      /*!< NOR 4KB sector erases */
+    uint64_t nor_erase_64k;     /*!< NOR 64KB block erases */
+    uint64_t nor_xip;           /*!< switches into flash (XIP) mode */
+    uint64_t nor_suspends;      /*!< NOR program/erase suspends */
+} EMU_Stats;
+
+/* SD/MMC card state shared by the SPI and SD bus front ends */
+typedef struct {
+    uint8_t *mem;
+    uint8_t *xip;               /*!< NOR: second view of the image at QSPI_FLASH_BASE */
+    uint64_t size;
+    uint8_t cid[16];
+    uint8_t csd[16];
+    uint8_t scr[8];
+    uint8_t ext_csd[512];
+    uint32_t ocr;
+    uint16_t rca;
+    uint8_t state;              /*!< EMU_ST_xxx */
+    uint8_t app;                /*!< previous command was CMD55 */
+    uint8_t width;              /*!< data lines 1/4/8 */
+    uint8_t hs;                 /*!< high speed timing selected */
+    uint32_t polls;
+    uint32_t blocklen;
+    uint32_t preset;            /*!< CMD23 block count, 0 for open ended */
+    uint8_t packed;             /*!< CMD23 announced an eMMC packed write group */
+    uint32_t erase_start;
+    uint32_t erase_end;
+    uint32_t dirty;             /*!< blocks held in the eMMC cache */
+    uint64_t busy_until;        /*!< end of the current programming/erase busy */
+} EMU_Card;
+
+/* card states as reported in the R1 CURRENT_STATE field */
+#define EMU_ST_IDLE     0
+#define EMU_ST_READY    1
+#define EMU_ST_IDENT    2
+#define EMU_ST_STBY     3
+#define EMU_ST_TRAN     4
+#define EMU_ST_DATA     5
+#define EMU_ST_RCV      6
+#define EMU_ST_PRG      7
+
+/* eMMC EXT_CSD byte offsets used by the model */
+#define EMU_EXT_CSD_FLUSH_CACHE     32
+#define EMU_EXT_CSD_CACHE_CTRL      33
+#define EMU_EXT_CSD_BUS_WIDTH       183
+#define EMU_EXT_CSD_HS_TIMING       185
+#define EMU_EXT_CSD_REV             192
+#define EMU_EXT_CSD_CARD_TYPE       196
+#define EMU_EXT_CSD_SEC_CNT         212
+#define EMU_EXT_CSD_CACHE_SIZE      249
+#define EMU_EXT_CSD_MAX_PACKED_WR   500
+
+extern EMU_Config emu_cfg;
+extern EMU_Stats emu_stats;
+extern EMU_Card emu_card;
+extern volatile uint64_t emu_now_ns;
+
+/* emu_soc.c */
+int emu_init(void);
+void emu_exit(void);
+void emu_advance(uint64_t ns);
+void *emu_ptr(uint32_t addr);
+uint64_t emu_bits_ns(uint64_t bits, uint32_t hz);
+
+/* emu_card.c */
+int emu_card_open(void);
+void emu_card_close(void);
+void emu_card_reset(void);
+uint8_t emu_card_busy(void);
+void emu_card_program(uint32_t us);
+void emu_card_wait(void);
+int emu_card_offset(uint32_t arg, uint32_t len, uint64_t *off);
+void emu_card_read(uint64_t off, uint8_t *dst, uint32_t len);
+void emu_card_write(uint64_t off, const uint8_t *src, uint32_t len);
+void emu_card_erase(void);
+uint32_t emu_card_max_hz(void);
+uint16_t emu_crc16(const uint8_t *buf, uint32_t len);
+uint8_t emu_crc7(const uint8_t *buf, uint32_t len);
+
+/* emu_flash.c */
+void emu_flash_reset(void);
+uint8_t emu_flash_xfer(uint8_t mosi);
+uint32_t emu_flash_wear(uint32_t *sectors);
+
+/* emu_spi.c / emu_sdio.c */
+void emu_spi_reset(void);
+void emu_spi_drain(void);
+uint64_t emu_spi_clocks_ns(uint64_t clocks);
+void emu_sdio_reset(void);
+uint8_t emu_sdio_dma_step(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EMU_H */
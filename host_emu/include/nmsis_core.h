@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*!
+ * @file     nmsis_core.h
+ * @brief    Host stand-in for the NMSIS core header, only what the SoC
+ *           drivers need to build with the native compiler
+ */
+
+#ifndef _HOST_NMSIS_CORE_H
+#define _HOST_NMSIS_CORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define __IM        volatile const
+#define __OM        volatile
+#define __IOM       volatile
+#define __I         volatile const
+#define __O         volatile
+#define __IO        volatile
+
+#define __STATIC_INLINE             static inline
+#define __STATIC_FORCEINLINE        static inline __attribute__((always_inline))
+#define __WEAK                      __attribute__((weak))
+#define __RWMB()                    __sync_synchronize()
+
+typedef enum ECLIC_TRIGGER {
+    ECLIC_LEVEL_TRIGGER = 0x0,
+    ECLIC_POSTIVE_EDGE_TRIGGER = 0x1,
+    ECLIC_NEGTIVE_EDGE_TRIGGER = 0x3,
+    ECLIC_MAX_TRIGGER = 0x3
+} ECLIC_TRIGGER_Type;
+
+#define ECLIC_NON_VECTOR_INTERRUPT  0x0
+#define ECLIC_VECTOR_INTERRUPT      0x1
+
+/* Board helpers the drivers call without including the board header,
+ * provided by host_emu/source/emu_soc.c */
+extern void delay_1ms(uint32_t count);
+
+/* Global interrupt enable and WFI, interrupts are delivered from these */
+extern void emu_irq_enable(void);
+extern void emu_irq_disable(void);
+extern void emu_wfi(void);
+#define __enable_irq()              emu_irq_enable()
+#define __disable_irq()             emu_irq_disable()
+#define __WFI()                     emu_wfi()
+
+/* No cache on the host side, the maintenance calls do nothing */
+#define MInvalDCacheLines(addr, cnt)    ((void)(addr), (void)(cnt))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HOST_NMSIS_CORE_H */
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*!
+ * @file     ns_sdk_hal.h
+ * @brief    Host stand-in for the SDK HAL umbrella header
+ */
+
+#ifndef _HOST_NS_SDK_HAL_H
+#define _HOST_NS_SDK_HAL_H
+
+#include "ns.h"
+#include "ns_qspi.h"
+#include "ns_sdio.h"
+#include "ns_sdmmc.h"
+
+#endif /* _HOST_NS_SDK_HAL_H */
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*!
+ * @file     nuclei_sdk_hal.h
+ * @brief    Host stand-in for the Nuclei SDK HAL header
+ */
+
+#ifndef _HOST_NUCLEI_SDK_HAL_H
+#define _HOST_NUCLEI_SDK_HAL_H
+
+#include "ns_sdk_hal.h"
+
+#endif /* _HOST_NUCLEI_SDK_HAL_H */
@@ -0,0 +1,538 @@
+/*--------------------------- Include ---------------------------*/
+#include "nuclei_sdk_hal.h"
+#include "ns_qspi_sdcard.h"
+#include "w25qxx_ftl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emu.h"
+
+/*-------------------------- Variable ---------------------------*/
+extern uint8_t CardType;
+extern uint32_t DeviceMode;
+extern uint32_t BusWidth;
+extern uint32_t BusMode;
+
+#define BENCH_MAX_BLOCKS    255
+
+typedef enum {
+    BENCH_SPI = 0,
+    BENCH_SD,
+    BENCH_MMC,
+    BENCH_NOR,
+} BENCH_Mode;
+
+__attribute__ ((aligned (4))) static uint8_t wpool[BENCH_MAX_BLOCKS * 512 + 4];
+__attribute__ ((aligned (4))) static uint8_t rpool[BENCH_MAX_BLOCKS * 512 + 4];
+static uint8_t *wbuf = wpool;
+static uint8_t *rbuf = rpool;
+__attribute__ ((aligned (4))) static uint8_t ring[2 * BENCH_MAX_BLOCKS * 512];
+
+static BENCH_Mode mode = BENCH_SD;
+static uint8_t packed;
+static uint8_t trim;
+static uint8_t irq;
+static uint8_t stream;
+static uint8_t reinit;
+static uint8_t direct;             /* 1 W25QXX_Write, 2 write-back sector cache */
+static uint8_t single;             /* nor: keep the single line fast read */
+static uint8_t xip;                /* nor: read through the memory mapped window */
+static uint32_t laps = 1;
+static uint32_t lap;
+static uint32_t per = 8;
+static uint32_t stream_bad;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\r\n", prog);
+    printf("  -m spi|sd|mmc|nor  bus and card, nor is a W25Q flash, default sd\r\n");
+    printf("  -i file         card image, default card.img\r\n");
+    printf("  -s MB           card size, default 64\r\n");
+    printf("  -c Hz           core clock, default 50000000\r\n");
+    printf("  -n sectors      sectors written and read back, default 2048\r\n");
+    printf("  -b blocks       sectors per request, 1..255, default 8\r\n");
+    printf("  -a us           read access time\r\n");
+    printf("  -w us           single block programming time\r\n");
+    printf("  -W us           multi block programming time per block\r\n");
+    printf("  -e us           busy after the last block of a multi block write\r\n");
+    printf("  -k KB           eMMC cache size\r\n");
+    printf("  -f Hz           SPI clock limit of the card\r\n");
+    printf("  -P              eMMC packed writes, one entry per sector in reverse order\r\n");
+    printf("  -T              erase the written range afterwards and check it reads blank\r\n");
+    printf("  -I              SDIO transfers complete through interrupts and WFI\r\n");
+    printf("  -U              pass buffers that are not word aligned\r\n");
+    printf("  -X              stream the whole range through a two half ring, half = -b sectors\r\n");
+    printf("  -F n            corrupt every n-th SD bus data transfer or SPI data block with a CRC error\r\n");
+    printf("  -G n            lose the DMA completion of every n-th SD bus data transfer, the data and EOT still arrive\r\n");
+    printf("  -R              initialise the card a second time, from its profile,\r\n");
+    printf("                  nor: remount the flash translation layer before reading\r\n");
+    printf("  -L n            write the range n times, default 1\r\n");
+    printf("  -D              nor: write through W25QXX_Write instead of the translation layer\r\n");
+    printf("  -C              nor: write through the 4KB write-back sector cache instead\r\n");
+    printf("  -M              nor: read through the memory mapped flash window (XIP)\r\n");
+    printf("  -Q              nor: read with the single line fast read instead of the mode picked at init\r\n");
+    printf("  -S              strict protocol checking\r\n");
+}
+
+static uint8_t bench_init(void)
+{
+    if (mode == BENCH_SPI) {
+        return SD_init(QSPI1);
+    }
+    if (mode == BENCH_NOR) {
+        W25QXX_Init(QSPI1);
+        if (single) {
+            W25QXX_READ_CMD = W25X_FastReadData;
+        }
+        if (xip) {
+            W25QXX_XIP_Init(QSPI1, QSPI_FLASH_BASE);
+        }
+        return direct ? 0 : W25QXX_FTL_Mount(QSPI1);
+    }
+    CardType = (mode == BENCH_MMC) ? SDIO_MULTIMEDIA_CARD : SDIO_STD_CAPACITY_SD_CARD_V1_1;
+    DeviceMode = SD_DMA_MODE;
+    BusWidth = (mode == BENCH_MMC) ? SDIO_DATA_SETUP_MODE_OCTOL : SDIO_DATA_SETUP_MODE_QUAD;
+    BusMode = (mode == BENCH_MMC) ? SDIO_DDR_MODE : SDIO_SDR_MODE;
+
+    SDIO_SetDateTimeout(SDIO0, 0xFFFFFFFF);
+    SDIO_Clock_Set(SDIO0, 0x31);
+    SDIO_StopClkEn(SDIO0, ENABLE);
+    SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_EN, ENABLE);
+    SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_EN, ENABLE);
+    if (irq && SDMMC_IrqInit(SDIO0) != SDMMC_OK) {
+        return 0xFF;
+    }
+    return SDMMC_Init(SDIO0);
+}
+
+static uint8_t bench_write(uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    SDMMC_PackedEntryTypeDef entry[SDMMC_PACKED_MAX_ENTRIES];
+    uint32_t i;
+
+    if (packed && cnt <= SDMMC_PackedWriteMax()) {
+        for (i = 0; i < cnt; i++) {
+            entry[i].buf = buf + (cnt - 1 - i) * 512;
+            entry[i].sector = sector + cnt - 1 - i;
+            entry[i].count = 1;
+        }
+        return SDMMC_WritePacked(SDIO0, entry, cnt);
+    }
+    if (mode == BENCH_SPI) {
+        return SD_WriteDiskRetry(QSPI1, buf, sector, cnt);
+    }
+    if (mode == BENCH_NOR && direct == 2) {
+        W25QXX_Cache_Write(QSPI1, buf, sector * 512, cnt * 512);
+        return 0;
+    }
+    if (mode == BENCH_NOR && direct) {
+        /* what spi_flash_fs did before, one read-erase-write per sector */
+        for (i = 0; i < cnt; i++) {
+            W25QXX_Write(QSPI1, buf + i * 512, (sector + i) * 512, 512);
+        }
+        return 0;
+    }
+    if (mode == BENCH_NOR) {
+        return W25QXX_FTL_Write(QSPI1, buf, sector, cnt);
+    }
+    return SDMMC_WriteDiskRetry(SDIO0, buf, sector, cnt);
+}
+
+static uint8_t bench_read(uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+    if (mode == BENCH_SPI) {
+        return SD_ReadDiskRetry(QSPI1, buf, sector, cnt);
+    }
+    if (mode == BENCH_NOR && direct) {
+        W25QXX_Cache_Read(QSPI1, buf, sector * 512, cnt * 512);
+        return 0;
+    }
+    if (mode == BENCH_NOR) {
+        return W25QXX_FTL_Read(QSPI1, buf, sector, cnt);
+    }
+    return SDMMC_ReadDiskRetry(SDIO0, buf, sector, cnt);
+}
+
+static uint8_t bench_sync(void)
+{
+    if (mode == BENCH_NOR && direct == 2) {
+        W25QXX_Cache_Flush(QSPI1);
+        return 0;
+    }
+    if (mode == BENCH_SPI || mode == BENCH_NOR) {
+        return 0;
+    }
+    return SDMMC_FlushCache(SDIO0);
+}
+
+static uint8_t bench_erase(uint32_t start, uint32_t end)
+{
+    if (mode == BENCH_SPI) {
+        return SD_Erase(QSPI1, start, end) || SD_Sync(QSPI1);
+    }
+    uint64_t t0 = emu_now_ns, t1, worst = 0;
+    uint8_t probe[512];
+    uint32_t reads = 0;
+
+    if (mode == BENCH_NOR && direct) {
+        /* queue the freed sectors, then let the idle work erase them while
+         * a sector at the end of the flash is read every millisecond */
+        W25QXX_Erase_Defer(QSPI1, start * 512, (end - start + 1) * 512);
+        printf("trim   queued in %.3f ms\r\n", (emu_now_ns - t0) / 1e6);
+        while (W25QXX_Erase_Idle(QSPI1)) {
+            delay_1ms(1);
+            t1 = emu_now_ns;
+            W25QXX_Read(QSPI1, probe, W25QXX_Info.Size - 4096, sizeof(probe));
+            worst = (emu_now_ns - t1 > worst) ? emu_now_ns - t1 : worst;
+            reads++;
+        }
+        W25QXX_Wait_Busy(QSPI1);
+        printf("reads  %u during the erase, worst %.3f ms\r\n", reads, worst / 1e6);
+        return 0;
+    }
+    if (mode == BENCH_NOR) {
+        /* trim, then let the idle work erase what it freed */
+        if (W25QXX_FTL_Trim(QSPI1, start, end) != 0) {
+            return 1;
+        }
+        printf("trim   queued in %.3f ms\r\n", (emu_now_ns - t0) / 1e6);
+        while (W25QXX_FTL_Idle(QSPI1));
+        return 0;
+    }
+    return SDMMC_Erase(SDIO0, start, end);
+}
+
+static void bench_fill(uint8_t *buf, uint32_t sector, uint32_t cnt)
+{
+    uint32_t i;
+
+    for (i = 0; i < cnt * 512; i++) {
+        buf[i] = (uint8_t)((sector + i / 512) * 7 + i + lap * 13);
+    }
+}
+
+static void bench_stream_fill(uint8_t *buf, uint32_t index, void *arg)
+{
+    bench_fill(buf, *(uint32_t *)arg + index * per, per);
+}
+
+static void bench_stream_check(uint8_t *buf, uint32_t index, void *arg)
+{
+    bench_fill(wbuf, *(uint32_t *)arg + index * per, per);
+    if (memcmp(buf, wbuf, per * 512) != 0) {
+        stream_bad++;
+    }
+}
+
+static void bench_report(const char *name, uint64_t bytes, uint64_t ns)
+{
+    printf("%-6s %8llu KB in %10.3f ms, %8.3f MB/s\r\n", name, (unsigned long long)(bytes >> 10),
+           ns / 1e6, ns ? (bytes / 1048576.0) / (ns / 1e9) : 0.0);
+}
+
+static void bench_stats(void)
+{
+    uint32_t i, n;
+
+    printf("\r\nbus %.3f ms, card busy %.3f ms, delay_1ms %.3f ms\r\n",
+           emu_stats.bus_ns / 1e6, emu_stats.busy_ns / 1e6, emu_stats.delay_ns / 1e6);
+    printf("blocks read %llu, written %llu, erased %llu, spi bytes %llu\r\n",
+           (unsigned long long)emu_stats.rd_blocks, (unsigned long long)emu_stats.wr_blocks,
+           (unsigned long long)emu_stats.erase_blocks, (unsigned long long)emu_stats.spi_bytes);
+    printf("crc errors %llu, forgiven protocol violations %llu, app commands %llu, packed groups %llu\r\n",
+           (unsigned long long)emu_stats.crc_errors, (unsigned long long)emu_stats.implicit,
+           (unsigned long long)emu_stats.acmd, (unsigned long long)emu_stats.packed);
+    printf("interrupts %llu, wfi %llu, m2m bytes %llu, lost dma completions %llu\r\n",
+           (unsigned long long)emu_stats.irqs, (unsigned long long)emu_stats.wfi,
+           (unsigned long long)emu_stats.m2m_bytes, (unsigned long long)emu_stats.dma_dropped);
+    if (mode == BENCH_NOR) {
+        i = emu_flash_wear(&n);
+        printf("page programs %llu, %llu bytes, 4KB erases %llu, 64KB erases %llu, max erases of a sector %u, %u sectors erased, read command 0x%02X, xip entries %llu, suspends %llu\r\n",
+               (unsigned long long)emu_stats.nor_programs, (unsigned long long)emu_stats.nor_prog_bytes,
+               (unsigned long long)emu_stats.nor_erase_4k, (unsigned long long)emu_stats.nor_erase_64k, i, n, W25QXX_READ_CMD, (unsigned long long)emu_stats.nor_xip,
+               (unsigned long long)emu_stats.nor_suspends);
+        printf("flash %lu KB%s, %u byte pages, %u address bytes, erase 0x%02X/0x%02X, reads 0x%X\r\n",
+               (unsigned long)(W25QXX_Info.Size / 1024), W25QXX_Info.Sfdp ? " from SFDP" : "", W25QXX_Info.PageSize,
+               W25QXX_Info.AddrBytes, W25QXX_Info.Erase4K, W25QXX_Info.Erase64K, W25QXX_Info.Reads);
+        if (!direct) {
+            printf("ftl gc %u, copies %u, wear moves %u, erases %u, free units %u, unit erases %u..%u\r\n",
+                   W25QXX_FTL_Stat.Gc, W25QXX_FTL_Stat.GcCopies, W25QXX_FTL_Stat.WlMoves, W25QXX_FTL_Stat.Erases,
+                   W25QXX_FTL_Stat.FreeUnits, W25QXX_FTL_Stat.MinErase, W25QXX_FTL_Stat.MaxErase);
+        }
+        return;
+    }
+    if (mode == BENCH_SPI) {
+        printf("spi step downs %u, step ups %u, clock %u Hz\r\n",
+               SD_SpeedStat.StepDowns, SD_SpeedStat.StepUps, SD_SpeedHz());
+    }
+    printf("retries %u, reinits %u, step downs %u, failures %u, max attempts %u, clock %u Hz\r\n",
+           SDMMC_Retry.Retries, SDMMC_Retry.Reinits, SDMMC_Retry.StepDowns, SDMMC_Retry.Failures,
+           SDMMC_Retry.MaxAttempts, SystemCoreClock / (2 * (SDMMC_BusCfg.ClkDiv + 1)));
+    if (mode != BENCH_SPI) {
+        printf("caps cmd23 %u, speed class %u, AU %u, erase group %u, cache %u KB, max clock %u Hz\r\n",
+               SDMMC_CardCaps.SetBlockCount, SDMMC_CardCaps.SpeedClass, SDMMC_CardCaps.AuSize,
+               SDMMC_CardCaps.EraseGroup, SDMMC_CardCaps.CacheSize, SDMMC_CardCaps.MaxClkHz);
+    }
+    printf("commands:");
+    for (i = 0; i < 64; i++) {
+        if (emu_stats.cmd[i]) {
+            printf(" CMD%u=%llu", i, (unsigned long long)emu_stats.cmd[i]);
+        }
+    }
+    printf("\r\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t total = 2048;
+    uint32_t s, n, i, bad = 0, failed = 0;
+    uint32_t first = 0;
+    uint64_t t0;
+    uint8_t sta;
+    uint8_t sized = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:i:s:c:n:b:a:w:W:e:k:f:F:G:L:PTIUXRDCMQSh")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "spi") == 0) {
+                mode = BENCH_SPI;
+            } else if (strcmp(optarg, "mmc") == 0) {
+                mode = BENCH_MMC;
+            } else if (strcmp(optarg, "nor") == 0) {
+                mode = BENCH_NOR;
+            } else {
+                mode = BENCH_SD;
+            }
+            break;
+        case 'i':
+            emu_cfg.image = optarg;
+            break;
+        case 's':
+            sized = 1;
+            emu_cfg.capacity = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'c':
+            SystemCoreClock = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            total = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            per = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            emu_cfg.rd_access_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            emu_cfg.wr_single_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            emu_cfg.wr_block_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            emu_cfg.wr_stop_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            emu_cfg.cache_kb = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            emu_cfg.spi_max_hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            packed = 1;
+            break;
+        case 'T':
+            trim = 1;
+            break;
+        case 'I':
+            irq = 1;
+            break;
+        case 'U':
+            wbuf = wpool + 1;
+            rbuf = rpool + 1;
+            break;
+        case 'X':
+            stream = 1;
+            break;
+        case 'R':
+            reinit = 1;
+            break;
+        case 'L':
+            laps = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            direct = 1;
+            break;
+        case 'C':
+            direct = 2;
+            break;
+        case 'Q':
+            single = 1;
+            break;
+        case 'M':
+            xip = 1;
+            break;
+        case 'F':
+            emu_cfg.fault_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'G':
+            emu_cfg.drop_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            emu_cfg.strict = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (per == 0 || per > BENCH_MAX_BLOCKS || laps == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mode == BENCH_MMC) {
+        emu_cfg.type = EMU_CARD_MMC;
+    }
+    if (mode == BENCH_NOR) {
+        emu_cfg.type = EMU_CARD_NOR;
+        if (!sized) {
+            emu_cfg.capacity = 16ULL << 20;
+        }
+    }
+    if (emu_init() != 0) {
+        return 1;
+    }
+    if ((uint64_t)total * 512 > emu_cfg.capacity) {
+        total = emu_cfg.capacity / 512;
+    }
+    if (mode == BENCH_NOR && !direct && total > W25QXX_FTL_SECTORS) {
+        total = W25QXX_FTL_SECTORS;
+    }
+    if (stream) {
+        /* whole laps of the ring, within one DATA_SETUP block count */
+        if (mode == BENCH_SPI || mode == BENCH_NOR || total < 2 * per) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (total > 65535) {
+            total = 65535;
+        }
+        total -= total % (2 * per);
+    }
+
+    t0 = emu_now_ns;
+    sta = bench_init();
+    if (sta != 0) {
+        printf("init failed: %d\r\n", sta);
+        bench_stats();
+        emu_exit();
+        return 1;
+    }
+    printf("init   %.3f ms, card %llu MB\r\n", (emu_now_ns - t0) / 1e6,
+           (unsigned long long)(emu_cfg.capacity >> 20));
+    if (reinit && mode != BENCH_SPI && mode != BENCH_NOR) {
+        t0 = emu_now_ns;
+        sta = bench_init();
+        printf("reinit %.3f ms, %s\r\n", (emu_now_ns - t0) / 1e6,
+               sta ? "failed" : (SDMMC_CardCaps.Cached ? "profile hit" : "probed"));
+        bad += sta ? 1 : 0;
+    }
+
+    t0 = emu_now_ns;
+    s = 0;
+    if (stream) {
+        sta = SDMMC_StreamWrite(SDIO0, first, ring, per, total, bench_stream_fill, &first);
+        if (sta != 0) {
+            printf("stream write failed: %d\r\n", sta);
+            bad++;
+        } else {
+            s = total;
+        }
+    }
+    /* a failed request counts as bad and the bench goes on, the rest of the range is still covered */
+    for (lap = 0; !stream && lap < laps; lap++) {
+        for (s = 0; s < total; s += n) {
+            n = (total - s < per) ? total - s : per;
+            bench_fill(wbuf, s, n);
+            sta = bench_write(wbuf, s, (uint8_t)n);
+            if (sta != 0 && failed++ == 0) {
+                printf("write failed at sector %u: %d\r\n", s, sta);
+            }
+        }
+    }
+    if (failed > 1) {
+        printf("%u writes failed\r\n", failed);
+    }
+    bad += failed;
+    failed = 0;
+    lap = laps - 1;
+    if ((sta = bench_sync()) != 0) {
+        printf("sync failed: %d\r\n", sta);
+        bad++;
+    }
+    bench_report("write", (uint64_t)s * 512 * (stream ? 1 : laps), emu_now_ns - t0);
+    if (reinit && mode == BENCH_NOR && !direct) {
+        t0 = emu_now_ns;
+        sta = W25QXX_FTL_Mount(QSPI1);
+        printf("remount %.3f ms, %s\r\n", (emu_now_ns - t0) / 1e6, sta ? "failed" : "map rebuilt");
+        bad += sta ? 1 : 0;
+    }
+
+    t0 = emu_now_ns;
+    s = 0;
+    if (stream) {
+        sta = SDMMC_StreamRead(SDIO0, first, ring, per, total, bench_stream_check, &first);
+        if (sta != 0) {
+            printf("stream read failed: %d\r\n", sta);
+            bad++;
+        } else {
+            s = total;
+        }
+        bad += stream_bad;
+    }
+    for (; !stream && s < total; s += n) {
+        n = (total - s < per) ? total - s : per;
+        sta = bench_read(rbuf, s, (uint8_t)n);
+        if (sta != 0) {
+            if (failed++ == 0) {
+                printf("read failed at sector %u: %d\r\n", s, sta);
+            }
+            continue;
+        }
+        bench_fill(wbuf, s, n);
+        if (memcmp(rbuf, wbuf, n * 512) != 0) {
+            bad++;
+        }
+    }
+    if (failed > 1) {
+        printf("%u reads failed\r\n", failed);
+    }
+    bad += failed;
+    bench_report("read", (uint64_t)s * 512, emu_now_ns - t0);
+    printf("verify %s, %u bad requests\r\n", bad ? "FAILED" : "ok", bad);
+
+    if (trim && total != 0) {
+        t0 = emu_now_ns;
+        sta = bench_erase(0, total - 1);
+        printf("erase  %8u sectors in %10.3f ms, status %d\r\n", total, (emu_now_ns - t0) / 1e6, sta);
+        for (s = 0; s < total && sta == 0; s += n) {
+            n = (total - s < per) ? total - s : per;
+            sta = bench_read(rbuf, s, (uint8_t)n);
+            for (i = 0; sta == 0 && i < n * 512; i++) {
+                if (rbuf[i] != (mode == BENCH_NOR ? 0xFF : 0)) {
+                    bad++;
+                    break;
+                }
+            }
+        }
+        printf("blank  %s\r\n", (sta || bad) ? "FAILED" : "ok");
+        bad += sta ? 1 : 0;
+    }
+
+    bench_stats();
+    emu_exit();
+    return bad ? 1 : 0;
+}
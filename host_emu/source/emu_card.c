@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+  * \file emu_card.c
+  * \brief SD/MMC card registers, image storage and busy timing of the host emulator
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ns.h"
+#include "emu.h"
+
+EMU_Config emu_cfg = {
+    .type = EMU_CARD_SDHC,
+    .image = "card.img",
+    .capacity = 64ULL << 20,
+    .init_polls = 3,
+    .rd_access_us = 100,
+    .rd_block_us = 10,
+    .wr_single_us = 250,
+    .wr_block_us = 40,
+    .wr_stop_us = 250,
+    .erase_us = 2000,
+    .cache_kb = 0,
+    .spi_max_hz = 0,
+    .byte_cycles = 16,
+    .strict = 0,
+};
+
+EMU_Card emu_card;
+static int emu_fd = -1;
+
+/**
+  * \brief  CRC7 of the command and register fields, polynomial x^7 + x^3 + 1.
+  */
+uint8_t emu_crc7(const uint8_t *buf, uint32_t len)
+{
+    uint8_t crc = 0;
+    uint8_t i;
+
+    while (len--) {
+        crc ^= *buf++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x12) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc >> 1;
+}
+
+/**
+  * \brief  CRC16-CCITT of a data block, polynomial x^16 + x^12 + x^5 + 1.
+  */
+uint16_t emu_crc16(const uint8_t *buf, uint32_t len)
+{
+    uint16_t crc = 0;
+    uint8_t i;
+
+    while (len--) {
+        crc ^= (uint16_t)(*buf++) << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static void emu_card_regs(void)
+{
+    EMU_Card *c = &emu_card;
+    uint32_t csize;
+    uint64_t sectors = c->size >> 9;
+
+    memset(c->cid, 0, sizeof(c->cid));
+    memset(c->csd, 0, sizeof(c->csd));
+    memset(c->scr, 0, sizeof(c->scr));
+    memset(c->ext_csd, 0, sizeof(c->ext_csd));
+
+    c->cid[0] = 0x03;                       /* MID */
+    memcpy(&c->cid[1], "EMHOST1", 7);       /* OID + PNM */
+    c->cid[8] = 0x10;                       /* PRV */
+    c->cid[9] = 0x12;                       /* PSN */
+    c->cid[10] = 0x34;
+    c->cid[11] = 0x56;
+    c->cid[12] = 0x78;
+    c->cid[13] = 0x01;                      /* MDT */
+    c->cid[14] = 0x5A;
+
+    if (emu_cfg.type == EMU_CARD_SDHC) {
+        csize = (uint32_t)(c->size >> 19) - 1;
+        c->csd[0] = 0x40;                   /* CSD v2 */
+        c->csd[1] = 0x0E;                   /* TAAC */
+        c->csd[3] = 0x32;                   /* TRAN_SPEED 25MHz */
+        c->csd[4] = 0x5B;                   /* CCC */
+        c->csd[5] = 0x59;                   /* READ_BL_LEN 512 */
+        c->csd[7] = (csize >> 16) & 0x3F;
+        c->csd[8] = (csize >> 8) & 0xFF;
+        c->csd[9] = csize & 0xFF;
+        c->csd[10] = 0x7F;
+        c->csd[11] = 0x80;
+        c->csd[12] = 0x0A;
+        c->csd[13] = 0x40;
+        c->ocr = 0x40FF8000;
+    } else {
+        /* C_SIZE_MULT 7, one C_SIZE unit is 256KB */
+        csize = (uint32_t)(c->size >> 18) - 1;
+        if (emu_cfg.type == EMU_CARD_MMC) {
+            c->csd[0] = 0x90;               /* CSD v1.2, SPEC_VERS 4 */
+            c->csd[1] = 0x27;
+            c->csd[2] = 0x01;
+            c->csd[3] = 0x32;               /* TRAN_SPEED 26MHz */
+            c->csd[4] = 0x8F;
+            c->ocr = 0x00FF8080;
+        } else {
+            c->csd[0] = 0x00;               /* CSD v1 */
+            c->csd[1] = 0x26;
+            c->csd[3] = 0x32;
+            c->csd[4] = 0x5B;
+            c->ocr = 0x00FF8000;
+        }
+        c->csd[5] = 0x59;
+        c->csd[6] = (csize >> 10) & 0x03;
+        c->csd[7] = (csize >> 2) & 0xFF;
+        c->csd[8] = (uint8_t)((csize & 0x03) << 6);
+        c->csd[9] = 0x03;                   /* C_SIZE_MULT[2:1] */
+        c->csd[10] = 0xFF;                  /* C_SIZE_MULT[0], erase fields */
+        c->csd[11] = 0x80;
+        c->csd[12] = 0x0A;
+        c->csd[13] = 0x40;
+    }
+
+    c->scr[0] = 0x02;                       /* SD_SPEC 2.00 */
+    c->scr[1] = 0x35;                       /* 1 and 4 bit bus */
+    c->scr[2] = 0x80;                       /* SD_SPEC3 */
+    c->scr[3] = 0x02;                       /* CMD23 supported */
+
+    c->ext_csd[EMU_EXT_CSD_REV] = 8;
+    c->ext_csd[194] = 2;                    /* CSD_STRUCTURE */
+    c->ext_csd[EMU_EXT_CSD_CARD_TYPE] = 0x07;   /* HS26, HS52, DDR52 */
+    c->ext_csd[EMU_EXT_CSD_SEC_CNT + 0] = sectors & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_SEC_CNT + 1] = (sectors >> 8) & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_SEC_CNT + 2] = (sectors >> 16) & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_SEC_CNT + 3] = (sectors >> 24) & 0xFF;
+    c->ext_csd[221] = 1;                    /* HC_WP_GRP_SIZE */
+    c->ext_csd[224] = 1;                    /* HC_ERASE_GRP_SIZE */
+    c->ext_csd[231] = 0x15;                 /* SEC_FEATURE_SUPPORT, GB_CL_EN */
+    c->ext_csd[EMU_EXT_CSD_CACHE_SIZE + 0] = emu_cfg.cache_kb & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_CACHE_SIZE + 1] = (emu_cfg.cache_kb >> 8) & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_CACHE_SIZE + 2] = (emu_cfg.cache_kb >> 16) & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_CACHE_SIZE + 3] = (emu_cfg.cache_kb >> 24) & 0xFF;
+    c->ext_csd[EMU_EXT_CSD_MAX_PACKED_WR] = 32;
+    c->ext_csd[504] = 1;                    /* S_CMD_SET */
+
+    c->cid[15] = (uint8_t)(emu_crc7(c->cid, 15) << 1) | 1;
+    c->csd[15] = (uint8_t)(emu_crc7(c->csd, 15) << 1) | 1;
+}
+
+/**
+  * \brief  Open or create the card image and build the card registers.
+  * \retval 0 on success, -1 on failure
+  */
+int emu_card_open(void)
+{
+    struct stat st;
+    EMU_Card *c = &emu_card;
+    uint64_t limit = (emu_cfg.type == EMU_CARD_SDHC) ? (32ULL << 30) :
+                     (emu_cfg.type == EMU_CARD_NOR) ? (32ULL << 20) : (1ULL << 30);
+
+    if ((emu_cfg.capacity & ((1 << 19) - 1)) || emu_cfg.capacity == 0 || emu_cfg.capacity > limit) {
+        fprintf(stderr, "emu: capacity must be a multiple of 512KB and at most %lluMB for this card type\n",
+                (unsigned long long)(limit >> 20));
+        return -1;
+    }
+    emu_fd = open(emu_cfg.image, O_RDWR | O_CREAT, 0644);
+    if (emu_fd < 0 || fstat(emu_fd, &st) != 0) {
+        perror(emu_cfg.image);
+        return -1;
+    }
+    if ((uint64_t)st.st_size < emu_cfg.capacity && ftruncate(emu_fd, (off_t)emu_cfg.capacity) != 0) {
+        perror(emu_cfg.image);
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    c->size = emu_cfg.capacity;
+    c->mem = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, emu_fd, 0);
+    if (c->mem == MAP_FAILED) {
+        perror(emu_cfg.image);
+        c->mem = NULL;
+        return -1;
+    }
+    if (emu_cfg.type == EMU_CARD_NOR && (uint64_t)st.st_size < c->size) {
+        /* new flash comes erased */
+        memset(c->mem + st.st_size, 0xFF, c->size - st.st_size);
+    }
+    if (emu_cfg.type == EMU_CARD_NOR) {
+        /* memory mapped window, readable only while QSPI1 is in flash mode */
+        c->xip = mmap((void *)QSPI_FLASH_BASE, c->size, PROT_NONE,
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, emu_fd, 0);
+        if (c->xip != (void *)QSPI_FLASH_BASE) {
+            fprintf(stderr, "emu: cannot map the flash window: %s\n", strerror(errno));
+            c->xip = NULL;
+            return -1;
+        }
+    }
+    emu_card_regs();
+    emu_card_reset();
+    return 0;
+}
+
+/**
+  * \brief  Write the image back and close it.
+  */
+void emu_card_close(void)
+{
+    if (emu_card.mem != NULL) {
+        msync(emu_card.mem, emu_card.size, MS_SYNC);
+        munmap(emu_card.mem, emu_card.size);
+        emu_card.mem = NULL;
+    }
+    if (emu_card.xip != NULL) {
+        munmap(emu_card.xip, emu_card.size);
+        emu_card.xip = NULL;
+    }
+    if (emu_fd >= 0) {
+        close(emu_fd);
+        emu_fd = -1;
+    }
+}
+
+/**
+  * \brief  CMD0 reset, back to idle with the power up bit cleared.
+  */
+void emu_card_reset(void)
+{
+    EMU_Card *c = &emu_card;
+
+    c->state = EMU_ST_IDLE;
+    c->app = 0;
+    c->width = 1;
+    c->hs = 0;
+    c->polls = 0;
+    c->rca = 0;
+    c->blocklen = 512;
+    c->preset = 0;
+    c->packed = 0;
+    c->ocr &= ~0x80000000UL;
+    c->ext_csd[EMU_EXT_CSD_BUS_WIDTH] = 0;
+    c->ext_csd[EMU_EXT_CSD_HS_TIMING] = 0;
+    c->ext_csd[EMU_EXT_CSD_CACHE_CTRL] = 0;
+    c->csd[3] = 0x32;
+    c->csd[15] = (uint8_t)(emu_crc7(c->csd, 15) << 1) | 1;
+}
+
+/**
+  * \brief  Check whether the card is still programming.
+  */
+uint8_t emu_card_busy(void)
+{
+    return emu_now_ns < emu_card.busy_until;
+}
+
+/**
+  * \brief  Queue programming busy behind any busy already pending.
+  * \param  us busy time in microseconds
+  */
+void emu_card_program(uint32_t us)
+{
+    uint64_t base = emu_card_busy() ? emu_card.busy_until : emu_now_ns;
+
+    emu_card.busy_until = base + (uint64_t)us * 1000ULL;
+}
+
+/**
+  * \brief  Host waits until the card releases busy.
+  */
+void emu_card_wait(void)
+{
+    if (emu_card_busy()) {
+        emu_stats.busy_ns += emu_card.busy_until - emu_now_ns;
+        emu_now_ns = emu_card.busy_until;
+    }
+}
+
+/**
+  * \brief  Convert a data command argument into an image offset.
+  * \param  arg command argument, block number for SDHC, byte address otherwise
+  * \param  len bytes the command is going to touch
+  * \param  off image offset
+  * \retval 0 when the range is inside the card, -1 otherwise
+  */
+int emu_card_offset(uint32_t arg, uint32_t len, uint64_t *off)
+{
+    uint64_t o = (emu_cfg.type == EMU_CARD_SDHC) ? ((uint64_t)arg << 9) : arg;
+
+    if (o + len > emu_card.size) {
+        return -1;
+    }
+    *off = o;
+    return 0;
+}
+
+void emu_card_read(uint64_t off, uint8_t *dst, uint32_t len)
+{
+    memcpy(dst, emu_card.mem + off, len);
+    emu_stats.rd_blocks += len >> 9;
+}
+
+void emu_card_write(uint64_t off, const uint8_t *src, uint32_t len)
+{
+    memcpy(emu_card.mem + off, src, len);
+    emu_stats.wr_blocks += len >> 9;
+}
+
+/**
+  * \brief  Erase the range set by CMD32/CMD33 or CMD35/CMD36, erased data reads as 0.
+  */
+void emu_card_erase(void)
+{
+    uint64_t first, last;
+
+    if (emu_card_offset(emu_card.erase_start, 512, &first) != 0 ||
+        emu_card_offset(emu_card.erase_end, 512, &last) != 0 || last < first) {
+        return;
+    }
+    first &= ~511ULL;
+    last = (last & ~511ULL) + 512;
+    memset(emu_card.mem + first, 0, last - first);
+    emu_stats.erase_blocks += (last - first) >> 9;
+    emu_card_program(emu_cfg.erase_us);
+}
+
+/**
+  * \brief  Highest bus clock the card accepts in its current timing mode.
+  */
+uint32_t emu_card_max_hz(void)
+{
+    if (emu_cfg.type == EMU_CARD_MMC) {
+        return emu_card.ext_csd[EMU_EXT_CSD_HS_TIMING] ? 52000000 : 26000000;
+    }
+    return emu_card.hs ? 50000000 : 25000000;
+}
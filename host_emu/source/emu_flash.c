@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+  * \file emu_flash.c
+  * \brief W25Q serial NOR flash model of the host emulator, sits behind QSPI1
+  * \details Selected with EMU_CARD_NOR. Bytes arrive through the
+  *          QSPI_TransmitReceive wrapper in emu_spi.c, program, erase and
+  *          status writes start when chip select goes high, which the model
+  *          sees through -Wl,--wrap=QSPI_CS_Enable. Programming can only clear
+  *          bits, the image keeps the flash contents. Read commands check
+  *          PROTO and DIR of every phase, dual and quad reads return garbage
+  *          and count a CRC error when a phase runs on the wrong lines.
+  *          In flash (XIP) mode, switched with -Wl,--wrap=QSPI_XIP_Enable,
+  *          the image is readable at QSPI_FLASH_BASE. Copies out of the
+  *          window, seen through -Wl,--wrap=memcpy, are charged one read
+  *          command per 32 byte line in the format FFMT describes.
+  *          Page programs and sector/block erases can be suspended with
+  *          0x75 for reads outside the range they change and resumed with
+  *          0x7A, a read inside the range counts a CRC error.
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ns.h"
+#include "ns_qspi.h"
+#include "ns_qspi_xip.h"
+#include "emu.h"
+
+/* typical W25Q128JV timings */
+#define NOR_BYTE1_NS        30000ULL        /* first byte of a page program */
+#define NOR_BYTEN_NS        2500ULL         /* every further byte */
+#define NOR_PAGE_NS         400000ULL       /* whole page program */
+#define NOR_SE_NS           45000000ULL     /* 4KB sector erase */
+#define NOR_BE_NS           150000000ULL    /* 64KB block erase */
+#define NOR_CE_NS           40000000000ULL  /* chip erase */
+#define NOR_SR_NS           10000000ULL     /* status register write */
+#define NOR_SUS_NS          20000ULL        /* tSUS, suspend until BUSY drops */
+#define NOR_XIP_LINE        32              /* bytes the controller fetches per read command */
+
+#define NOR_SR1_BUSY        0x01
+#define NOR_SR1_WEL         0x02
+#define NOR_SR2_QE          0x02
+#define NOR_SR2_SUS         0x80
+#define NOR_SR3_ADS         0x01
+
+/* read commands, lines of the address phase, mode and dummy bytes after the
+ * address, lines of the data phase and whether QE has to be set */
+static const struct nor_read {
+    uint8_t op;
+    uint8_t alines;
+    uint8_t hdr;
+    uint8_t dlines;
+    uint8_t qe;
+} nor_reads[] = {
+    { 0x03, 1, 0, 1, 0 },
+    { 0x0B, 1, 1, 1, 0 },
+    { 0x3B, 1, 1, 2, 0 },
+    { 0xBB, 2, 1, 2, 0 },
+    { 0x6B, 1, 1, 4, 1 },
+    { 0xEB, 4, 3, 4, 1 },
+};
+
+static struct {
+    uint8_t op;
+    uint32_t pos;               /* bytes after the opcode */
+    uint32_t addr;
+    uint8_t alen;               /* address bytes of the current command */
+    uint8_t wel;
+    uint8_t sr[3];
+    uint8_t pd;                 /* deep power down */
+    const struct nor_read *rd;  /* read command in progress */
+    uint8_t bad;                /* a phase ran on the wrong lines */
+    uint8_t xip;                /* QSPI1 is in flash mode */
+    uint8_t page[256];          /* page program buffer */
+    uint32_t pbytes;
+    uint32_t *wear;             /* erase count per 4KB sector */
+    uint32_t busy_addr;         /* range the running program or erase changes, */
+    uint32_t busy_len;          /* 0 if it cannot be suspended */
+    uint8_t sus;                /* suspended with 0x75 */
+    uint64_t sus_left;          /* busy time left when it was suspended */
+} nor;
+
+void emu_flash_reset(void)
+{
+    uint32_t *wear = nor.wear;
+
+    memset(&nor, 0, sizeof(nor));
+    free(wear);
+    nor.wear = calloc(emu_card.size / 4096, sizeof(uint32_t));
+}
+
+/* log2 of the size, JEDEC capacity byte, one above the 0x90 device ID */
+static uint8_t nor_capacity_code(void)
+{
+    uint8_t code = 0;
+
+    while ((1ULL << code) < emu_card.size) {
+        code++;
+    }
+    return code;
+}
+
+/* SFDP of a W25Q128JV scaled to the image: header, one basic flash parameter
+ * table of 16 DWORDs at 0x80, 0xFF elsewhere */
+static uint8_t nor_sfdp(uint32_t addr)
+{
+    static const uint8_t hdr[16] = {
+        'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+        0x00, 0x06, 0x01, 16, 0x80, 0x00, 0x00, 0xFF,
+    };
+    uint32_t dw[16] = {
+        0xFF7120E5,     /* 4KB erase 0x20, 1-1-2, 1-2-2, 1-4-4, 1-1-4 reads */
+        0,
+        0x6B08EB44,     /* 1-4-4: 2 mode, 4 dummy clocks; 1-1-4: 8 dummy clocks */
+        0xBB423B08,     /* 1-1-2: 8 dummy clocks; 1-2-2: 2 mode, 0 dummy clocks */
+        0xFFFFFFEE, 0xFF00FFFF, 0xFF00FFFF,
+        0x520F200C,     /* erase types 4KB 0x20, 32KB 0x52 */
+        0xFF00D810,     /* 64KB 0xD8 */
+        0x00A60000, 0x8F0F1F00,
+        0x00000080,     /* 256 byte pages */
+        0, 0, 0,
+        0x01000000,     /* enter 4-byte addressing with 0xB7 */
+    };
+
+    dw[1] = 0x80000000 | (nor_capacity_code() + 3);
+    if (emu_card.size > 0x1000000) {
+        dw[0] |= 1 << 17;
+    }
+    if (addr < sizeof(hdr)) {
+        return hdr[addr];
+    }
+    if (addr >= 0x80 && addr < 0x80 + sizeof(dw)) {
+        return (uint8_t)(dw[(addr - 0x80) / 4] >> (8 * (addr % 4)));
+    }
+    return 0xFF;
+}
+
+static uint8_t nor_sr(uint8_t n)
+{
+    if (n == 0) {
+        return (emu_card_busy() ? (NOR_SR1_BUSY | NOR_SR1_WEL) : 0) | (nor.wel ? NOR_SR1_WEL : 0);
+    }
+    return nor.sr[n];
+}
+
+static void nor_busy(uint64_t ns, uint32_t addr, uint32_t len)
+{
+    emu_card.busy_until = emu_now_ns + ns;
+    emu_stats.busy_ns += ns;
+    nor.busy_addr = addr;
+    nor.busy_len = len;
+}
+
+/* 0x75: BUSY drops within tSUS and SUS is set, ignored when nothing runs */
+static void nor_suspend(void)
+{
+    if (!emu_card_busy() || nor.sus || nor.busy_len == 0) {
+        return;
+    }
+    nor.sus_left = emu_card.busy_until - emu_now_ns;
+    emu_stats.busy_ns -= nor.sus_left;
+    nor.sus = 1;
+    nor.sr[1] |= NOR_SR2_SUS;
+    emu_stats.nor_suspends++;
+    emu_card.busy_until = emu_now_ns + NOR_SUS_NS;
+    emu_stats.busy_ns += NOR_SUS_NS;
+}
+
+/* 0x7A: the suspended program or erase goes on where it stopped */
+static void nor_resume(void)
+{
+    if (!nor.sus || emu_card_busy()) {
+        return;
+    }
+    nor.sus = 0;
+    nor.sr[1] &= ~NOR_SR2_SUS;
+    emu_card.busy_until = emu_now_ns + nor.sus_left;
+    emu_stats.busy_ns += nor.sus_left;
+}
+
+/* bytes a suspended program or erase is still changing */
+static uint8_t nor_sus_hit(uint32_t addr, uint32_t len)
+{
+    return nor.sus && addr < nor.busy_addr + nor.busy_len && addr + len > nor.busy_addr;
+}
+
+static void nor_erase(uint32_t addr, uint32_t len, uint64_t ns, uint8_t suspendable)
+{
+    uint32_t i;
+
+    addr &= ~(len - 1);
+    if (addr >= emu_card.size) {
+        return;
+    }
+    memset(emu_card.mem + addr, 0xFF, len);
+    for (i = 0; i < len / 4096; i++) {
+        nor.wear[addr / 4096 + i]++;
+    }
+    if (len == 4096) {
+        emu_stats.nor_erase_4k++;
+    } else if (len == 65536) {
+        emu_stats.nor_erase_64k++;
+    }
+    nor_busy(ns, addr, suspendable ? len : 0);
+}
+
+static const struct nor_read *nor_read_cmd(uint8_t op)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(nor_reads) / sizeof(nor_reads[0]); i++) {
+        if (nor_reads[i].op == op) {
+            return &nor_reads[i];
+        }
+    }
+    return NULL;
+}
+
+/* the controller frame matches a phase on lines data lines, multi line
+ * phases also need the direction, a TX frame does not sample, an RX frame
+ * leaves the lines floating */
+static uint8_t nor_lines_ok(uint8_t lines, uint8_t rx)
+{
+    uint32_t fmt = QSPI1->FMT;
+    uint8_t have;
+
+    switch (fmt & QSPI_FMT_PROTO_MASK) {
+    case QSPI_FMT_PROTO_DUAL:
+        have = 2;
+        break;
+    case QSPI_FMT_PROTO_QUAD:
+        have = 4;
+        break;
+    default:
+        have = 1;
+        break;
+    }
+    if (have != lines) {
+        return 0;
+    }
+    return lines == 1 || ((fmt & QSPI_FMT_DIR) ? !rx : rx);
+}
+
+/* chip select went high, start whatever the command asked for */
+static void nor_deselect(void)
+{
+    uint32_t i, base;
+    uint8_t op = nor.op;
+    uint32_t pos = nor.pos;
+    uint8_t addressed = pos > nor.alen;
+
+    nor.pos = 0;
+    nor.op = 0;
+    if (op == 0x75) {
+        nor_suspend();
+        return;
+    }
+    if (op == 0x7A) {
+        nor_resume();
+        return;
+    }
+    if (op == 0 || !nor.wel) {
+        return;
+    }
+    switch (op) {
+    case 0x02:
+    case 0x32:
+        if (!addressed || nor.pbytes == 0) {
+            return;
+        }
+        base = nor.addr & ~0xFFU;
+        if (base < emu_card.size) {
+            for (i = 0; i < 256; i++) {
+                emu_card.mem[base + i] &= nor.page[i];
+            }
+        }
+        emu_stats.nor_programs++;
+        emu_stats.nor_prog_bytes += nor.pbytes;
+        nor_busy(nor.pbytes >= 256 ? NOR_PAGE_NS :
+                 NOR_BYTE1_NS + (nor.pbytes - 1) * NOR_BYTEN_NS < NOR_PAGE_NS ?
+                 NOR_BYTE1_NS + (nor.pbytes - 1) * NOR_BYTEN_NS : NOR_PAGE_NS, base, 256);
+        break;
+    case 0x20:
+        if (!addressed) {
+            return;
+        }
+        nor_erase(nor.addr, 4096, NOR_SE_NS, 1);
+        break;
+    case 0xD8:
+        if (!addressed) {
+            return;
+        }
+        nor_erase(nor.addr, 65536, NOR_BE_NS, 1);
+        break;
+    case 0x60:
+    case 0xC7:
+        nor_erase(0, (uint32_t)emu_card.size, NOR_CE_NS, 0);
+        break;
+    case 0x01:
+    case 0x31:
+    case 0x11:
+        if (pos < 2) {
+            return;
+        }
+        nor.sr[op == 0x01 ? 0 : op == 0x31 ? 1 : 2] = (uint8_t)nor.addr & ~(op == 0x31 ? NOR_SR2_SUS : NOR_SR1_BUSY);
+        nor_busy(NOR_SR_NS, 0, 0);
+        break;
+    default:
+        return;
+    }
+    nor.wel = 0;
+}
+
+/**
+  * \brief  One byte exchanged with the flash while it is selected.
+  * \param  mosi byte from the host
+  * \retval byte driven back
+  */
+uint8_t emu_flash_xfer(uint8_t mosi)
+{
+    uint32_t idx;
+
+    if (nor.xip) {
+        /* register mode transfer while the controller owns the bus */
+        emu_stats.crc_errors++;
+        return 0xFF;
+    }
+    if (nor.pos == 0) {
+        nor.pos = 1;
+        nor.op = 0;
+        nor.addr = 0;
+        nor.pbytes = 0;
+        nor.alen = (nor.sr[2] & NOR_SR3_ADS) ? 4 : 3;
+        nor.rd = nor_read_cmd(mosi);
+        nor.bad = 0;
+        if (!nor_lines_ok(1, 0)) {
+            /* opcode on the wrong lines, the part sees garbage */
+            emu_stats.crc_errors++;
+            return 0xFF;
+        }
+        if (nor.rd != NULL && nor.rd->qe && !(nor.sr[1] & NOR_SR2_QE)) {
+            /* quad commands are not decoded while IO2/IO3 are /WP and /HOLD */
+            nor.rd = NULL;
+            return 0xFF;
+        }
+        if ((emu_card_busy() && mosi != 0x05 && mosi != 0x35 && mosi != 0x15 && mosi != 0x75) ||
+            (nor.sus && nor.rd == NULL && mosi != 0x05 && mosi != 0x35 && mosi != 0x15 && mosi != 0x7A) ||
+            (nor.pd && mosi != 0xAB)) {
+            /* ignored by the part, the driver did not wait */
+            emu_stats.implicit++;
+            return 0xFF;
+        }
+        nor.op = mosi;
+        switch (mosi) {
+        case 0x06:
+            nor.wel = 1;
+            break;
+        case 0x04:
+            nor.wel = 0;
+            break;
+        case 0xB7:
+            nor.sr[2] |= NOR_SR3_ADS;
+            break;
+        case 0xE9:
+            nor.sr[2] &= ~NOR_SR3_ADS;
+            break;
+        case 0xB9:
+            nor.pd = 1;
+            break;
+        case 0xAB:
+            nor.pd = 0;
+            break;
+        case 0x32:
+            if (!(nor.sr[1] & NOR_SR2_QE)) {
+                nor.op = 0;
+                break;
+            }
+            /* fall through */
+        case 0x02:
+            memset(nor.page, 0xFF, sizeof(nor.page));
+            break;
+        default:
+            break;
+        }
+        return 0xFF;
+    }
+
+    idx = nor.pos++ - 1;
+    if (nor.rd != NULL && nor.op == nor.rd->op) {
+        if (idx < nor.alen + nor.rd->hdr) {
+            if (!nor_lines_ok(nor.rd->alines, 0) && !nor.bad) {
+                nor.bad = 1;
+                emu_stats.crc_errors++;
+            }
+            if (idx < nor.alen) {
+                nor.addr = (nor.addr << 8) | mosi;
+            }
+            return 0xFF;
+        }
+        if ((!nor_lines_ok(nor.rd->dlines, 1) || nor_sus_hit(nor.addr % emu_card.size, 1)) && !nor.bad) {
+            nor.bad = 1;
+            emu_stats.crc_errors++;
+        }
+        return emu_card.mem[nor.addr++ % emu_card.size] ^ (nor.bad ? 0xA5 : 0);
+    }
+    switch (nor.op) {
+    case 0x05:
+        return nor_sr(0);
+    case 0x35:
+        return nor_sr(1);
+    case 0x15:
+        return nor_sr(2);
+    case 0x01:
+    case 0x31:
+    case 0x11:
+        if (idx == 0) {
+            nor.addr = mosi;
+        }
+        break;
+    case 0x90:
+        if (idx >= 3) {
+            return ((idx - 3) & 1) ? (uint8_t)(nor_capacity_code() - 1) : 0xEF;
+        }
+        break;
+    case 0x9F:
+        return (idx % 3 == 0) ? 0xEF : (idx % 3 == 1) ? 0x40 : nor_capacity_code();
+    case 0x5A:
+        /* always 3 address bytes and 8 dummy clocks */
+        if (idx < 3) {
+            nor.addr = (nor.addr << 8) | mosi;
+        } else if (idx > 3) {
+            return nor_sfdp(nor.addr++);
+        }
+        break;
+    case 0x02:
+    case 0x32:
+        if (idx < nor.alen) {
+            nor.addr = (nor.addr << 8) | mosi;
+        } else {
+            if (!nor_lines_ok(nor.op == 0x32 ? 4 : 1, 0) && !nor.bad) {
+                nor.bad = 1;
+                emu_stats.crc_errors++;
+            }
+            mosi ^= nor.bad ? 0xA5 : 0;
+            /* wraps inside the page, like the part */
+            nor.page[(nor.addr + nor.pbytes) & 0xFF] = mosi;
+            nor.pbytes++;
+        }
+        break;
+    case 0x20:
+    case 0xD8:
+        if (idx < nor.alen) {
+            nor.addr = (nor.addr << 8) | mosi;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0xFF;
+}
+
+/**
+  * \brief  Host wrapper of QSPI_CS_Enable, chip select going high ends a flash command.
+  */
+void __real_QSPI_CS_Enable(QSPI_TypeDef *QSPIx, uint8_t csid, ControlStatus Status);
+void __wrap_QSPI_CS_Enable(QSPI_TypeDef *QSPIx, uint8_t csid, ControlStatus Status)
+{
+    uint8_t was = (QSPIx->CSID & csid) != 0;
+
+    if (QSPIx == QSPI1) {
+        emu_spi_drain();
+    }
+    __real_QSPI_CS_Enable(QSPIx, csid, Status);
+    if (QSPIx == QSPI1 && emu_cfg.type == EMU_CARD_NOR && was && Status != ENABLE) {
+        nor_deselect();
+    }
+}
+
+/* FFMT describes one of the read commands the way the part expects it */
+static uint8_t nor_xip_format_ok(void)
+{
+    uint32_t ffmt = ((QSPI_XIP_TypeDef *)QSPI1)->FFMT;
+    const struct nor_read *rd = nor_read_cmd((ffmt & QSPI_XIP_FFMT_CMD_CODE_MASK) >> QSPI_XIP_FFMT_CMD_CODE_OFS);
+    uint8_t alines = 1 << ((ffmt & QSPI_XIP_FFMT_ADDR_PROTO_MASK) >> QSPI_XIP_FFMT_ADDR_PROTO_OFS);
+    uint8_t dlines = 1 << ((ffmt & QSPI_XIP_FFMT_DATA_PROTO_MASK) >> QSPI_XIP_FFMT_DATA_PROTO_OFS);
+    uint8_t pad = (ffmt & QSPI_XIP_FFMT_PAD_CNT_MASK) >> QSPI_XIP_FFMT_PAD_CNT_OFS;
+    uint8_t alen = (ffmt & QSPI_XIP_FFMT_ADDR_LEN_MASK) >> QSPI_XIP_FFMT_ADDR_LEN_OFS;
+
+    return rd != NULL && (ffmt & QSPI_XIP_FFMT_CMD) && !(ffmt & QSPI_XIP_FFMT_CMD_PROTO_MASK) &&
+           alen == ((nor.sr[2] & NOR_SR3_ADS) ? 4 : 3) && alines == rd->alines && dlines == rd->dlines &&
+           pad == rd->hdr * 8 / rd->alines && (!rd->qe || (nor.sr[1] & NOR_SR2_QE));
+}
+
+/**
+  * \brief  Host wrapper of QSPI_XIP_Enable, opens and closes the flash window.
+  */
+void __real_QSPI_XIP_Enable(QSPI_XIP_TypeDef *QSPI_XIPx, ControlStatus Status);
+void __wrap_QSPI_XIP_Enable(QSPI_XIP_TypeDef *QSPI_XIPx, ControlStatus Status)
+{
+    __real_QSPI_XIP_Enable(QSPI_XIPx, Status);
+    if ((QSPI_TypeDef *)QSPI_XIPx != QSPI1 || emu_cfg.type != EMU_CARD_NOR || emu_card.xip == NULL) {
+        return;
+    }
+    emu_spi_drain();
+    if (Status == ENABLE && !nor.xip) {
+        emu_stats.nor_xip++;
+        if (!nor_xip_format_ok()) {
+            fprintf(stderr, "emu: XIP read format 0x%08x does not match the flash\n",
+                    (unsigned)((QSPI_XIP_TypeDef *)QSPI1)->FFMT);
+            emu_stats.crc_errors++;
+        }
+        if (emu_card_busy() || nor.pos != 0) {
+            /* the part would answer with status or ignore the read */
+            emu_stats.implicit++;
+        }
+    }
+    nor.xip = (Status == ENABLE);
+    mprotect(emu_card.xip, emu_card.size, nor.xip ? PROT_READ : PROT_NONE);
+}
+
+/* clocks of one line fetch: command, address, mode and dummy, data */
+static uint32_t nor_xip_line_clocks(void)
+{
+    uint32_t ffmt = ((QSPI_XIP_TypeDef *)QSPI1)->FFMT;
+    uint32_t alines = 1 << ((ffmt & QSPI_XIP_FFMT_ADDR_PROTO_MASK) >> QSPI_XIP_FFMT_ADDR_PROTO_OFS);
+    uint32_t dlines = 1 << ((ffmt & QSPI_XIP_FFMT_DATA_PROTO_MASK) >> QSPI_XIP_FFMT_DATA_PROTO_OFS);
+    uint32_t alen = (ffmt & QSPI_XIP_FFMT_ADDR_LEN_MASK) >> QSPI_XIP_FFMT_ADDR_LEN_OFS;
+    uint32_t pad = (ffmt & QSPI_XIP_FFMT_PAD_CNT_MASK) >> QSPI_XIP_FFMT_PAD_CNT_OFS;
+
+    return 8 + alen * 8 / alines + pad + NOR_XIP_LINE * 8 / dlines;
+}
+
+/**
+  * \brief  Host wrapper of memcpy, times copies out of the flash window.
+  */
+void *__real_memcpy(void *dst, const void *src, size_t n);
+void *__wrap_memcpy(void *dst, const void *src, size_t n)
+{
+    const uint8_t *p = src;
+    uint64_t off, lines, ns;
+
+    if (nor.xip && n != 0 && p >= emu_card.xip && p < emu_card.xip + emu_card.size) {
+        off = p - emu_card.xip;
+        if (nor_sus_hit((uint32_t)off, (uint32_t)n)) {
+            emu_stats.crc_errors++;
+        }
+        lines = (off % NOR_XIP_LINE + n + NOR_XIP_LINE - 1) / NOR_XIP_LINE;
+        ns = emu_spi_clocks_ns(lines * nor_xip_line_clocks());
+        emu_stats.bus_ns += ns;
+        emu_advance(ns);
+    }
+    return __real_memcpy(dst, src, n);
+}
+
+/**
+  * \brief  Highest erase count of any 4KB sector and how many sectors were erased.
+  */
+uint32_t emu_flash_wear(uint32_t *sectors)
+{
+    uint32_t i, max = 0, n = 0;
+
+    for (i = 0; nor.wear != NULL && i < emu_card.size / 4096; i++) {
+        if (nor.wear[i] > max) {
+            max = nor.wear[i];
+        }
+        n += nor.wear[i] != 0;
+    }
+    if (sectors != NULL) {
+        *sectors = n;
+    }
+    return max;
+}
@@ -0,0 +1,918 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+  * \file emu_sdio.c
+  * \brief SD bus front end of the card model, sits behind SDIO0 and its uDMA channel
+  * \details The real ns_sdio.c is linked unchanged, the entry points that start
+  *          bus activity are intercepted with -Wl,--wrap:
+  *          - SDIO_SendCommand: runs the command, fills RSP0..3 and STATUS
+  *          - SDIO_DMA_Config: moves data between the card and the DMA buffer
+  *          - SDIO_ReadData/SDIO_SendData: FIFO access in polling mode
+  *          - SDIO_ClearFlag/SDIO_DmaInterruptClr: write-1-to-clear semantics
+  *          - SDIO_DmaGetIntStat: advances a continuous mode channel
+  *          Everything completes synchronously, the virtual clock is advanced
+  *          by the bus, access and busy times the transfer would take. A
+  *          channel in continuous mode moves one half of its ring whenever the
+  *          host polls for a DMA status bit that is not set yet or executes WFI,
+  *          so a driver that keeps up with the halves never sees an overrun.
+  *          Stores to TX_DATA that bypass SDIO_SendData cannot be observed.
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include "ns.h"
+#include "ns_sdio.h"
+#include "emu.h"
+
+/* card status bits of R1 */
+#define R1_OUT_OF_RANGE     (1UL << 31)
+#define R1_SWITCH_ERROR     (1UL << 7)
+#define R1_READY_FOR_DATA   (1UL << 8)
+#define R1_APP_CMD          (1UL << 5)
+
+#define SD_RCA              0x5AA5
+
+enum {
+    RSP_NONE = 0,           /* card stays silent, host sees a timeout */
+    RSP_SHORT,              /* R1/R1b/R3/R6/R7 */
+    RSP_LONG,               /* R2 */
+};
+
+enum {
+    XFER_NONE = 0,
+    XFER_READ,
+    XFER_WRITE,
+};
+
+static struct {
+    uint8_t dir;
+    uint8_t cmd;
+    uint8_t busy;           /* host waits for DAT0 busy before EOT */
+    uint32_t err;           /* data error reported with EOT */
+    uint8_t image;          /* payload belongs to the card image */
+    uint8_t cached;         /* eMMC cache absorbs the write */
+    uint8_t packed;         /* first block is a packed write header */
+    uint32_t bsize;
+    uint32_t blocks;
+    uint32_t len;
+    uint32_t pos;
+    uint64_t off;
+    uint8_t *buf;
+    uint32_t cap;
+    uint8_t ring;           /* continuous channel running, next half in bit 1 */
+    uint8_t drop;           /* the DMA channel does not report completion */
+} xfer;
+
+/* open ended CMD18/CMD25 waiting for CMD12 */
+static uint8_t sdio_open;
+
+static uint32_t sdio_hz(void)
+{
+    return SystemCoreClock / (2 * (SDIO0->CLK_DIV + 1));
+}
+
+static uint8_t sdio_lanes(void)
+{
+    switch ((SDIO0->DATA_SETUP & SDIO_DATA_SETUP_MODE_MASK) >> SDIO_DATA_SETUP_MODE_OFS) {
+    case 1:
+        return 4;
+    case 2:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
+static uint8_t sdio_card_ddr(void)
+{
+    return emu_cfg.type == EMU_CARD_MMC && emu_card.ext_csd[EMU_EXT_CSD_BUS_WIDTH] >= 5;
+}
+
+/* host and card disagree on lanes, data rate, or the clock is out of spec */
+static uint8_t sdio_bus_bad(void)
+{
+    uint8_t host_ddr = (SDIO0->CR & SDIO_CR_DDR) ? 1 : 0;
+
+    return sdio_lanes() != emu_card.width || host_ddr != sdio_card_ddr() ||
+           sdio_hz() > emu_card_max_hz();
+}
+
+/* injected CRC error, every emu_cfg.fault_every-th data transfer of the image */
+static uint8_t sdio_fault(void)
+{
+    static uint32_t n;
+
+    return emu_cfg.fault_every && ++n % emu_cfg.fault_every == 0;
+}
+
+/* lost DMA completion, every emu_cfg.drop_every-th single shot data transfer of the image */
+static uint8_t sdio_drop(void)
+{
+    static uint32_t n;
+
+    if (emu_cfg.drop_every && ++n % emu_cfg.drop_every == 0) {
+        emu_stats.dma_dropped++;
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t sdio_block_ns(uint32_t bsize)
+{
+    uint64_t bits = (uint64_t)bsize * 8 / sdio_lanes() + 16 + 2;
+
+    if (SDIO0->CR & SDIO_CR_DDR) {
+        bits = (bits + 1) / 2;
+    }
+    return emu_bits_ns(bits, sdio_hz());
+}
+
+static uint32_t sdio_status(void)
+{
+    EMU_Card *c = &emu_card;
+    uint32_t st = (uint32_t)(emu_card_busy() ? EMU_ST_PRG : c->state) << 9;
+
+    if (!emu_card_busy() && c->state != EMU_ST_RCV) {
+        st |= R1_READY_FOR_DATA;
+    }
+    return st;
+}
+
+static void sdio_buf(uint32_t len)
+{
+    if (len > xfer.cap) {
+        xfer.buf = realloc(xfer.buf, len);
+        xfer.cap = len;
+    }
+}
+
+void emu_sdio_reset(void)
+{
+    free(xfer.buf);
+    memset(&xfer, 0, sizeof(xfer));
+    sdio_open = 0;
+    SDIO0->IP = SDIO_IP_RXEMPTY;
+}
+
+static void sdio_done(void)
+{
+    if (xfer.err) {
+        SDIO0->STATUS |= SDIO_STATUS_ERR | xfer.err;
+    }
+    SDIO0->STATUS |= SDIO_STATUS_EOT;
+    SDIO0->IP |= SDIO_IP_RXEMPTY;
+    xfer.dir = XFER_NONE;
+}
+
+/* geometry the host programmed into DATA_SETUP, 0 when the data path is off */
+static uint32_t sdio_setup(uint8_t read)
+{
+    uint32_t ds = SDIO0->DATA_SETUP;
+
+    if (!(ds & SDIO_DATA_SETUP_CHANNEL_ENABLE) || !!(ds & SDIO_DATA_SETUP_RWN_READ) != read) {
+        return 0;
+    }
+    xfer.bsize = ((ds & SDIO_DATA_SETUP_BLOCK_SIZE_MASK) >> SDIO_DATA_SETUP_BLOCK_SIZE_OFS) + 1;
+    xfer.blocks = ((ds & SDIO_DATA_SETUP_BLOCK_NUM_MASK) >> SDIO_DATA_SETUP_BLOCK_NUM_OFS) + 1;
+    xfer.len = xfer.bsize * xfer.blocks;
+    xfer.pos = 0;
+    xfer.err = 0;
+    xfer.ring = 0;
+    xfer.drop = 0;
+    sdio_buf(xfer.len);
+    return xfer.len;
+}
+
+static void sdio_write_commit(void);
+
+/**
+  * \brief  Move one half of the ring of a continuous mode channel.
+  * \details Sets HTRANS after the first half and FTRANS after the second. At
+  *          the end of the ring the channel restarts while CONTINUOUS is
+  *          still set and stops otherwise, as it does once the transfer length
+  *          programmed in DATA_SETUP is reached.
+  * \retval 1 a half was moved, 0 no continuous channel is running
+  */
+uint8_t emu_sdio_dma_step(void)
+{
+    uint8_t rd = (xfer.dir == XFER_READ);
+    volatile uint32_t *cfg = rd ? &SDIO0->RX_CFG : &SDIO0->TX_CFG;
+    uint32_t size = rd ? (SDIO0->RX_SIZE & SDIO_RX_SIZE_NUM_MASK) : (SDIO0->TX_SIZE & SDIO_TX_SIZE_TX_SIZE_MASK);
+    uint8_t *ring = emu_ptr(rd ? SDIO0->RX_SADDR : SDIO0->TX_SADDR);
+    uint32_t en = rd ? SDIO_RX_CFG_EN : SDIO_TX_CFG_EN;
+    uint32_t cont = rd ? SDIO_RX_CFG_CONTINUOUS : SDIO_TX_CFG_CONTINUOUS;
+    uint32_t half = size / 2;
+    uint32_t second = (xfer.ring >> 1) & 1;
+
+    if (!xfer.ring || xfer.dir == XFER_NONE || !(*cfg & en)) {
+        return 0;
+    }
+    if (half > xfer.len - xfer.pos) {
+        half = xfer.len - xfer.pos;
+    }
+    if (rd) {
+        memcpy(ring + second * (size / 2), xfer.buf + xfer.pos, half);
+    } else {
+        memcpy(xfer.buf + xfer.pos, ring + second * (size / 2), half);
+    }
+    xfer.pos += half;
+    xfer.ring ^= 2;
+    SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT |= second ? (rd ? RX_FTRANS_IRQ_STAT : TX_FTRANS_IRQ_STAT)
+                                                     : (rd ? RX_HTRANS_IRQ_STAT : TX_HTRANS_IRQ_STAT);
+    if (xfer.pos == xfer.len || (second && !(*cfg & cont))) {
+        *cfg &= ~en;
+        xfer.ring = 0;
+    }
+    if (xfer.pos == xfer.len) {
+        if (rd) {
+            sdio_done();
+        } else {
+            sdio_write_commit();
+        }
+    }
+    return 1;
+}
+
+static void sdio_rx_dma(void)
+{
+    uint32_t n;
+
+    if (xfer.dir != XFER_READ || !(SDIO0->RX_CFG & SDIO_RX_CFG_EN)) {
+        return;
+    }
+    if (SDIO0->RX_CFG & SDIO_RX_CFG_CONTINUOUS) {
+        xfer.ring = 1;
+        emu_sdio_dma_step();
+        return;
+    }
+    n = SDIO0->RX_SIZE & SDIO_RX_SIZE_NUM_MASK;
+    if (n > xfer.len - xfer.pos) {
+        n = xfer.len - xfer.pos;
+    }
+    memcpy(emu_ptr(SDIO0->RX_SADDR), xfer.buf + xfer.pos, n);
+    xfer.pos += n;
+    SDIO0->RX_CFG &= ~SDIO_RX_CFG_EN;
+    if (xfer.pos < xfer.len || !xfer.image || !sdio_drop()) {
+        SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT |= RX_FTRANS_IRQ_STAT | RX_HTRANS_IRQ_STAT;
+    }
+    if (xfer.pos == xfer.len) {
+        sdio_done();
+    }
+}
+
+/**
+  * \brief  Card starts sending a data block train.
+  * \param  src register payload, NULL to read the image at off
+  * \param  reglen payload length of a register read
+  * \param  off image offset
+  * \param  ok the command was accepted, otherwise only a data timeout is reported
+  */
+static void sdio_read_start(const uint8_t *src, uint32_t reglen, uint64_t off, uint8_t ok)
+{
+    uint32_t i;
+    uint64_t ns = 0;
+    uint8_t bad;
+
+    if (sdio_setup(1) == 0) {
+        /* nobody listens on DAT, the card still sends the data */
+        return;
+    }
+    xfer.dir = XFER_READ;
+    xfer.image = (src == NULL);
+    memset(xfer.buf, 0, xfer.len);
+    if (!ok) {
+        xfer.err = SDIO_STATUS_DATA_ERR_TIMEOUT;
+    } else if (src != NULL) {
+        memcpy(xfer.buf, src, (reglen < xfer.len) ? reglen : xfer.len);
+        ns = sdio_block_ns(xfer.len);
+    } else {
+        for (i = 0; i < xfer.blocks; i++) {
+            if (off + (uint64_t)(i + 1) * xfer.bsize > emu_card.size) {
+                xfer.err = SDIO_STATUS_DATA_ERR_TIMEOUT;
+                break;
+            }
+            emu_card_read(off + (uint64_t)i * xfer.bsize, xfer.buf + i * xfer.bsize, xfer.bsize);
+            ns += sdio_block_ns(xfer.bsize);
+        }
+        emu_advance((uint64_t)emu_cfg.rd_access_us * 1000ULL +
+                    (uint64_t)(xfer.blocks - 1) * emu_cfg.rd_block_us * 1000ULL);
+    }
+    bad = ok && (sdio_bus_bad() || (xfer.image && sdio_fault()));
+    if (bad) {
+        for (i = 0; i < xfer.blocks; i++) {
+            xfer.buf[i * xfer.bsize] ^= 0x10;
+        }
+        emu_stats.crc_errors += xfer.blocks;
+        xfer.err = SDIO_STATUS_DATA_ERR_CRCERR;
+    }
+    emu_stats.bus_ns += ns;
+    emu_advance(ns);
+    SDIO0->IP &= ~SDIO_IP_RXEMPTY;
+    sdio_rx_dma();
+}
+
+/*
+ * Image offset of block i of the write train. For a packed group block 0 is
+ * the header and the data blocks follow the entries it lists.
+ */
+static int sdio_write_offset(uint32_t i, uint64_t *off)
+{
+    const uint32_t *hdr = (const uint32_t *)xfer.buf;
+    uint32_t n, e, entries;
+    uint64_t base;
+
+    if (!xfer.packed) {
+        *off = xfer.off + (uint64_t)i * xfer.bsize;
+        return 0;
+    }
+    entries = (hdr[0] >> 16) & 0xFF;
+    if ((hdr[0] & 0xFFFF) != 0x0201 || entries == 0 || (entries + 1) * 8 > xfer.bsize) {
+        return -1;
+    }
+    n = 1;
+    for (e = 1; e <= entries; e++) {
+        if (i < n + hdr[e * 2]) {
+            if (emu_card_offset(hdr[e * 2 + 1], emu_card.blocklen, &base) != 0) {
+                return -1;
+            }
+            *off = base + (uint64_t)(i - n) * xfer.bsize;
+            return 0;
+        }
+        n += hdr[e * 2];
+    }
+    return -1;
+}
+
+static void sdio_write_commit(void)
+{
+    EMU_Card *c = &emu_card;
+    uint32_t i;
+    uint32_t us;
+    uint64_t ns;
+    uint64_t off;
+    uint8_t bad = sdio_bus_bad() || sdio_fault();
+
+    for (i = 0; i < xfer.blocks; i++) {
+        emu_card_wait();
+        ns = sdio_block_ns(xfer.bsize);
+        emu_stats.bus_ns += ns;
+        emu_advance(ns);
+        if (bad) {
+            emu_stats.crc_errors++;
+            xfer.err = SDIO_STATUS_DATA_ERR_CRCERR;
+            break;
+        }
+        if (xfer.packed && i == 0) {
+            emu_stats.packed++;
+            continue;
+        }
+        if (sdio_write_offset(i, &off) != 0 || off + xfer.bsize > c->size) {
+            xfer.err = SDIO_STATUS_DATA_ERR_TIMEOUT;
+            break;
+        }
+        emu_card_write(off, xfer.buf + i * xfer.bsize, xfer.bsize);
+        if (xfer.cached && c->dirty < emu_cfg.cache_kb * 2) {
+            c->dirty++;
+            us = 0;
+        } else {
+            us = (xfer.cmd == 24) ? emu_cfg.wr_single_us : emu_cfg.wr_block_us;
+        }
+        emu_card_program(us);
+    }
+    if (xfer.cmd == 25 && !sdio_open) {
+        /* closed ended by CMD23 */
+        emu_card_program(xfer.cached ? 0 : emu_cfg.wr_stop_us);
+        c->state = EMU_ST_TRAN;
+    } else if (xfer.cmd == 24) {
+        c->state = EMU_ST_TRAN;
+    }
+    if (!xfer.drop) {
+        SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT |= TX_FTRANS_IRQ_STAT | TX_HTRANS_IRQ_STAT;
+    }
+    if (xfer.busy) {
+        emu_card_wait();
+    }
+    sdio_done();
+}
+
+static void sdio_tx_dma(void)
+{
+    uint32_t n;
+
+    if (xfer.dir != XFER_WRITE || !(SDIO0->TX_CFG & SDIO_TX_CFG_EN)) {
+        return;
+    }
+    if (SDIO0->TX_CFG & SDIO_TX_CFG_CONTINUOUS) {
+        xfer.ring = 1;
+        emu_sdio_dma_step();
+        return;
+    }
+    n = SDIO0->TX_SIZE & SDIO_TX_SIZE_TX_SIZE_MASK;
+    if (n > xfer.len - xfer.pos) {
+        n = xfer.len - xfer.pos;
+    }
+    memcpy(xfer.buf + xfer.pos, emu_ptr(SDIO0->TX_SADDR), n);
+    xfer.pos += n;
+    SDIO0->TX_CFG &= ~SDIO_TX_CFG_EN;
+    if (xfer.pos == xfer.len) {
+        xfer.drop = sdio_drop();
+        sdio_write_commit();
+    } else {
+        SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT |= TX_FTRANS_IRQ_STAT | TX_HTRANS_IRQ_STAT;
+    }
+}
+
+static void sdio_write_start(uint8_t cmd, uint64_t off, uint8_t busy)
+{
+    EMU_Card *c = &emu_card;
+
+    c->state = EMU_ST_RCV;
+    if (sdio_setup(0) == 0) {
+        return;
+    }
+    xfer.dir = XFER_WRITE;
+    xfer.cmd = cmd;
+    xfer.off = off;
+    xfer.busy = busy;
+    xfer.image = 1;
+    xfer.cached = emu_cfg.type == EMU_CARD_MMC && (c->ext_csd[EMU_EXT_CSD_CACHE_CTRL] & 1) && emu_cfg.cache_kb;
+    xfer.packed = c->packed && cmd == 25;
+    sdio_tx_dma();
+}
+
+static void sdio_flush(void)
+{
+    EMU_Card *c = &emu_card;
+
+    if (c->dirty) {
+        emu_card_program(c->dirty * emu_cfg.wr_block_us + emu_cfg.wr_stop_us);
+        c->dirty = 0;
+    }
+}
+
+/* MMC CMD6, write one EXT_CSD byte */
+static uint32_t sdio_mmc_switch(uint32_t arg)
+{
+    EMU_Card *c = &emu_card;
+    uint8_t access = (arg >> 24) & 3;
+    uint8_t index = (arg >> 16) & 0xFF;
+    uint8_t value = (arg >> 8) & 0xFF;
+    uint8_t v = c->ext_csd[index];
+
+    switch (access) {
+    case 1:
+        v |= value;
+        break;
+    case 2:
+        v &= ~value;
+        break;
+    case 3:
+        v = value;
+        break;
+    default:
+        return R1_SWITCH_ERROR;
+    }
+    switch (index) {
+    case EMU_EXT_CSD_BUS_WIDTH:
+        if (v == 0) {
+            c->width = 1;
+        } else if (v == 1 || v == 5) {
+            c->width = 4;
+        } else if (v == 2 || v == 6) {
+            c->width = 8;
+        } else {
+            return R1_SWITCH_ERROR;
+        }
+        if (v >= 5 && !c->ext_csd[EMU_EXT_CSD_HS_TIMING]) {
+            return R1_SWITCH_ERROR;
+        }
+        break;
+    case EMU_EXT_CSD_HS_TIMING:
+        if (v > 1) {
+            return R1_SWITCH_ERROR;
+        }
+        break;
+    case EMU_EXT_CSD_CACHE_CTRL:
+        if (!(v & 1)) {
+            sdio_flush();
+        }
+        break;
+    case EMU_EXT_CSD_FLUSH_CACHE:
+        if (v & 1) {
+            sdio_flush();
+        }
+        v = 0;
+        break;
+    default:
+        break;
+    }
+    c->ext_csd[index] = v;
+    return 0;
+}
+
+/**
+  * \brief  Run one command through the card model.
+  * \param  cmd command index
+  * \param  arg command argument
+  * \param  busy host waits for busy release
+  * \param  rsp short response payload
+  * \param  reg long response register
+  * \retval RSP_NONE, RSP_SHORT or RSP_LONG
+  */
+static uint8_t sdio_command(uint8_t cmd, uint32_t arg, uint8_t busy, uint32_t *rsp, const uint8_t **reg)
+{
+    EMU_Card *c = &emu_card;
+    uint8_t mmc = (emu_cfg.type == EMU_CARD_MMC);
+    uint8_t app = c->app;
+    uint32_t st;
+    uint64_t off = 0;
+    uint8_t ok;
+    static uint8_t switch_status[64];
+    /* speed class 10, 4MB allocation unit */
+    static uint8_t sd_status[64] = { [8] = 0x04, [9] = 0x00, [10] = 0x90 };
+
+    emu_stats.cmd[cmd]++;
+    c->app = 0;
+
+    /* commands that need the bus while the card still owns it */
+    if (cmd != 0 && cmd != 12 && cmd != 13) {
+        if (sdio_open || xfer.dir != XFER_NONE) {
+            if (emu_cfg.strict) {
+                return RSP_NONE;
+            }
+            emu_stats.implicit++;
+            sdio_open = 0;
+            xfer.dir = XFER_NONE;
+            if (c->state == EMU_ST_RCV) {
+                emu_card_program(emu_cfg.wr_stop_us);
+            }
+            c->state = EMU_ST_TRAN;
+        }
+        if (emu_card_busy() && c->state != EMU_ST_IDLE) {
+            if (emu_cfg.strict) {
+                return RSP_NONE;
+            }
+            emu_stats.implicit++;
+            emu_card_wait();
+        }
+    }
+    st = sdio_status();
+    *rsp = st;
+
+    if (app && !mmc) {
+        emu_stats.acmd++;
+        st |= R1_APP_CMD;
+        *rsp = st;
+        switch (cmd) {
+        case 6:
+            c->width = ((arg & 3) == 2) ? 4 : 1;
+            return RSP_SHORT;
+        case 13:
+            sdio_read_start(sd_status, sizeof(sd_status), 0, 1);
+            return RSP_SHORT;
+        case 23:
+            return RSP_SHORT;
+        case 41:
+            if (c->state != EMU_ST_IDLE) {
+                return RSP_NONE;
+            }
+            if (++c->polls >= emu_cfg.init_polls &&
+                (emu_cfg.type != EMU_CARD_SDHC || (arg & 0x40000000UL))) {
+                c->ocr |= 0x80000000UL;
+                c->state = EMU_ST_READY;
+            }
+            *rsp = c->ocr;
+            return RSP_SHORT;
+        case 51:
+            sdio_read_start(c->scr, 8, 0, 1);
+            return RSP_SHORT;
+        default:
+            break;
+        }
+        /* not an ACMD, handled as the plain command */
+    }
+
+    switch (cmd) {
+    case 0:
+        emu_card_reset();
+        sdio_open = 0;
+        xfer.dir = XFER_NONE;
+        return RSP_NONE;
+    case 1:
+        if (!mmc || c->state != EMU_ST_IDLE) {
+            return RSP_NONE;
+        }
+        if (++c->polls >= emu_cfg.init_polls) {
+            c->ocr |= 0x80000000UL;
+            c->state = EMU_ST_READY;
+        }
+        *rsp = c->ocr;
+        return RSP_SHORT;
+    case 2:
+        if (c->state != EMU_ST_READY) {
+            return RSP_NONE;
+        }
+        c->state = EMU_ST_IDENT;
+        *reg = c->cid;
+        return RSP_LONG;
+    case 3:
+        if (c->state != EMU_ST_IDENT && c->state != EMU_ST_STBY) {
+            return RSP_NONE;
+        }
+        c->state = EMU_ST_STBY;
+        if (mmc) {
+            c->rca = arg >> 16;
+        } else {
+            c->rca = SD_RCA;
+            /* R6, status bits 23/22/19 fold into 15/14/13 */
+            *rsp = ((uint32_t)c->rca << 16) | (st & 0x1FFF);
+        }
+        return RSP_SHORT;
+    case 6:
+        if (c->state != EMU_ST_TRAN) {
+            return RSP_NONE;
+        }
+        if (mmc) {
+            *rsp |= sdio_mmc_switch(arg);
+            return RSP_SHORT;
+        }
+        memset(switch_status, 0, sizeof(switch_status));
+        switch_status[1] = 0x64;                /* max current */
+        switch_status[13] = 0x03;               /* group 1 supports default and high speed */
+        switch_status[16] = arg & 0x0F;
+        if ((arg & 0x80000000UL) && (arg & 0x0F) == 1) {
+            c->hs = 1;
+        }
+        sdio_read_start(switch_status, sizeof(switch_status), 0, 1);
+        return RSP_SHORT;
+    case 7:
+        if ((arg >> 16) != c->rca) {
+            if (c->state == EMU_ST_TRAN) {
+                c->state = EMU_ST_STBY;
+            }
+            return mmc ? RSP_SHORT : RSP_NONE;
+        }
+        if (c->state == EMU_ST_STBY) {
+            c->state = EMU_ST_TRAN;
+        }
+        return RSP_SHORT;
+    case 8:
+        if (!mmc) {
+            if (c->state != EMU_ST_IDLE) {
+                return RSP_NONE;
+            }
+            *rsp = arg & 0xFFF;
+            return RSP_SHORT;
+        }
+        if (c->state != EMU_ST_TRAN) {
+            return RSP_NONE;
+        }
+        sdio_read_start(c->ext_csd, sizeof(c->ext_csd), 0, 1);
+        return RSP_SHORT;
+    case 9:
+    case 10:
+        if (c->state != EMU_ST_STBY) {
+            return RSP_NONE;
+        }
+        *reg = (cmd == 9) ? c->csd : c->cid;
+        return RSP_LONG;
+    case 12:
+        if (sdio_open || xfer.dir != XFER_NONE) {
+            sdio_open = 0;
+            xfer.dir = XFER_NONE;
+            if (c->state == EMU_ST_RCV) {
+                emu_card_program(emu_cfg.wr_stop_us);
+            }
+            c->state = EMU_ST_TRAN;
+        } else if (emu_cfg.strict) {
+            return RSP_NONE;
+        } else {
+            emu_stats.implicit++;
+        }
+        return RSP_SHORT;
+    case 13:
+        return RSP_SHORT;
+    case 16:
+        /* the block length is fixed at 512 in DDR52, CMD16 is illegal there */
+        if (c->state != EMU_ST_TRAN || sdio_card_ddr()) {
+            return RSP_NONE;
+        }
+        if (emu_cfg.type != EMU_CARD_SDHC && arg >= 1 && arg <= 512) {
+            c->blocklen = arg;
+        }
+        return RSP_SHORT;
+    case 17:
+    case 18:
+        if (c->state != EMU_ST_TRAN) {
+            return RSP_NONE;
+        }
+        ok = emu_card_offset(arg, (emu_cfg.type == EMU_CARD_SDHC) ? 512 : c->blocklen, &off) == 0;
+        if (!ok) {
+            *rsp |= R1_OUT_OF_RANGE;
+        }
+        sdio_open = (cmd == 18 && c->preset == 0 && ok);
+        c->preset = 0;
+        c->packed = 0;
+        c->state = sdio_open ? EMU_ST_DATA : EMU_ST_TRAN;
+        sdio_read_start(NULL, 0, off, ok);
+        return RSP_SHORT;
+    case 23:
+        if (c->state != EMU_ST_TRAN || (!mmc && !(c->scr[3] & 0x02))) {
+            return RSP_NONE;
+        }
+        c->preset = arg & 0xFFFF;
+        c->packed = mmc && (arg & 0x40000000UL);
+        return RSP_SHORT;
+    case 24:
+    case 25:
+        if (c->state != EMU_ST_TRAN) {
+            return RSP_NONE;
+        }
+        if (emu_card_offset(arg, (emu_cfg.type == EMU_CARD_SDHC) ? 512 : c->blocklen, &off) != 0) {
+            *rsp |= R1_OUT_OF_RANGE;
+            return RSP_SHORT;
+        }
+        sdio_open = (cmd == 25 && c->preset == 0);
+        c->preset = 0;
+        sdio_write_start(cmd, off, busy);
+        c->packed = 0;
+        return RSP_SHORT;
+    case 32:
+    case 35:
+        c->erase_start = arg;
+        return RSP_SHORT;
+    case 33:
+    case 36:
+        c->erase_end = arg;
+        return RSP_SHORT;
+    case 38:
+        emu_card_erase();
+        return RSP_SHORT;
+    case 55:
+        c->app = 1;
+        *rsp |= R1_APP_CMD;
+        return RSP_SHORT;
+    default:
+        return RSP_NONE;
+    }
+}
+
+/**
+  * \brief  Host replacement of SDIO_SendCommand.
+  * \details The real function programs CMD_ARG/CMD_OP and pulses START, the
+  *          card model then answers through RSP0..3 and STATUS.
+  */
+void __real_SDIO_SendCommand(SDIO_TypeDef *SDIOx, SDIO_CmdInitTypeDef *SDIO_CmdInitStruct);
+void __wrap_SDIO_SendCommand(SDIO_TypeDef *SDIOx, SDIO_CmdInitTypeDef *SDIO_CmdInitStruct)
+{
+    uint32_t op;
+    uint8_t cmd;
+    uint8_t kind;
+    uint32_t rsp = 0;
+    const uint8_t *reg = NULL;
+    uint32_t bits = 48 + 8;
+
+    __real_SDIO_SendCommand(SDIOx, SDIO_CmdInitStruct);
+    if (SDIOx != SDIO0) {
+        return;
+    }
+    SDIOx->START = 0;
+    SDIOx->STATUS = 0;
+    op = SDIOx->CMD_OP;
+    cmd = (op & SDIO_CMD_OP_INDEX_MASK) >> SDIO_CMD_OP_INDEX_OFS;
+
+    if (op & SDIO_CMD_OP_POWER_UP) {
+        bits += 74;
+    }
+    if (op & SDIO_CMD_OP_RSP) {
+        bits += (op & SDIO_CMD_OP_RSP_LEN) ? 136 : 48;
+    }
+    emu_stats.bus_ns += emu_bits_ns(bits, sdio_hz());
+    emu_advance(emu_bits_ns(bits, sdio_hz()));
+
+    kind = sdio_command(cmd, SDIOx->CMD_ARG, (op & SDIO_CMD_OP_BUSY) ? 1 : 0, &rsp, &reg);
+
+    if (!(op & SDIO_CMD_OP_RSP)) {
+        if (xfer.dir == XFER_NONE) {
+            SDIOx->STATUS |= SDIO_STATUS_EOT;
+        }
+        return;
+    }
+    if (kind == RSP_NONE) {
+        SDIOx->STATUS |= SDIO_STATUS_EOT | SDIO_STATUS_ERR | SDIO_STATUS_CMD_ERR_TIMEOUT;
+        return;
+    }
+    if (kind == RSP_LONG) {
+        SDIOx->RSP3 = ((uint32_t)reg[0] << 24) | ((uint32_t)reg[1] << 16) | ((uint32_t)reg[2] << 8) | reg[3];
+        SDIOx->RSP2 = ((uint32_t)reg[4] << 24) | ((uint32_t)reg[5] << 16) | ((uint32_t)reg[6] << 8) | reg[7];
+        SDIOx->RSP1 = ((uint32_t)reg[8] << 24) | ((uint32_t)reg[9] << 16) | ((uint32_t)reg[10] << 8) | reg[11];
+        SDIOx->RSP0 = ((uint32_t)reg[12] << 24) | ((uint32_t)reg[13] << 16) | ((uint32_t)reg[14] << 8) | reg[15];
+    } else {
+        SDIOx->RSP0 = rsp;
+        SDIOx->RSP1 = (cmd == 1 || cmd == 41) ? 0x3F : cmd;
+        SDIOx->RSP2 = 0;
+        SDIOx->RSP3 = 0;
+    }
+    if (xfer.dir != XFER_NONE) {
+        /* EOT follows the data phase */
+        return;
+    }
+    if (op & SDIO_CMD_OP_BUSY) {
+        emu_card_wait();
+    }
+    SDIOx->STATUS |= SDIO_STATUS_EOT;
+}
+
+/**
+  * \brief  Host replacement of SDIO_DMA_Config, the armed channel runs to completion at once.
+  */
+void __real_SDIO_DMA_Config(SDIO_TypeDef *SDIOx, SDIO_DmaCfgTypeDef *SDIO_DmaCfgStruct);
+void __wrap_SDIO_DMA_Config(SDIO_TypeDef *SDIOx, SDIO_DmaCfgTypeDef *SDIO_DmaCfgStruct)
+{
+    __real_SDIO_DMA_Config(SDIOx, SDIO_DmaCfgStruct);
+    if (SDIOx != SDIO0) {
+        return;
+    }
+    sdio_rx_dma();
+    sdio_tx_dma();
+}
+
+/**
+  * \brief  Host replacement of SDIO_ClearFlag, STATUS flags are write 1 to clear.
+  */
+void __wrap_SDIO_ClearFlag(SDIO_TypeDef *SDIOx, uint32_t status)
+{
+    SDIOx->STATUS &= ~status;
+}
+
+/**
+  * \brief  Host replacement of SDIO_ReadData, pops one word of the receive FIFO.
+  */
+uint32_t __wrap_SDIO_ReadData(SDIO_TypeDef *SDIOx)
+{
+    uint32_t w = 0;
+
+    if (SDIOx != SDIO0 || xfer.dir != XFER_READ) {
+        return 0;
+    }
+    memcpy(&w, xfer.buf + xfer.pos, 4);
+    xfer.pos += 4;
+    if (xfer.pos >= xfer.len) {
+        xfer.pos = xfer.len;
+        sdio_done();
+    }
+    return w;
+}
+
+/**
+  * \brief  Host replacement of SDIO_SendData, pushes one word into the transmit FIFO.
+  */
+void __wrap_SDIO_SendData(SDIO_TypeDef *SDIOx, uint32_t data)
+{
+    if (SDIOx != SDIO0 || xfer.dir != XFER_WRITE) {
+        return;
+    }
+    memcpy(xfer.buf + xfer.pos, &data, 4);
+    xfer.pos += 4;
+    if (xfer.pos >= xfer.len) {
+        xfer.pos = xfer.len;
+        sdio_write_commit();
+    }
+}
+
+/**
+  * \brief  Host replacement of SDIO_DmaGetIntStat, a running ring advances until the polled bit is set.
+  */
+uint32_t __wrap_SDIO_DmaGetIntStat(UDMA_P2M_CHx_Irq_TypeDef *SDIO_DMA, SDIO_DmaIntStatTypedef status)
+{
+    if (SDIO_DMA == SDIO0_DMA_SDIO0_P2M_IRQ && !(SDIO_DMA->CHX_IRQ_STAT & status)) {
+        emu_sdio_dma_step();
+    }
+    return SDIO_DMA->CHX_IRQ_STAT & status;
+}
+
+/**
+  * \brief  Host replacement of SDIO_DmaInterruptClr, IRQ status is write 1 to clear.
+  */
+uint32_t __wrap_SDIO_DmaInterruptClr(UDMA_P2M_CHx_Irq_TypeDef *SDIO_DMA, SDIO_DmaIntClrTypedef interrupt_clr)
+{
+    SDIO_DMA->CHX_IRQ_STAT &= ~(uint32_t)interrupt_clr;
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+  * \file emu_soc.c
+  * \brief peripheral windows, virtual clock and board helpers of the host emulator
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "ns.h"
+#include "ns_sdio.h"
+#include "ns_udma.h"
+#include "emu.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+volatile uint32_t SystemCoreClock = 50000000;
+volatile uint64_t emu_now_ns;
+EMU_Stats emu_stats;
+
+/* handlers installed with ECLIC_Register_IRQ and the global enable */
+static void (*emu_handler[64])(void);
+static uint8_t emu_mie;
+
+/* register windows the drivers dereference directly */
+static const struct {
+    uintptr_t base;
+    size_t size;
+} emu_windows[] = {
+    { QSPI1_BASE, 0x1000 },
+    { SDIO0_BASE, 0x2000 },     /* SDIO0 and SDIO0_DMA */
+    { UDMA0_BASE, 0x1000 },     /* M2M channels */
+};
+
+#define EMU_WINDOW_NUM  (sizeof(emu_windows) / sizeof(emu_windows[0]))
+
+/**
+  * \brief  Map the peripheral windows at their SoC addresses and open the card image.
+  * \retval 0 on success, -1 on failure
+  */
+int emu_init(void)
+{
+    uint32_t i;
+    void *p;
+
+    if ((uintptr_t)&emu_now_ns > 0xFFFFFFFFUL) {
+        fprintf(stderr, "emu: data above 4GB, rebuild with -no-pie so ADDR32() keeps DMA buffers intact\n");
+        return -1;
+    }
+    for (i = 0; i < EMU_WINDOW_NUM; i++) {
+        p = mmap((void *)emu_windows[i].base, emu_windows[i].size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != (void *)emu_windows[i].base) {
+            fprintf(stderr, "emu: cannot map 0x%08lx: %s\n", (unsigned long)emu_windows[i].base, strerror(errno));
+            return -1;
+        }
+    }
+    memset(&emu_stats, 0, sizeof(emu_stats));
+    emu_now_ns = 0;
+    if (emu_card_open() != 0) {
+        return -1;
+    }
+    emu_spi_reset();
+    emu_sdio_reset();
+    emu_flash_reset();
+    return 0;
+}
+
+/**
+  * \brief  Flush the card image and release the peripheral windows.
+  */
+void emu_exit(void)
+{
+    uint32_t i;
+
+    emu_card_close();
+    for (i = 0; i < EMU_WINDOW_NUM; i++) {
+        munmap((void *)emu_windows[i].base, emu_windows[i].size);
+    }
+}
+
+/**
+  * \brief  Advance the virtual clock.
+  * \param  ns nanoseconds
+  */
+void emu_advance(uint64_t ns)
+{
+    emu_now_ns += ns;
+}
+
+/**
+  * \brief  Time needed to clock a number of bits.
+  * \param  bits bit count
+  * \param  hz bus clock
+  * \retval nanoseconds, rounded up
+  */
+uint64_t emu_bits_ns(uint64_t bits, uint32_t hz)
+{
+    if (hz == 0) {
+        return 0;
+    }
+    return (bits * 1000000000ULL + hz - 1) / hz;
+}
+
+/**
+  * \brief  Recover a host pointer from the 32-bit DMA address the drivers program.
+  * \details Data and heap live below 4GB in a -no-pie build, only stack
+  *          buffers need their upper half restored.
+  * \param  addr value written to the DMA address register
+  * \retval host pointer
+  */
+void *emu_ptr(uint32_t addr)
+{
+    uintptr_t sp = (uintptr_t)&addr;
+    uintptr_t cand = (sp & ~(uintptr_t)0xFFFFFFFFUL) | addr;
+
+    if (cand > sp && cand - sp < (64UL << 20)) {
+        return (void *)cand;
+    }
+    return (void *)(uintptr_t)addr;
+}
+
+/**
+  * \brief  Board delay, only moves the virtual clock.
+  * \param  count milliseconds
+  */
+void delay_1ms(uint32_t count)
+{
+    emu_stats.delay_ns += (uint64_t)count * 1000000ULL;
+    emu_advance((uint64_t)count * 1000000ULL);
+}
+
+/**
+  * \brief  Host replacement of the ECLIC setup, records the handler.
+  * \retval 0 on success, -1 for an IRQ the model has no line for
+  */
+int32_t ECLIC_Register_IRQ(IRQn_Type IRQn, uint8_t shv, ECLIC_TRIGGER_Type trig_mode, uint8_t lvl,
+                           uint8_t priority, void *handler)
+{
+    (void)shv;
+    (void)trig_mode;
+    (void)lvl;
+    (void)priority;
+    if (IRQn != SDIO0_IRQn && IRQn != SDIO0_DMA_IRQn) {
+        return -1;
+    }
+    emu_handler[IRQn] = (void (*)(void))handler;
+    return 0;
+}
+
+/* level of the SDIO0 and SDIO0 DMA interrupt lines */
+static uint8_t emu_irq_pending(IRQn_Type IRQn)
+{
+    if (emu_handler[IRQn] == NULL) {
+        return 0;
+    }
+    if (IRQn == SDIO0_IRQn) {
+        return ((SDIO0->IE & SDIO_IE_EOT_IRQ) && (SDIO0->STATUS & SDIO_STATUS_EOT)) ||
+               ((SDIO0->IE & SDIO_IE_ERR_IRQ) && (SDIO0->STATUS & SDIO_STATUS_ERR));
+    }
+    return (SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_EN & SDIO0_DMA_SDIO0_P2M_IRQ->CHX_IRQ_STAT) != 0;
+}
+
+/* run the handlers of all pending lines, returns how many were taken */
+static uint32_t emu_irq_dispatch(void)
+{
+    static const IRQn_Type lines[] = { SDIO0_DMA_IRQn, SDIO0_IRQn };
+    uint32_t i, n = 0;
+
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        if (emu_irq_pending(lines[i])) {
+            emu_stats.irqs++;
+            emu_mie = 0;
+            emu_handler[lines[i]]();
+            emu_mie = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+void emu_irq_enable(void)
+{
+    emu_mie = 1;
+    emu_irq_dispatch();
+}
+
+void emu_irq_disable(void)
+{
+    emu_mie = 0;
+}
+
+/**
+  * \brief  WFI, returns once an interrupt line is pending.
+  * \details The model completes transfers synchronously, only a continuous
+  *          mode DMA ring still has data to move. A WFI with no line pending
+  *          after that would never wake up on the board either.
+  */
+void emu_wfi(void)
+{
+    emu_stats.wfi++;
+    if (!emu_irq_pending(SDIO0_IRQn) && !emu_irq_pending(SDIO0_DMA_IRQn)) {
+        emu_sdio_dma_step();
+    }
+    if (emu_irq_pending(SDIO0_IRQn) || emu_irq_pending(SDIO0_DMA_IRQn)) {
+        if (emu_mie) {
+            emu_irq_dispatch();
+        }
+        return;
+    }
+    fprintf(stderr, "emu: WFI with no interrupt pending, the driver would hang here\n");
+    abort();
+}
+
+/**
+  * \brief  Host replacement of M2M_DMA_Cmd, an enabled channel copies at once.
+  * \details MSIZE counts source width units. FTRANS is set and TRANS_EN
+  *          dropped, as the channel does when the transfer is complete.
+  */
+void __real_M2M_DMA_Cmd(UDMA_CHxCfg_TypeDef *UDMAy_CHannelx, ControlStatus Status);
+void __wrap_M2M_DMA_Cmd(UDMA_CHxCfg_TypeDef *UDMAy_CHannelx, ControlStatus Status)
+{
+    UDMA_CHx_IRQ_TypeDef *irq = (UDMAy_CHannelx == UDMA0_M2M_CH0) ? UDMA0_CH0_M2M_IRQ : UDMA0_CH1_M2M_IRQ;
+    uint32_t unit;
+
+    __real_M2M_DMA_Cmd(UDMAy_CHannelx, Status);
+    if (Status != ENABLE) {
+        return;
+    }
+    unit = 1U << ((UDMAy_CHannelx->MCTRL & UDMA_CH0_CFG_MCTRL_MSWIDTH_MASK) >> UDMA_CH0_CFG_MCTRL_MSWIDTH_OFS);
+    memmove(emu_ptr(UDMAy_CHannelx->MDSTADDR), emu_ptr(UDMAy_CHannelx->MSRCADDR), UDMAy_CHannelx->MSIZE * unit);
+    emu_stats.m2m_bytes += UDMAy_CHannelx->MSIZE * unit;
+    UDMAy_CHannelx->MCTRL &= ~UDMA_TRANS_ENABLE;
+    irq->CHX_IRQ_STAT = UDMA_CH0_IRQ_STAT_FTRANS;
+}
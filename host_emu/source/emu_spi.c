@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2019 Nuclei Limited. All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+  * \file emu_spi.c
+  * \brief SPI mode front end of the card model, sits behind QSPI1
+  * \details Linked with -Wl,--wrap=QSPI_TransmitReceive, every byte the
+  *          driver exchanges goes through the card state machine below.
+  *          CSID and SCKDIV are read from the mapped QSPI1 window.
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "ns.h"
+#include "ns_qspi.h"
+#include "emu.h"
+
+#define SPI_R1_IDLE         0x01
+#define SPI_R1_ILLEGAL      0x04
+#define SPI_R1_CRC          0x08
+#define SPI_R1_ADDRESS      0x20
+#define SPI_R1_PARAM        0x40
+
+#define SPI_TOKEN_SINGLE    0xFE
+#define SPI_TOKEN_MULTI     0xFC
+#define SPI_TOKEN_STOP      0xFD
+
+#define SPI_TX_FIFO         8       /* QSPI transmit FIFO entries */
+#define SPI_STORE_CYCLES    4       /* core cycles of one TX_FULL poll and store */
+
+enum {
+    SPI_IDLE = 0,
+    SPI_READ,           /* streaming data packets to the host */
+    SPI_WRITE,          /* waiting for or receiving data packets */
+};
+
+static struct {
+    uint8_t frame[6];
+    uint8_t flen;
+    uint8_t out[8];
+    uint8_t olen;
+    uint8_t opos;
+    uint8_t mode;
+    uint8_t multi;
+    uint8_t reg;                /* current read is a CSD/CID/SCR register */
+    uint8_t rx;                 /* a write data packet is being received */
+    uint32_t left;              /* blocks left of a CMD23 read, 0 while open ended */
+    uint64_t off;
+    uint64_t ready_at;
+    uint8_t pkt[1 + 512 + 2];
+    uint16_t plen;
+    uint16_t ppos;
+    uint64_t tx_done;           /* queued transmit only frames are on the wire until then */
+} spi;
+
+void emu_spi_reset(void)
+{
+    memset(&spi, 0, sizeof(spi));
+}
+
+/**
+  * \brief  Wait for frames queued by QSPI_SendData to leave, what the driver
+  *         does by polling BUSY before the next exchange or chip select change.
+  */
+void emu_spi_drain(void)
+{
+    if (spi.tx_done > emu_now_ns) {
+        emu_advance(spi.tx_done - emu_now_ns);
+    }
+}
+
+static uint32_t spi_hz(void)
+{
+    return SystemCoreClock / (2 * ((QSPI1->SCKDIV & 0xFFF) + 1));
+}
+
+/* clocks of one byte frame, PROTO selects one, two or four data lines */
+static uint32_t spi_frame_bits(void)
+{
+    switch (QSPI1->FMT & QSPI_FMT_PROTO_MASK) {
+    case QSPI_FMT_PROTO_DUAL:
+        return 4;
+    case QSPI_FMT_PROTO_QUAD:
+        return 2;
+    default:
+        return 8;
+    }
+}
+
+/**
+  * \brief  Time of a number of QSPI1 clock cycles at the current divider.
+  */
+uint64_t emu_spi_clocks_ns(uint64_t clocks)
+{
+    return emu_bits_ns(clocks, spi_hz());
+}
+
+static uint8_t spi_overclocked(void)
+{
+    return emu_cfg.spi_max_hz && spi_hz() > emu_cfg.spi_max_hz;
+}
+
+/* injected CRC error, every emu_cfg.fault_every-th data block of the image */
+static uint8_t spi_fault(void)
+{
+    static uint32_t n;
+
+    return emu_cfg.fault_every && ++n % emu_cfg.fault_every == 0;
+}
+
+static void spi_queue(const uint8_t *buf, uint8_t len)
+{
+    memcpy(spi.out, buf, len);
+    spi.olen = len;
+    spi.opos = 0;
+}
+
+static void spi_read_start(uint64_t off, uint8_t multi, uint8_t reg)
+{
+    spi.mode = SPI_READ;
+    spi.off = off;
+    spi.multi = multi;
+    spi.reg = reg;
+    spi.left = multi ? emu_card.preset : 0;
+    spi.plen = 0;
+    spi.ppos = 0;
+    spi.ready_at = emu_now_ns + (reg ? 0 : (uint64_t)emu_cfg.rd_access_us * 1000ULL);
+}
+
+/* build the next data packet, token + payload + CRC16 */
+static void spi_read_packet(void)
+{
+    uint16_t len = (spi.reg == 51) ? 8 : spi.reg ? 16 : 512;
+    uint16_t crc;
+
+    spi.pkt[0] = SPI_TOKEN_SINGLE;
+    if (spi.reg == 51) {
+        memcpy(&spi.pkt[1], emu_card.scr, 8);
+    } else if (spi.reg) {
+        memcpy(&spi.pkt[1], (spi.reg == 9) ? emu_card.csd : emu_card.cid, 16);
+    } else {
+        emu_card_read(spi.off, &spi.pkt[1], 512);
+    }
+    crc = emu_crc16(&spi.pkt[1], len);
+    spi.pkt[1 + len] = crc >> 8;
+    spi.pkt[2 + len] = crc & 0xFF;
+    if (spi_overclocked() || (spi.reg == 0 && spi_fault())) {
+        spi.pkt[1 + (emu_stats.crc_errors % len)] ^= 0x10;
+        emu_stats.crc_errors++;
+    }
+    spi.plen = len + 3;
+    spi.ppos = 0;
+}
+
+static uint8_t spi_read_byte(void)
+{
+    uint8_t b;
+
+    if (spi.ppos == spi.plen) {
+        if (emu_now_ns < spi.ready_at) {
+            return 0xFF;
+        }
+        spi_read_packet();
+    }
+    b = spi.pkt[spi.ppos++];
+    if (spi.ppos == spi.plen) {
+        spi.plen = 0;
+        spi.ppos = 0;
+        if (spi.left != 0 && --spi.left == 0) {
+            /* block count preset with CMD23 reached, no CMD12 needed */
+            spi.mode = SPI_IDLE;
+        } else if (spi.multi && spi.off + 1024 <= emu_card.size) {
+            spi.off += 512;
+            spi.ready_at = emu_now_ns + (uint64_t)emu_cfg.rd_block_us * 1000ULL;
+        } else {
+            spi.mode = SPI_IDLE;
+        }
+    }
+    return b;
+}
+
+static void spi_write_byte(uint8_t mosi)
+{
+    uint8_t resp;
+
+    spi.pkt[spi.ppos++] = mosi;
+    if (spi.ppos < 512 + 2) {
+        return;
+    }
+    spi.rx = 0;
+    spi.ppos = 0;
+    if (spi_overclocked() || spi_fault()) {
+        emu_stats.crc_errors++;
+        resp = 0x0B;
+    } else {
+        emu_card_write(spi.off, spi.pkt, 512);
+        resp = 0x05;
+    }
+    spi_queue(&resp, 1);
+    if (spi.multi) {
+        if (spi.off + 1024 <= emu_card.size) {
+            spi.off += 512;
+        }
+        emu_card_program(emu_cfg.wr_block_us);
+    } else {
+        spi.mode = SPI_IDLE;
+        emu_card_program(emu_cfg.wr_single_us);
+    }
+}
+
+static void spi_command(void)
+{
+    EMU_Card *c = &emu_card;
+    uint8_t cmd = spi.frame[0] & 0x3F;
+    uint32_t arg = ((uint32_t)spi.frame[1] << 24) | ((uint32_t)spi.frame[2] << 16) |
+                   ((uint32_t)spi.frame[3] << 8) | spi.frame[4];
+    uint8_t app = c->app;
+    uint8_t r[6] = { 0xFF, 0, 0, 0, 0, 0 };
+    uint8_t rlen = 2;
+    uint64_t off;
+
+    if (spi.mode == SPI_WRITE && spi.multi) {
+        /* CMD25 still open, the card only looks for data and stop tran tokens */
+        emu_stats.implicit++;
+        if (emu_cfg.strict) {
+            return;
+        }
+        spi.mode = SPI_IDLE;
+    }
+    emu_stats.cmd[cmd]++;
+    c->app = 0;
+    r[1] = (c->state == EMU_ST_IDLE) ? SPI_R1_IDLE : 0;
+
+    /* CRC is only checked on CMD0 and CMD8 while CRC mode is off */
+    if ((cmd == 0 || cmd == 8) && (spi.frame[5] >> 1) != emu_crc7(spi.frame, 5)) {
+        r[1] |= SPI_R1_CRC;
+        spi_queue(r, rlen);
+        return;
+    }
+    if (app) {
+        emu_stats.acmd++;
+        switch (cmd) {
+        case 41:
+            if (emu_cfg.type == EMU_CARD_MMC) {
+                r[1] |= SPI_R1_ILLEGAL;
+                break;
+            }
+            if (++c->polls >= emu_cfg.init_polls) {
+                c->state = EMU_ST_TRAN;
+                c->ocr |= 0x80000000UL;
+                r[1] = 0;
+            }
+            break;
+        case 13:
+            rlen = 3;
+            break;
+        case 23:
+            break;
+        case 51:
+            if (emu_cfg.type == EMU_CARD_MMC) {
+                r[1] |= SPI_R1_ILLEGAL;
+            } else if (r[1] == 0) {
+                spi_read_start(0, 0, 51);
+            }
+            break;
+        default:
+            r[1] |= SPI_R1_ILLEGAL;
+            break;
+        }
+        spi_queue(r, rlen);
+        return;
+    }
+
+    switch (cmd) {
+    case 0:
+        emu_card_reset();
+        spi.mode = SPI_IDLE;
+        r[1] = SPI_R1_IDLE;
+        break;
+    case 1:
+        if (emu_cfg.type != EMU_CARD_MMC) {
+            r[1] |= SPI_R1_ILLEGAL;
+        } else if (++c->polls >= emu_cfg.init_polls) {
+            c->state = EMU_ST_TRAN;
+            c->ocr |= 0x80000000UL;
+            r[1] = 0;
+        }
+        break;
+    case 8:
+        if (emu_cfg.type == EMU_CARD_MMC) {
+            r[1] |= SPI_R1_ILLEGAL;
+            break;
+        }
+        r[4] = (arg >> 8) & 0x0F;
+        r[5] = arg & 0xFF;
+        rlen = 6;
+        break;
+    case 9:
+    case 10:
+        if (r[1] == 0) {
+            spi_read_start(0, 0, cmd);
+        }
+        break;
+    case 12:
+        if (spi.mode == SPI_READ) {
+            spi.mode = SPI_IDLE;
+        }
+        /* stuff byte, then R1 */
+        r[2] = r[1];
+        r[1] = 0xFF;
+        rlen = 3;
+        break;
+    case 13:
+        r[2] = 0;
+        rlen = 3;
+        break;
+    case 16:
+    case 59:
+        break;
+    case 23:
+        /* SD cards only take it when the SCR says so */
+        if (emu_cfg.type != EMU_CARD_MMC && !(c->scr[3] & 0x02)) {
+            r[1] |= SPI_R1_ILLEGAL;
+        } else {
+            c->preset = arg & 0xFFFF;
+        }
+        spi_queue(r, rlen);
+        return;
+    case 17:
+    case 18:
+        if (emu_card_offset(arg, 512, &off) != 0) {
+            r[1] |= SPI_R1_PARAM;
+        } else {
+            spi_read_start(off, cmd == 18, 0);
+        }
+        break;
+    case 24:
+    case 25:
+        if (emu_card_offset(arg, 512, &off) != 0) {
+            r[1] |= SPI_R1_PARAM;
+        } else {
+            spi.mode = SPI_WRITE;
+            spi.off = off;
+            spi.multi = (cmd == 25);
+            spi.rx = 0;
+            spi.ppos = 0;
+        }
+        break;
+    case 32:
+    case 35:
+        c->erase_start = arg;
+        break;
+    case 33:
+    case 36:
+        c->erase_end = arg;
+        break;
+    case 38:
+        emu_card_erase();
+        break;
+    case 55:
+        c->app = 1;
+        break;
+    case 58:
+        r[2] = c->ocr >> 24;
+        r[3] = (c->ocr >> 16) & 0xFF;
+        r[4] = (c->ocr >> 8) & 0xFF;
+        r[5] = c->ocr & 0xFF;
+        rlen = 6;
+        break;
+    default:
+        r[1] |= SPI_R1_ILLEGAL;
+        break;
+    }
+    /* a preset block count only applies to the command right after CMD23 */
+    c->preset = 0;
+    spi_queue(r, rlen);
+}
+
+/**
+  * \brief  Host replacement of QSPI_TransmitReceive for QSPI1.
+  * \param  QSPIx QSPI instance
+  * \param  pTxData byte shifted out on MOSI
+  * \param  pRxData byte sampled on MISO
+  */
+FlagStatus __wrap_QSPI_TransmitReceive(QSPI_TypeDef *QSPIx, uint8_t *pTxData, uint8_t *pRxData)
+{
+    uint8_t mosi = *pTxData;
+    uint8_t miso = 0xFF;
+    uint64_t ns;
+
+    if (QSPIx != QSPI1) {
+        *pRxData = 0xFF;
+        return SET;
+    }
+    emu_spi_drain();
+    ns = emu_bits_ns(spi_frame_bits(), spi_hz());
+    emu_stats.bus_ns += ns;
+    emu_stats.spi_bytes++;
+    emu_advance(ns + emu_bits_ns(emu_cfg.byte_cycles, SystemCoreClock));
+
+    if (!(QSPI1->CSID & QSPI_CSID_NUM_CS0)) {
+        /* deselected, the card drops a partial command frame */
+        spi.flen = 0;
+        *pRxData = 0xFF;
+        return SET;
+    }
+    if (emu_cfg.type == EMU_CARD_NOR) {
+        *pRxData = emu_flash_xfer(mosi);
+        return SET;
+    }
+
+    if (spi.opos < spi.olen) {
+        miso = spi.out[spi.opos++];
+    } else if (spi.mode == SPI_READ) {
+        miso = spi_read_byte();
+    } else if (emu_card_busy()) {
+        miso = 0x00;
+    }
+
+    if (spi.mode == SPI_WRITE && spi.rx) {
+        spi_write_byte(mosi);
+    } else if (spi.mode == SPI_WRITE && !emu_card_busy() &&
+               mosi == (spi.multi ? SPI_TOKEN_MULTI : SPI_TOKEN_SINGLE)) {
+        spi.rx = 1;
+        spi.ppos = 0;
+    } else if (spi.mode == SPI_WRITE && spi.multi && !emu_card_busy() && mosi == SPI_TOKEN_STOP) {
+        spi.mode = SPI_IDLE;
+        emu_card_program(emu_cfg.wr_stop_us);
+    } else if (spi.flen != 0) {
+        spi.frame[spi.flen++] = mosi;
+        if (spi.flen == 6) {
+            spi.flen = 0;
+            spi_command();
+        }
+    } else if ((mosi & 0xC0) == 0x40) {
+        spi.frame[0] = mosi;
+        spi.flen = 1;
+    }
+
+    *pRxData = miso;
+    return SET;
+}
+
+/**
+  * \brief  Host replacement of QSPI_SendData for QSPI1, a transmit only frame.
+  * \details Used for address and data phases that only transmit, only the
+  *          NOR flash model listens to these. The frame is queued in the
+  *          transmit FIFO, the core only stalls when the FIFO is full.
+  * \param  QSPIx QSPI instance
+  * \param  Data byte shifted out
+  */
+void __wrap_QSPI_SendData(QSPI_TypeDef *QSPIx, uint32_t Data)
+{
+    uint64_t ns, start;
+
+    if (QSPIx != QSPI1) {
+        return;
+    }
+    ns = emu_bits_ns(spi_frame_bits(), spi_hz());
+    emu_stats.bus_ns += ns;
+    emu_stats.spi_bytes++;
+    start = spi.tx_done > emu_now_ns ? spi.tx_done : emu_now_ns;
+    if (start > emu_now_ns + (SPI_TX_FIFO - 1) * ns) {
+        emu_advance(start - emu_now_ns - (SPI_TX_FIFO - 1) * ns);
+    }
+    spi.tx_done = start + ns;
+    emu_advance(emu_bits_ns(SPI_STORE_CYCLES, SystemCoreClock));
+    if ((QSPI1->CSID & QSPI_CSID_NUM_CS0) && emu_cfg.type == EMU_CARD_NOR) {
+        emu_flash_xfer((uint8_t)Data);
+    }
+}
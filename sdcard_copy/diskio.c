@@ -45,12 +45,7 @@ DRESULT disk_read (
 	switch(pdrv)
 	{
 		case SDMMC_CARD:
-			res=SDMMC_ReadDisk(SDIO0, buff, sector, count);
-			while(res)
-			{
-                SDMMC_Init(SDIO0);
-				res=SDMMC_ReadDisk(SDIO0, buff, sector, count);
-			}
+			res=SDMMC_ReadDiskRetry(SDIO0, buff, sector, count);
 			break;
 		default:
 			res=1;
@@ -72,12 +67,7 @@ DRESULT disk_write (
 	switch(pdrv)
 	{
 		case SDMMC_CARD:
-			res=SDMMC_WriteDisk(SDIO0, (uint8_t*)buff, sector, count);
-			while(res)
-			{
-				SDMMC_Init(SDIO0);	
-				res=SDMMC_WriteDisk(SDIO0, (uint8_t*)buff, sector, count);
-			}
+			res=SDMMC_WriteDiskRetry(SDIO0, (uint8_t*)buff, sector, count);
 			break;
 		default:
 			res=1;
@@ -103,6 +93,9 @@ DRESULT disk_ioctl (
 		    case CTRL_SYNC:
 				res = RES_OK;
 		        break;
+		    case CTRL_TRIM:
+				res = (SDMMC_Erase(SDIO0, ((LBA_t*)buff)[0], ((LBA_t*)buff)[1]) == SDMMC_OK) ? RES_OK : RES_ERROR;
+		        break;
 		    case GET_SECTOR_SIZE:
 				*(DWORD*)buff = 512;
 		        res = RES_OK;
@@ -51,6 +51,8 @@ void sdio_config(void)
     SDIO_StopClkEn(SDIO0, ENABLE);
     SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, RX_FTRANS_IRQ_EN, ENABLE);
     SDIO_DmaInterruptEn(SDIO0_DMA_SDIO0_P2M_IRQ, TX_FTRANS_IRQ_EN, ENABLE);
+    /* DMA and end of transfer wake the core from WFI instead of being polled */
+    SDMMC_IrqInit(SDIO0);
 }
 
 __attribute__ ((aligned (4))) uint8_t buffer_all[FATFS_WR_SIZE];
@@ -84,6 +86,9 @@ void copyfile(uint8_t * srcfilename, uint8_t * destfilename)
     f_close(&file_src);
     f_close(&file_dest);
     printf("\r\ncopyfile finish\r\n");
+    printf("retries %u, reinits %u, step downs %u, failures %u, max attempts %u\r\n",
+           SDMMC_Retry.Retries, SDMMC_Retry.Reinits, SDMMC_Retry.StepDowns,
+           SDMMC_Retry.Failures, SDMMC_Retry.MaxAttempts);
 }
 
 int main(void)
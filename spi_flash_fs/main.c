@@ -114,8 +114,8 @@ int main(void)
     BYTE work[FF_MAX_SS]; /* Working buffer */
 
     MKFS_PARM fs_parm = {
-        /* filesystem parameter: format = FAT32, other use default val */
-        .fmt = FS_FAT32, .n_fat = 0, .au_size = 0, .align = 0, .n_root = 0,
+        /* filesystem parameter: format = FAT32, laid out on erase blocks (GET_BLOCK_SIZE), other use default val */
+        .fmt = FS_FAT32 | FM_ERASE, .n_fat = 0, .au_size = 0, .align = 0, .n_root = 0,
     };
 
 #ifdef MISC_HAS_QSPI1_HAS_CLK
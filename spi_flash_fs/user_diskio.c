@@ -37,7 +37,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "diskio.h"        /* Declarations of disk functions */
 #include "ns_sdk_hal.h"
-#include "w25qxx.h"
+#include "w25qxx_ftl.h"
 
 
 static volatile DSTATUS Stat = STA_NOINIT;
@@ -46,9 +46,34 @@ static volatile DSTATUS Stat = STA_NOINIT;
 
 #define EX_FLASH  0
 
+/* 1: sectors go through the translation layer in w25qxx_ftl.c
+ * 0: sectors map straight onto the flash behind the 4KB write-back cache */
+#ifndef SPI_FLASH_USE_FTL
+#define SPI_FLASH_USE_FTL         1
+#endif
+
+/* 1: reads are copied from the memory mapped window of the controller, program
+ *    and erase switch it back to register mode for their commands */
+#ifndef SPI_FLASH_USE_XIP
+#define SPI_FLASH_USE_XIP         0
+#endif
+#ifndef SPI_FLASH_XIP_WINDOW
+#define SPI_FLASH_XIP_WINDOW      QSPI_FLASH_BASE
+#endif
+
 #define SPI_FLASH_SECTOR_SIZE     512
-#define SPI_FLASH_SECTOR_COUNT    4096
+#if SPI_FLASH_USE_FTL
+#define SPI_FLASH_SECTOR_COUNT    W25QXX_FTL_SECTORS
+#else
+#define SPI_FLASH_SECTOR_COUNT    (W25QXX_Info.Size / SPI_FLASH_SECTOR_SIZE)    /* whole chip, from SFDP */
+#endif
+/* erase block in sectors, f_mkfs lays the volume out on it. The translation
+ * layer writes single sectors anywhere, there is nothing to align to. */
+#if SPI_FLASH_USE_FTL
 #define SPI_FLASH_BLOCK_SIZE      1
+#else
+#define SPI_FLASH_BLOCK_SIZE      (4096 / SPI_FLASH_SECTOR_SIZE)
+#endif
 
 DSTATUS disk_status (
     BYTE pdrv                /* Physical drive nmuber to identify the drive */
@@ -66,6 +91,12 @@ DSTATUS disk_initialize (
     {
         case EX_FLASH:
             W25QXX_Init(QSPI1);
+#if SPI_FLASH_USE_XIP
+            W25QXX_XIP_Init(QSPI1, SPI_FLASH_XIP_WINDOW);
+#endif
+#if SPI_FLASH_USE_FTL
+            res = W25QXX_FTL_Mount(QSPI1);
+#endif
             break;
         default:
             res=1;
@@ -87,13 +118,11 @@ DRESULT disk_read (
     switch(pdrv)
     {
         case EX_FLASH:
-            for(;count>0;count--)
-            {
-                W25QXX_Read(QSPI1, buff, sector*SPI_FLASH_SECTOR_SIZE, SPI_FLASH_SECTOR_SIZE);
-                sector++;
-                buff += SPI_FLASH_SECTOR_SIZE;
-            }
-            res=0;
+#if SPI_FLASH_USE_FTL
+            res = W25QXX_FTL_Read(QSPI1, buff, sector, count);
+#else
+            W25QXX_Cache_Read(QSPI1, buff, sector*SPI_FLASH_SECTOR_SIZE, count*SPI_FLASH_SECTOR_SIZE);
+#endif
             break;
 
         default:
@@ -117,13 +146,13 @@ DRESULT disk_write (
     {
 
         case EX_FLASH://外部flash
-            for(;count>0;count--)
-            {
-                W25QXX_Write(QSPI1, (uint8_t*)buff, sector*SPI_FLASH_SECTOR_SIZE, SPI_FLASH_SECTOR_SIZE);
-                sector++;
-                buff+=SPI_FLASH_SECTOR_SIZE;
-            }
-            res=0;
+#if SPI_FLASH_USE_FTL
+            /* appended to a pre-erased slot, no read-erase-write of the 4KB sector */
+            res = W25QXX_FTL_Write(QSPI1, buff, sector, count);
+#else
+            /* merged per 4KB erase sector, written back on eviction or CTRL_SYNC */
+            W25QXX_Cache_Write(QSPI1, buff, sector*SPI_FLASH_SECTOR_SIZE, count*SPI_FLASH_SECTOR_SIZE);
+#endif
             break;
 
         default:
@@ -145,14 +174,41 @@ DRESULT res;
         switch(cmd)
         {
             case CTRL_SYNC:
+#if !SPI_FLASH_USE_FTL
+                W25QXX_Cache_Flush(QSPI1);
+#endif
+                /* the last page program may still run */
+                W25QXX_Wait_Busy(QSPI1);
+                res = RES_OK;
+                break;
+            case CTRL_TRIM:
+#if SPI_FLASH_USE_FTL
+                /* retire the slots, W25QXX_FTL_Idle erases the units they free */
+                res = W25QXX_FTL_Trim(QSPI1, ((LBA_t*)buff)[0], ((LBA_t*)buff)[1]) ? RES_ERROR : RES_OK;
+#else
+                /* queue freed 4KB sectors, W25QXX_Erase_Idle erases them ahead of later writes */
+                W25QXX_Erase_Defer(QSPI1, ((LBA_t*)buff)[0]*SPI_FLASH_SECTOR_SIZE,
+                                   (((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1)*SPI_FLASH_SECTOR_SIZE);
                 res = RES_OK;
+#endif
+                break;
+            case CTRL_MMAP:
+#if SPI_FLASH_USE_XIP && !SPI_FLASH_USE_FTL
+                /* sectors sit linearly in the window, valid until the next write or erase */
+                ((DMMAP*)buff)->addr = W25QXX_XIP_Map(QSPI1, ((DMMAP*)buff)->sector*SPI_FLASH_SECTOR_SIZE,
+                                                      ((DMMAP*)buff)->count*SPI_FLASH_SECTOR_SIZE);
+                res = ((DMMAP*)buff)->addr ? RES_OK : RES_ERROR;
+#else
+                /* the translation layer scatters sectors over the flash */
+                res = RES_PARERR;
+#endif
                 break;
             case GET_SECTOR_SIZE:
                 *(WORD*)buff = SPI_FLASH_SECTOR_SIZE;
                 res = RES_OK;
                 break;
             case GET_BLOCK_SIZE:
-                *(WORD*)buff = SPI_FLASH_BLOCK_SIZE;
+                *(DWORD*)buff = SPI_FLASH_BLOCK_SIZE;
                 res = RES_OK;
                 break;
             case GET_SECTOR_COUNT:
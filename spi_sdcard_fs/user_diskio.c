@@ -128,9 +128,8 @@ DSTATUS disk_initialize (
     res = SD_init(QSPI1);
             if(res)
             {
-                SPI_setspeed(QSPI1, QSPI_SCKDIV_PRESCALER_64);
+                SPI_setspeed(QSPI1, SD_SPI_INIT_PRESCALER);
                 spi_readwrite(QSPI1,0xff);
-                SPI_setspeed(QSPI1, QSPI_SCKDIV_PRESCALER_8);
             }
     if(res)return  STA_NOINIT;
     else return RES_OK;
@@ -185,9 +184,13 @@ DRESULT disk_read (
     switch (pdrv)
     {
         case 0:
-            res=SD_ReadDisk(QSPI1,buff,sector,count);
+            /* CRC error or timeout: retried at a slower clock, which comes
+               back up after a run of clean transfers */
+            res=SD_ReadDiskRetry(QSPI1,buff,sector,count);
                 if(res == 0){
                     return RES_OK;
+                }else if(res == SD_ERR_BUSY){
+                    return RES_NOTRDY;
                 }else{
                     return RES_ERROR;
                 }
@@ -223,9 +226,11 @@ DRESULT disk_write (
     switch (pdrv)
     {
         case 0:
-            res=SD_WriteDisk(QSPI1, (uint8_t *)buff,sector,count);
+            res=SD_WriteDiskRetry(QSPI1, (uint8_t *)buff,sector,count);
                 if(res == 0){
                     return RES_OK;
+                }else if(res == SD_ERR_BUSY){
+                    return RES_NOTRDY;
                 }else{
                     return RES_ERROR;
                 }
@@ -254,12 +259,11 @@ DRESULT disk_ioctl (
     switch(cmd)
         {
             case CTRL_SYNC:
-                        SD_CS(QSPI1, 1);
-                        do{
-                            delay_1ms(20);
-                        }while(spi_readwrite(QSPI1, 0xFF)!=0xFF);
-                        res=RES_OK;
-                        SD_CS(QSPI1, 0);
+                        /* only waits if the last write is still being programmed */
+                        res = SD_Sync(QSPI1) ? RES_ERROR : RES_OK;
+                break;
+            case CTRL_TRIM:
+                res = SD_Erase(QSPI1, ((LBA_t*)buff)[0], ((LBA_t*)buff)[1]) ? RES_ERROR : RES_OK;
                 break;
             case GET_SECTOR_SIZE:
                 *(WORD*)buff = 512;